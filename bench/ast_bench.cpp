@@ -0,0 +1,129 @@
+// ASTの表現ごとのパースとcodegenの速さを測るベンチマーク。
+// parser.hのクラス階層(ClassASTBuilder)と、flatast.hの配列で表したAST(FlatASTBuilder)を比べる。
+// ./bench/ast_bench [file.mc]
+// ファイルを省略した場合は深くネストした式を持つ.mcファイルを生成して使う。
+#define MC_NO_MAIN
+#include "../src/mc.cpp"
+
+#include <random>
+
+static void generateExpr(std::mt19937 &Rng, int Depth, std::string &S) {
+    if (Depth == 0) {
+        S += Rng() % 2 ? "x" : std::to_string(Rng() % 1000);
+        return;
+    }
+    switch (Rng() % 4) {
+        case 0:
+            S += "if ";
+            generateExpr(Rng, Depth - 1, S);
+            S += " < y then ";
+            generateExpr(Rng, Depth - 1, S);
+            S += " else ";
+            generateExpr(Rng, Depth - 1, S);
+            return;
+        case 1:
+            S += "g(";
+            generateExpr(Rng, Depth - 1, S);
+            S += ", ";
+            generateExpr(Rng, Depth - 1, S);
+            S += ")";
+            return;
+        default:
+            S += "(";
+            generateExpr(Rng, Depth - 1, S);
+            S += "+-*"[Rng() % 3];
+            generateExpr(Rng, Depth - 1, S);
+            S += ")";
+            return;
+    }
+}
+
+static std::string generateSource(int NumDefs, int Depth) {
+    std::mt19937 Rng(42);
+    std::string S = "def g(a b) a - b\n";
+    for (int i = 0; i < NumDefs; ++i) {
+        S += "def f" + std::to_string(i) + "(x y)\n    ";
+        generateExpr(Rng, Depth, S);
+        S += "\n";
+    }
+    return S;
+}
+
+template <typename Fn> static double bestOf(int Reps, Fn F) {
+    double Best = 1e30;
+    for (int i = 0; i < Reps; ++i) {
+        auto Start = std::chrono::steady_clock::now();
+        F();
+        std::chrono::duration<double> D = std::chrono::steady_clock::now() - Start;
+        Best = std::min(Best, D.count());
+    }
+    return Best;
+}
+
+// astBytes - 今パースした定義のASTが使っているバイト数
+static size_t astBytes(ClassASTBuilder &) { return ASTArena.getBytesAllocated(); }
+static size_t astBytes(FlatASTBuilder &B) {
+    const FlatAST &A = B.AST;
+    return A.size() * (sizeof(uint8_t) + 3 * sizeof(uint32_t)) +
+           A.Consts.size() * sizeof(uint64_t) + A.SlotNames.size() * sizeof(StringRef) +
+           A.ArgList.size() * sizeof(uint32_t) + ASTArena.getBytesAllocated();
+}
+
+// parseAll - 全ての定義をBでパースする。Codegenがtrueならcodegenしてprintした結果を返す。
+// PeakBytesには一つの定義のASTが使った最大のバイト数をセットする。
+template <typename BuilderT>
+static std::string parseAll(BuilderT &B, bool Codegen, size_t &PeakBytes) {
+    std::string IR;
+    raw_string_ostream OS(IR);
+    myModule = std::make_unique<Module>("ast bench", Context);
+    SymbolFunctions.clear();
+    lexer.rewind();
+    getNextToken();
+    PeakBytes = 0;
+    while (CurTok == tok_def) {
+        auto FnAST = ParseDefinition(B);
+        if (!FnAST)
+            break;
+        PeakBytes = std::max(PeakBytes, astBytes(B));
+        if (Codegen)
+            if (auto *FnIR = FnAST->codegen())
+                FnIR->print(OS);
+        ASTArena.Reset();
+        FlatBuilder.AST.clear();
+    }
+    return OS.str();
+}
+
+int main(int argc, char *argv[]) {
+    std::string File = "bench/ast_bench_input.mc";
+    if (argc > 1) {
+        File = argv[1];
+    } else {
+        std::ofstream(File) << generateSource(500, 8);
+    }
+
+    if (!lexer.initStream(File))
+        return 1;
+    lexer.tokenize(1);
+    initBinopPrecedence();
+
+    // 両方の表現から全く同じIRができるか確認する。
+    size_t ClassBytes, FlatBytes, Unused;
+    if (parseAll(ClassBuilder, true, ClassBytes) != parseAll(FlatBuilder, true, FlatBytes)) {
+        errs() << "IR mismatch between class and flat AST\n";
+        return 1;
+    }
+
+    double TClassParse = bestOf(5, [&] { parseAll(ClassBuilder, false, Unused); });
+    double TFlatParse = bestOf(5, [&] { parseAll(FlatBuilder, false, Unused); });
+    double TClassAll = bestOf(3, [&] { parseAll(ClassBuilder, true, Unused); });
+    double TFlatAll = bestOf(3, [&] { parseAll(FlatBuilder, true, Unused); });
+
+    outs() << format("%zu tokens\n", lexer.getNumTokens());
+    outs() << format("peak AST bytes per def  class: %zu  flat: %zu\n", ClassBytes, FlatBytes);
+    outs() << format("parse    class: %8.2f ms  flat: %8.2f ms\n",
+            TClassParse * 1e3, TFlatParse * 1e3);
+    outs() << format("+codegen class: %8.2f ms  flat: %8.2f ms\n",
+            TClassAll * 1e3, TFlatAll * 1e3);
+    return 0;
+}
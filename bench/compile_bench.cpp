@@ -0,0 +1,304 @@
+// コンパイラ全体のスループットを測るベンチマーク。
+// 大きな.mcファイルを何種類か生成し、それぞれを./mc -stats=jsonでコンパイルして、
+// 1秒あたりの行数、フェーズごとの時間、最大RSSを表示する。
+// bench/compile_baseline.jsonに保存した値より、時間かメモリが許容範囲を超えて増えていたら失敗する。
+// ./bench/compile_bench [-O0|-O1|-O2|-O3] [--tolerance=PERCENT] [--update-baseline]
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+static const char *const BaselineFile = "bench/compile_baseline.json";
+static const char *const Phases[] = {"lex", "parse", "codegen", "verify", "optimize", "emit"};
+
+//===----------------------------------------------------------------------===//
+// 入力の生成
+// どれも乱数の種を固定しているので、毎回同じファイルができる。
+//===----------------------------------------------------------------------===//
+
+static void generateExpr(std::mt19937 &Rng, int Depth, std::string &S) {
+    if (Depth == 0) {
+        S += Rng() % 2 ? "x" : std::to_string(Rng() % 1000);
+        return;
+    }
+    switch (Rng() % 3) {
+        case 0:
+            S += "if ";
+            generateExpr(Rng, Depth - 1, S);
+            S += " < y then ";
+            generateExpr(Rng, Depth - 1, S);
+            S += " else ";
+            generateExpr(Rng, Depth - 1, S);
+            return;
+        default:
+            S += "(";
+            generateExpr(Rng, Depth - 1, S);
+            S += "+-*"[Rng() % 3];
+            generateExpr(Rng, Depth - 1, S);
+            S += ")";
+            return;
+    }
+}
+
+// generateDefs - 小さな式を持つ関数をN個。前の関数を呼ぶ。
+static std::string generateDefs(int N) {
+    std::mt19937 Rng(1);
+    std::string S;
+    for (int i = 0; i < N; ++i) {
+        S += "def f" + std::to_string(i) + "(x y)\n    ";
+        generateExpr(Rng, 4, S);
+        if (i > 0)
+            S += " + f" + std::to_string(Rng() % i) + "(y, x)";
+        S += "\n";
+    }
+    return S;
+}
+
+// generateChain - 長さLenの二項演算の鎖(x + y * x - ...)を持つ関数をN個。
+static std::string generateChain(int N, int Len) {
+    std::mt19937 Rng(2);
+    std::string S;
+    for (int i = 0; i < N; ++i) {
+        S += "def c" + std::to_string(i) + "(x y)\n    x";
+        for (int j = 0; j < Len; ++j) {
+            S += " ";
+            S += "+-*<"[Rng() % 4];
+            S += Rng() % 2 ? " y" : " x";
+            if (j % 16 == 15)
+                S += "\n   ";
+        }
+        S += "\n";
+    }
+    return S;
+}
+
+// generateWideCalls - 引数がArgs個の関数と、それをCalls回呼ぶ関数をN組。
+static std::string generateWideCalls(int N, int Args, int Calls) {
+    std::mt19937 Rng(3);
+    std::string S;
+    for (int i = 0; i < N; ++i) {
+        std::string Name = "w" + std::to_string(i);
+        S += "def " + Name + "(";
+        for (int a = 0; a < Args; ++a)
+            S += (a ? " a" : "a") + std::to_string(a);
+        S += ")\n    a0 + a" + std::to_string(Args - 1) + "\n";
+        S += "def use" + std::to_string(i) + "(x y)\n    0";
+        for (int c = 0; c < Calls; ++c) {
+            S += " +\n    " + Name + "(";
+            for (int a = 0; a < Args; ++a) {
+                S += a ? ", " : "";
+                S += Rng() % 3 ? (Rng() % 2 ? "x" : "y") : std::to_string(Rng() % 100);
+            }
+            S += ")";
+        }
+        S += "\n";
+    }
+    return S;
+}
+
+static void generateIfTree(std::mt19937 &Rng, int Depth, int Indent, std::string &S) {
+    if (Depth == 0) {
+        S += "x * " + std::to_string(Rng() % 100) + " + y";
+        return;
+    }
+    std::string Pad(Indent * 4, ' ');
+    S += "if x < " + std::to_string(Rng() % 1000) + " then\n" + Pad + "    ";
+    generateIfTree(Rng, Depth - 1, Indent + 1, S);
+    S += "\n" + Pad + "else\n" + Pad + "    ";
+    generateIfTree(Rng, Depth - 1, Indent + 1, S);
+}
+
+// generateIfTrees - 深さDepthの完全二分木になったifを持つ関数をN個。
+static std::string generateIfTrees(int N, int Depth) {
+    std::mt19937 Rng(4);
+    std::string S;
+    for (int i = 0; i < N; ++i) {
+        S += "def t" + std::to_string(i) + "(x y)\n    ";
+        generateIfTree(Rng, Depth, 1, S);
+        S += "\n";
+    }
+    return S;
+}
+
+struct BenchInput {
+    const char *Name;
+    std::string Source;
+};
+
+//===----------------------------------------------------------------------===//
+// 計測
+//===----------------------------------------------------------------------===//
+
+struct Result {
+    size_t Lines = 0;
+    double TotalMs = 1e30;
+    double PhaseMs[6] = {};
+    int64_t PeakRSSKB = 0;
+};
+
+// runMC - ./mcでFileを一回コンパイルし、-stats=jsonの出力をRに反映する。
+static bool runMC(StringRef OptLevel, StringRef File, Result &R) {
+    SmallString<128> StatsFile;
+    sys::fs::createTemporaryFile("mc-stats", "json", StatsFile);
+    StringRef Args[] = {"./mc", OptLevel, "-stats=json", File};
+    Optional<StringRef> Redirects[] = {None, StringRef(StatsFile), StringRef("/dev/null")};
+
+    auto Start = std::chrono::steady_clock::now();
+    int RC = sys::ExecuteAndWait("./mc", Args, None, Redirects);
+    std::chrono::duration<double, std::milli> Elapsed = std::chrono::steady_clock::now() - Start;
+
+    auto Buf = MemoryBuffer::getFile(StatsFile);
+    sys::fs::remove(StatsFile);
+    if (RC != 0 || !Buf) {
+        errs() << "./mc " << OptLevel << " " << File << " failed\n";
+        return false;
+    }
+    // stdoutには"Wrote output.o"の後にJSONが出力される。
+    StringRef Out = (*Buf)->getBuffer();
+    auto Stats = json::parse(Out.substr(Out.find('{')));
+    if (!Stats) {
+        errs() << File << ": " << toString(Stats.takeError()) << "\n";
+        return false;
+    }
+    const json::Object *Obj = Stats->getAsObject();
+    const json::Object *PhaseObj = Obj ? Obj->getObject("phases") : nullptr;
+    if (!PhaseObj)
+        return false;
+
+    // 一番速かった回の時間を使う。メモリは一番多かった回。
+    R.PeakRSSKB = std::max(R.PeakRSSKB, Obj->getInteger("peak_rss_kb").getValueOr(0));
+    if (Elapsed.count() >= R.TotalMs)
+        return true;
+    R.TotalMs = Elapsed.count();
+    for (unsigned i = 0; i < 6; ++i) {
+        const json::Object *P = PhaseObj->getObject(Phases[i]);
+        R.PhaseMs[i] = P ? P->getNumber("wall_ms").getValueOr(0) : 0;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    std::string OptLevel = "-O0";
+    double Tolerance = 25;
+    bool UpdateBaseline = false;
+    for (int i = 1; i < argc; ++i) {
+        StringRef Arg = argv[i];
+        if (Arg.size() == 3 && Arg.startswith("-O")) {
+            OptLevel = Arg.str();
+        } else if (Arg.startswith("--tolerance=")) {
+            if (Arg.substr(12).getAsDouble(Tolerance))
+                return 1;
+        } else if (Arg == "--update-baseline") {
+            UpdateBaseline = true;
+        } else {
+            errs() << "usage: " << argv[0]
+                   << " [-O0|-O1|-O2|-O3] [--tolerance=PERCENT] [--update-baseline]\n";
+            return 1;
+        }
+    }
+
+    std::vector<BenchInput> Inputs = {
+        {"defs", generateDefs(2000)},
+        {"chain", generateChain(20, 2000)},
+        {"wide", generateWideCalls(50, 64, 20)},
+        {"iftree", generateIfTrees(8, 10)},
+    };
+
+    sys::fs::create_directories("bench/inputs");
+    outs() << "input       lines  total ms    lines/s";
+    for (const char *P : Phases)
+        outs() << format(" %9s", P);
+    outs() << "    rss KB\n";
+
+    std::vector<Result> Results;
+    for (auto &In : Inputs) {
+        std::string File = std::string("bench/inputs/") + In.Name + ".mc";
+        std::ofstream(File) << In.Source;
+        Result R;
+        R.Lines = std::count(In.Source.begin(), In.Source.end(), '\n');
+        for (int Rep = 0; Rep < 3; ++Rep)
+            if (!runMC(OptLevel, File, R))
+                return 1;
+        outs() << format("%-8s %8zu %9.1f %10.0f", In.Name, R.Lines, R.TotalMs,
+                R.Lines / (R.TotalMs / 1e3));
+        for (double Ms : R.PhaseMs)
+            outs() << format(" %9.1f", Ms);
+        outs() << format(" %9lld\n", (long long)R.PeakRSSKB);
+        Results.push_back(R);
+    }
+
+    if (UpdateBaseline) {
+        std::error_code EC;
+        raw_fd_ostream OS(BaselineFile, EC);
+        if (EC) {
+            errs() << BaselineFile << ": " << EC.message() << "\n";
+            return 1;
+        }
+        json::OStream J(OS, 2);
+        J.object([&] {
+            J.attribute("opt", OptLevel);
+            J.attributeObject("inputs", [&] {
+                for (size_t i = 0; i < Inputs.size(); ++i)
+                    J.attributeObject(Inputs[i].Name, [&] {
+                        J.attribute("total_ms", (int64_t)std::round(Results[i].TotalMs));
+                        J.attribute("peak_rss_kb", Results[i].PeakRSSKB);
+                    });
+            });
+        });
+        OS << "\n";
+        outs() << "Wrote " << BaselineFile << "\n";
+        return 0;
+    }
+
+    auto Buf = MemoryBuffer::getFile(BaselineFile);
+    Expected<json::Value> Baseline = Buf ? json::parse((*Buf)->getBuffer())
+                                         : Expected<json::Value>(json::Value(nullptr));
+    const json::Object *BaseObj = Baseline ? Baseline->getAsObject() : nullptr;
+    if (!BaseObj) {
+        if (!Baseline)
+            consumeError(Baseline.takeError());
+        outs() << "No baseline in " << BaselineFile << "; run with --update-baseline\n";
+        return 0;
+    }
+    if (BaseObj->getString("opt").getValueOr("") != OptLevel) {
+        outs() << "Baseline was measured with a different optimization level; not compared\n";
+        return 0;
+    }
+
+    // 時間もメモリも、基準値の(100 + Tolerance)%を超えたら失敗にする。
+    bool Regressed = false;
+    const json::Object *BaseInputs = BaseObj->getObject("inputs");
+    outs() << format("\nbaseline (%s, tolerance %.0f%%)\n", BaselineFile, Tolerance);
+    for (size_t i = 0; i < Inputs.size(); ++i) {
+        const json::Object *B = BaseInputs ? BaseInputs->getObject(Inputs[i].Name) : nullptr;
+        if (!B)
+            continue;
+        double BaseMs = B->getNumber("total_ms").getValueOr(0);
+        double BaseRSS = B->getInteger("peak_rss_kb").getValueOr(0);
+        double TimeRatio = Results[i].TotalMs / BaseMs;
+        double RSSRatio = Results[i].PeakRSSKB / BaseRSS;
+        bool Bad = TimeRatio > 1 + Tolerance / 100 || RSSRatio > 1 + Tolerance / 100;
+        Regressed |= Bad;
+        outs() << format("%-8s time %+6.1f%%  rss %+6.1f%%%s\n", Inputs[i].Name,
+                (TimeRatio - 1) * 100, (RSSRatio - 1) * 100, Bad ? "  REGRESSION" : "");
+    }
+    if (Regressed) {
+        errs() << format("FAIL: compile performance regressed beyond %.0f%%\n", Tolerance);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,95 @@
+// トークナイズのスループット(MB/s)を測るベンチマーク。
+// 一文字ずつ読むgettokと、SIMDで分類しスレッドで分割するtokenizeを比べる。
+// ./bench/lexer_bench [file.mc] [スレッド数]
+// ファイルを省略した場合は大きな.mcファイルを生成して使う。
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace llvm;
+
+#include "../src/lexer.h"
+
+static std::string generateSource(size_t NumDefs) {
+    std::string S;
+    for (size_t i = 0; i < NumDefs; ++i) {
+        std::string N = std::to_string(i);
+        S += "def f" + N + "(x y)\n";
+        S += "    if x < " + N + " then x * " + N + " + y - 12345 else # comment\n";
+        S += "        f" + N + "(x - 1, y + 2) + f" + N + "(y, x)\n";
+    }
+    return S;
+}
+
+template <typename Fn> static double bestOf(int Reps, Fn F) {
+    double Best = 1e30;
+    for (int i = 0; i < Reps; ++i) {
+        auto Start = std::chrono::steady_clock::now();
+        F();
+        std::chrono::duration<double> D = std::chrono::steady_clock::now() - Start;
+        Best = std::min(Best, D.count());
+    }
+    return Best;
+}
+
+int main(int argc, char *argv[]) {
+    std::string File = "bench/lexer_bench_input.mc";
+    if (argc > 1) {
+        File = argv[1];
+    } else {
+        std::ofstream(File) << generateSource(200000);
+    }
+    unsigned Threads = argc > 2 ? atoi(argv[2]) : std::thread::hardware_concurrency();
+
+    Lexer L;
+    if (!L.initStream(File))
+        return 1;
+    double MB = MemoryBuffer::getFile(File).get()->getBufferSize() / 1e6;
+
+    // 両方のlexerが同じトークン列を返すか確認する。
+    size_t NumTokens = 0;
+    {
+        Lexer Ref, Arr;
+        Ref.initStream(File);
+        Arr.initStream(File);
+        Arr.tokenize(Threads);
+        while (true) {
+            int A = Ref.gettok(), B = Arr.next();
+            if (A != B || (A == tok_number && Ref.getNumVal() != Arr.getNumVal()) ||
+                    (A == tok_identifier && Ref.getIdentifier() != Arr.getIdentifier())) {
+                errs() << "token mismatch at token " << NumTokens << "\n";
+                return 1;
+            }
+            if (A == tok_eof)
+                break;
+            ++NumTokens;
+        }
+    }
+
+    double TGettok = bestOf(5, [&] {
+        Lexer G;
+        G.initStream(File);
+        while (G.gettok() != tok_eof)
+            ;
+    });
+    double TSingle = bestOf(5, [&] { L.tokenize(1); });
+    double TMulti = bestOf(5, [&] { L.tokenize(Threads); });
+
+    outs() << format("%.1f MB, %zu tokens\n", MB, NumTokens);
+    outs() << format("gettok:               %8.1f MB/s\n", MB / TGettok);
+    outs() << format("tokenize (1 thread):  %8.1f MB/s\n", MB / TSingle);
+    outs() << format("tokenize (%u threads): %8.1f MB/s\n", Threads, MB / TMulti);
+    return 0;
+}
@@ -0,0 +1,20 @@
+#!/bin/sh
+# --profile-generateで取ったプロファイルを--profile-useで使った場合と、使わない場合の-O2を比べる。
+# 学習用の実行(n=1000000)とは別の、大きいnで測る。
+# usage: CXX=clang++ sh bench/pgo_bench.sh
+CXX=${CXX:-clang++}
+N=${N:-300000000}
+
+build() {
+    ./mc -O2 "$@" bench/pgo.mc > /dev/null 2>&1 || exit 1
+    $CXX -O2 bench/pgo_main.cpp output.o -o bench/pgo_main || exit 1
+}
+
+rm -f bench/pgo.mcprof
+build --profile-generate=bench/pgo.mcprof
+./bench/pgo_main train 1000000 || exit 1
+
+build
+./bench/pgo_main -O2 $N
+build --profile-use=bench/pgo.mcprof
+./bench/pgo_main -O2+pgo $N
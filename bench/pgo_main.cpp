@@ -0,0 +1,25 @@
+// bench/pgo.mcのrun(n)を3回呼び、一番速かった時間を出力する。
+// e.g. clang++ -O2 bench/pgo_main.cpp output.o -o bench/pgo_main && ./bench/pgo_main base 300000000
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+extern "C" long run(long n);
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <label> <n>\n", argv[0]);
+        return 1;
+    }
+    long n = atol(argv[2]), result = 0;
+    double best = 1e30;
+    for (int i = 0; i < 3; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        result = run(n);
+        std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+        best = std::min(best, d.count());
+    }
+    printf("%-8s run(%ld) = %ld  %8.1f ms\n", argv[1], n, result, best * 1e3);
+    return 0;
+}
@@ -0,0 +1,132 @@
+// MC言語で書いたカーネル(bench/kernels.mc)と、同じアルゴリズムをC++で書いたものの実行時間を比べる。
+// ./mc -O2 bench/kernels.mc && clang++ -O2 bench/runtime_bench.cpp output.o -o bench/runtime_bench
+// ./bench/runtime_bench [ラベル] [繰り返す回数]
+// 各カーネルを数回ウォームアップしてから繰り返し呼び、一回ごとの時間の中央値とp99を出力する。
+// C++版もこのファイルと一緒に-O2でコンパイルされるので、mcの最適化レベルごとの差を比べられる。
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+typedef long I;
+
+extern "C" {
+I fib(I n);
+I gcd(I a, I b);
+I ack(I m, I n);
+I collatz(I n);
+I power(I b, I e);
+}
+
+// C++版。符号無しで計算して、MC言語と同じく2^64で割った余りにする。
+namespace ref {
+static I fib(I n) { return n < 3 ? 1 : (I)((unsigned long)fib(n - 1) + fib(n - 2)); }
+
+static I gcd(I a, I b) {
+    if (b < 1)
+        return a;
+    if (a < b)
+        return gcd(b, a);
+    return gcd(a - b, b);
+}
+
+static I ack(I m, I n) {
+    if (m < 1)
+        return n + 1;
+    if (n < 1)
+        return ack(m - 1, 1);
+    return ack(m - 1, ack(m, n - 1));
+}
+
+static I halfp(I n, I p) {
+    if (n < p + p)
+        return 0;
+    I q = halfp(n, p + p);
+    return n - q - q < p + p ? q : q + p;
+}
+
+static I collatz(I n) {
+    I total = 0;
+    for (I i = 1; i < n + 1; ++i)
+        for (I x = i; 1 < x; ++total) {
+            I h = halfp(x, 1);
+            x = x - h - h < 1 ? h : x * 3 + 1;
+        }
+    return total;
+}
+
+static I power(I b, I e) {
+    unsigned long r = 1;
+    for (I i = 0; i < e; ++i)
+        r *= b;
+    return r;
+}
+} // namespace ref
+
+struct Kernel {
+    const char *Name;
+    I (*MC)(I, I);
+    I (*Ref)(I, I);
+    I A, B;
+};
+
+// 引数の数を揃えるためのラッパー
+static I mcFib(I n, I) { return fib(n); }
+static I refFib(I n, I) { return ref::fib(n); }
+static I mcCollatz(I n, I) { return collatz(n); }
+static I refCollatz(I n, I) { return ref::collatz(n); }
+
+struct Timing {
+    double Median, P99;
+};
+
+// measure - Fnをウォームアップした後Reps回呼び、一回の時間(マイクロ秒)の中央値とp99を返す。
+// 引数はvolatileから読み、C++版がコンパイル時に計算されないようにする。
+static Timing measure(I (*Fn)(I, I), I A, I B, int Reps, I &Result) {
+    volatile I VA = A, VB = B;
+    for (int i = 0; i < 3; ++i)
+        Result = Fn(VA, VB);
+    std::vector<double> Times;
+    for (int i = 0; i < Reps; ++i) {
+        auto Start = std::chrono::steady_clock::now();
+        Result = Fn(VA, VB);
+        std::chrono::duration<double, std::micro> D = std::chrono::steady_clock::now() - Start;
+        Times.push_back(D.count());
+    }
+    std::sort(Times.begin(), Times.end());
+    return {Times[Times.size() / 2], Times[std::min(Times.size() - 1, Times.size() * 99 / 100)]};
+}
+
+int main(int argc, char *argv[]) {
+    const char *Label = argc > 1 ? argv[1] : "mc";
+    int Reps = argc > 2 ? atoi(argv[2]) : 21;
+    if (Reps < 1)
+        Reps = 1;
+
+    const Kernel Kernels[] = {
+        {"fib", mcFib, refFib, 27, 0},
+        {"gcd", gcd, ref::gcd, 10000000, 3},
+        {"ack", ack, ref::ack, 3, 7},
+        {"collatz", mcCollatz, refCollatz, 3000, 0},
+        {"power", power, ref::power, 3, 3000000},
+    };
+
+    printf("%-8s %-8s %12s %12s %12s %12s %7s\n", Label, "kernel", "mc med(us)", "mc p99(us)",
+            "c++ med(us)", "c++ p99(us)", "mc/c++");
+    bool Ok = true;
+    for (const Kernel &K : Kernels) {
+        I MCResult, RefResult;
+        Timing MC = measure(K.MC, K.A, K.B, Reps, MCResult);
+        Timing Ref = measure(K.Ref, K.A, K.B, Reps, RefResult);
+        if (MCResult != RefResult) {
+            fprintf(stderr, "%s: mc returned %ld but c++ returned %ld\n", K.Name, MCResult,
+                    RefResult);
+            Ok = false;
+        }
+        printf("%-8s %-8s %12.1f %12.1f %12.1f %12.1f %7.2f\n", Label, K.Name, MC.Median, MC.P99,
+                Ref.Median, Ref.P99, MC.Median / Ref.Median);
+    }
+    return Ok ? 0 : 1;
+}
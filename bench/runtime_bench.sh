@@ -0,0 +1,12 @@
+#!/bin/sh
+# bench/kernels.mcを各最適化レベルでコンパイルし、C++版(-O2)と実行時間を比べる。
+# usage: CXX=clang++ OPTS="-O0 -O2" sh bench/runtime_bench.sh
+CXX=${CXX:-clang++}
+OPTS=${OPTS:-"-O0 -O1 -O2 -O3"}
+REPS=${REPS:-21}
+
+for opt in $OPTS; do
+    ./mc $opt bench/kernels.mc > /dev/null 2>&1 || exit 1
+    $CXX -O2 bench/runtime_bench.cpp output.o -o bench/runtime_bench || exit 1
+    ./bench/runtime_bench mc$opt $REPS || exit 1
+done
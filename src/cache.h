@@ -0,0 +1,220 @@
+//===----------------------------------------------------------------------===//
+// Compilation Cache
+// --cache-dir=DIRが指定された場合、関数定義ごとにcodegenと関数単位の最適化が終わった
+// LLVM IRをビットコードにしてDIRに保存します。
+// キーは、その定義のトークン列(空白とコメントを除いたもの)、呼び出している関数のシグネチャ、
+// 最適化レベル、ターゲットトリプル、CPUと機能のSHA1です。キーが同じ定義は同じIRになるので、
+// 次のコンパイルでは保存したビットコードをmyModuleにリンクし、codegenを丸ごと飛ばします。
+// モジュール単位の最適化とオブジェクトファイルの出力は毎回行います。
+// ファイル名は"llvmcache-<キー>"で、pruneCache(ThinLTOのキャッシュと同じもの)で
+// 最近使われていないものから消し、ディレクトリを--cache-sizeで指定したサイズ以下に保ちます。
+//===----------------------------------------------------------------------===//
+
+// copyUseListOrder - Fの引数、ブロック、命令のuse-listの順番を、VMapで対応するクローンにも
+// 同じにする。use-listの順番はphiのpredsの表示順などに現れるので、キャッシュから読み直したIRが
+// 元のIRと全く同じになるようにする。
+static void copyUseListOrder(Function &F, ValueToValueMapTy &VMap) {
+    auto CopyOrder = [&](Value &V) {
+        Value *NV = VMap.lookup(&V);
+        if (!NV || V.hasOneUse() || V.use_empty())
+            return;
+        DenseMap<std::pair<const Value *, unsigned>, unsigned> Pos;
+        unsigned N = 0;
+        for (const Use &U : V.uses())
+            Pos[{VMap.lookup(U.getUser()), U.getOperandNo()}] = N++;
+        NV->sortUseList([&](const Use &L, const Use &R) {
+            return Pos.lookup({L.getUser(), L.getOperandNo()}) <
+                   Pos.lookup({R.getUser(), R.getOperandNo()});
+        });
+    };
+    for (auto &Arg : F.args())
+        CopyOrder(Arg);
+    for (auto &BB : F) {
+        CopyOrder(BB);
+        for (auto &I : BB)
+            CopyOrder(I);
+    }
+}
+
+class FunctionCache {
+    public:
+        void init(StringRef Directory, uint64_t MaxSizeBytes) {
+            Dir = Directory.str();
+            MaxSize = MaxSizeBytes;
+            if (std::error_code EC = sys::fs::create_directories(Dir)) {
+                errs() << "Could not create cache directory " << Dir << ": "
+                       << EC.message() << "\n";
+                Dir.clear();
+            }
+        }
+
+        bool enabled() const { return !Dir.empty(); }
+
+        // reset - キャッシュを使わない状態に戻し、統計も消す。--serveでリクエストごとに呼ぶ。
+        void reset() {
+            Dir.clear();
+            Hits = Misses = Stores = Evicted = 0;
+        }
+
+        // computeKey - lexerのTokBeginからTokEnd(含まない)までのトークンでできた定義のキー。
+        // 呼び出し先の引数の数や、どの引数が配列かが変わるとcodegenの結果(エラーになるかどうか)が
+        // 変わるので、Mで見つけた呼び出し先のシグネチャもキーに含める。配列の引数はLLVMの引数の
+        // ポインタと長さの二つになるので、引数の数だけでは`g(a b)`と`g(a[])`を区別できない。
+        std::string computeKey(size_t TokBegin, size_t TokEnd, Module &M) {
+            SHA1 H;
+            H.update(LLVM_VERSION_STRING);
+            H.update(utostr(Opts.OptLevel));
+            H.update(TargetTriple);
+            H.update(TargetCPU);
+            H.update(TargetFeatures);
+            for (size_t i = TokBegin; i < TokEnd; ++i) {
+                int Kind = lexer.getTokKind(i);
+                uint8_t KindByte = Kind;
+                H.update(KindByte);
+                if (Kind != tok_identifier && Kind != tok_number)
+                    continue;
+                StringRef Text = lexer.getTokText(i);
+                // "ab" "c"と"a" "bc"を区別するため、長さも入れる。
+                H.update(utostr(Text.size()) + ":");
+                H.update(Text);
+                if (Kind == tok_identifier && i + 1 < TokEnd && lexer.getTokKind(i + 1) == '(') {
+                    Function *Callee = M.getFunction(Text);
+                    H.update(Callee ? getSignatureKey(*Callee) : "-");
+                }
+            }
+            return toHex(H.final(), /*LowerCase=*/true);
+        }
+
+        // load - キーのビットコードがあればMにリンクし、その関数を返す。
+        Function *load(const std::string &Key, Module &M) {
+            std::string Path = getPath(Key);
+            int FD;
+            if (sys::fs::openFileForRead(Path, FD)) {
+                ++Misses;
+                return nullptr;
+            }
+            // pruneCacheが最近使われたものを残すように、最終アクセス時刻を更新する。
+            sys::fs::setLastAccessAndModificationTime(FD, std::chrono::system_clock::now());
+            auto BufOrErr = MemoryBuffer::getOpenFile(FD, Path, -1);
+            sys::Process::SafelyCloseFileDescriptor(FD);
+            if (!BufOrErr) {
+                ++Misses;
+                return nullptr;
+            }
+
+            auto FragOrErr = parseBitcodeFile(**BufOrErr, M.getContext());
+            if (!FragOrErr) {
+                consumeError(FragOrErr.takeError());
+                ++Misses;
+                return nullptr;
+            }
+            std::string Name;
+            for (auto &F : **FragOrErr)
+                if (!F.isDeclaration())
+                    Name = F.getName().str();
+            if (Name.empty() || Linker::linkModules(M, std::move(*FragOrErr))) {
+                ++Misses;
+                return nullptr;
+            }
+            ++Hits;
+            return M.getFunction(Name);
+        }
+
+        // store - Fと、Fが呼んでいる関数の宣言だけを持つモジュールをビットコードで保存する。
+        void store(const std::string &Key, Function &F) {
+            Module Frag(F.getName(), F.getContext());
+            Frag.setTargetTriple(F.getParent()->getTargetTriple());
+            Frag.setDataLayout(F.getParent()->getDataLayout());
+            Function *NF = Function::Create(F.getFunctionType(), F.getLinkage(),
+                    F.getName(), &Frag);
+
+            ValueToValueMapTy VMap;
+            VMap[&F] = NF;
+            for (auto &BB : F)
+                for (auto &I : BB)
+                    if (auto *Call = dyn_cast<CallInst>(&I)) {
+                        Function *Callee = Call->getCalledFunction();
+                        if (Callee && !VMap.count(Callee))
+                            VMap[Callee] = Function::Create(Callee->getFunctionType(),
+                                    Function::ExternalLinkage, Callee->getName(), &Frag);
+                    }
+            auto NewArg = NF->arg_begin();
+            for (auto &Arg : F.args()) {
+                NewArg->setName(Arg.getName());
+                VMap[&Arg] = &*NewArg++;
+            }
+            SmallVector<ReturnInst *, 4> Returns;
+            CloneFunctionInto(NF, &F, VMap, CloneFunctionChangeType::DifferentModule, Returns);
+            copyUseListOrder(F, VMap);
+            // CloneFunctionIntoは空のllvm.dbg.cuを作るが、デバッグ情報は無いので消しておく。
+            if (NamedMDNode *CUs = Frag.getNamedMetadata("llvm.dbg.cu"))
+                Frag.eraseNamedMetadata(CUs);
+
+            // 他のプロセスやスレッドが途中まで書いたファイルを読まないよう、
+            // 一時ファイルに書いてからrenameする。
+            int FD;
+            SmallString<128> TmpPath;
+            if (sys::fs::createUniqueFile(Dir + "/tmp-%%%%%%%%", FD, TmpPath))
+                return;
+            {
+                raw_fd_ostream OS(FD, /*shouldClose=*/true);
+                // use-listの順番(phiのpredsの順番等)も保存し、読み直したIRを全く同じにする。
+                WriteBitcodeToFile(Frag, OS, /*ShouldPreserveUseListOrder=*/true);
+            }
+            if (sys::fs::rename(TmpPath, getPath(Key)))
+                sys::fs::remove(TmpPath);
+            else
+                ++Stores;
+        }
+
+        // prune - 最近使われていないものから消し、キャッシュを上限のサイズ以下にする。
+        void prune() {
+            if (!enabled())
+                return;
+            size_t Before = countEntries();
+            CachePruningPolicy Policy;
+            Policy.Interval = std::chrono::seconds(0);
+            Policy.MaxSizeBytes = MaxSize;
+            pruneCache(Dir, Policy);
+            Evicted += Before - std::min(Before, countEntries());
+        }
+
+        void printStats(raw_ostream &OS) {
+            OS << "cache: " << Hits << " hits, " << Misses << " misses, " << Stores
+               << " stored, " << Evicted << " evicted\n";
+        }
+
+    private:
+        // getSignatureKey - Fの引数の並び。配列のポインタは'a'、それ以外のi64は'i'。
+        static std::string getSignatureKey(Function &F) {
+            std::string Sig;
+            for (auto &Arg : F.args())
+                Sig += Arg.getType()->isPointerTy() ? 'a' : 'i';
+            return Sig;
+        }
+
+        std::string getPath(const std::string &Key) { return Dir + "/llvmcache-" + Key; }
+
+        size_t countEntries() {
+            size_t N = 0;
+            std::error_code EC;
+            for (sys::fs::directory_iterator I(Dir, EC), E; I != E && !EC; I.increment(EC))
+                if (sys::path::filename(I->path()).startswith("llvmcache-"))
+                    ++N;
+            return N;
+        }
+
+        std::string Dir;
+        uint64_t MaxSize = 0;
+        // --batchでは複数のスレッドから使われる
+        std::atomic<unsigned> Hits{0}, Misses{0}, Stores{0}, Evicted{0};
+};
+
+static FunctionCache FnCache;
+
+// finishCache - キャッシュを上限のサイズ以下にし、--cache-statsなら統計を出力する。
+static void finishCache() {
+    FnCache.prune();
+    if (Opts.CacheStats)
+        FnCache.printStats(errs());
+}
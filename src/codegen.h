@@ -7,21 +7,107 @@
 //===----------------------------------------------------------------------===//
 
 // https://llvm.org/doxygen/LLVMContext_8h_source.html
-static LLVMContext Context;
+static thread_local LLVMContext Context;
 // https://llvm.org/doxygen/classllvm_1_1IRBuilder.html
 // LLVM IRを生成するためのインターフェース
-static IRBuilder<> Builder(Context);
+static thread_local IRBuilder<> Builder(Context);
 // https://llvm.org/doxygen/classllvm_1_1Module.html
 // このModuleはC++ Moduleとは何の関係もなく、LLVM IRを格納するトップレベルオブジェクトです。
-static std::unique_ptr<Module> myModule;
-// 変数名とllvm::Valueのマップを保持する
-static std::map<std::string, Value *> NamedValues;
+static thread_local std::unique_ptr<Module> myModule;
+// 変数のスロット(parser.hを参照)ごとに、その変数の値を置くallocaを保持する。
+// 引数もローカル変数も全てエントリーブロックのallocaに置いて読み書きし、
+// finishFunctionでmem2regによってSSAのレジスタに昇格する。
+static thread_local std::vector<AllocaInst *> SlotValues;
+// 配列の引数のスロットごとに、その先頭のポインタ(i64*)と長さ(i64)を保持する。
+// 配列でないスロットは(nullptr, nullptr)。
+static thread_local std::vector<std::pair<Value *, Value *>> SlotArrays;
+// 今codegenしている関数のスロットごとの変数名。allocaの名前に使う。
+static thread_local ArrayRef<StringRef> CurSlotNames;
+// シンボル番号ごとの、その名前のmyModuleの関数。呼び出しの度に名前で探さないようにする。
+// 関数を消したりmyModuleを作り直したりしたらclearする。
+static thread_local std::vector<Function *> SymbolFunctions;
+// シンボル番号の名前を引くLexer。パイプライン(pipeline.h)のワーカーでは、パースしている
+// スレッドのlexerを指す。
+static thread_local const Lexer *SymbolSource = &lexer;
+
+// FunctionSignature - パイプラインで、他のワーカーがcodegenする関数を宣言するための情報。
+// パースしているスレッドがシンボル番号ごとに一度だけ書き、Ordinalをセットしてから読ませる。
+struct FunctionSignature {
+    // この関数を定義した、パースした順の番号(1から)。0ならまだ定義されていない。
+    std::atomic<unsigned> Ordinal{0};
+    SmallVector<StringRef, 4> Args;
+    SmallVector<bool, 4> ArrayArgs;
+};
+// パイプラインのワーカーが参照する、シンボル番号ごとのシグネチャの表。それ以外ではnullptr。
+static thread_local const FunctionSignature *PipelineSignatures;
+// パイプラインのワーカーが今codegenしている定義の、パースした順の番号
+static thread_local unsigned PipelineOrdinal;
+
+//===----------------------------------------------------------------------===//
+// Codegen Walker
+// 式のcodegenは、子の式のcodegenを再帰的に呼ぶ代わりに、CodegenWalkerの明示的な作業スタックで
+// 行います。各ノードのcodegenは段階(Stage)に分かれていて、子の式の値が必要になったらevalで
+// 子を積んでその段階を終えます。子のcodegenが終わるとその値が値のスタックに積まれ、
+// 親は次の段階から再開します。これで深くネストした式でもC++のスタックは溢れません。
+// NodeTはクラス階層のASTならExprAST *、FlatASTならノードのインデックスです。
+//===----------------------------------------------------------------------===//
+
+template <typename NodeT> class CodegenWalker {
+    public:
+        // run - Rootをcodegenしてその値を返す。Step(W, Node, Stage)はNodeのStage番目の段階を行い、
+        // evalで子を積むか、retで値を返すか、どちらもせずに次の段階に進む。
+        template <typename StepT> Value *run(NodeT Root, StepT Step) {
+            eval(Root);
+            while (!Frames.empty()) {
+                Frame F = Frames.back();
+                ++Frames.back().Stage;
+                Base = F.Base;
+                Step(*this, F.Node, F.Stage);
+            }
+            return Values.back();
+        }
+
+        // eval - Nodeをcodegenし、その値を今のノードの値のスタックに積んでから次の段階に戻る。
+        void eval(NodeT Node) { Frames.push_back({Node, 0, (unsigned)Values.size()}); }
+        // ret - 今のノードのcodegenを終え、その値をVにする。エラーならnullptr。
+        void ret(Value *V) {
+            Values.resize(Base);
+            Values.push_back(V);
+            Frames.pop_back();
+        }
+        // push - 後の段階で使う値(作ったブロックや元の束縛等)を今のノードの値のスタックに積む。
+        void push(Value *V) { Values.push_back(V); }
+
+        // 今のノードの値のスタック。evalした子の値とpushした値が順に並ぶ。
+        Value *&operator[](unsigned i) { return Values[Base + i]; }
+        Value *back() { return Values.back(); }
+        unsigned size() const { return Values.size() - Base; }
+        ArrayRef<Value *> values() const { return makeArrayRef(Values).drop_front(Base); }
+
+    private:
+        struct Frame {
+            NodeT Node;
+            unsigned Stage;
+            // このノードの値のスタックがValuesのどこから始まるか
+            unsigned Base;
+        };
+        std::vector<Frame> Frames;
+        std::vector<Value *> Values;
+        unsigned Base = 0;
+};
 
 // https://llvm.org/doxygen/classllvm_1_1Value.html
 // llvm::Valueという、LLVM IRのオブジェクトでありFunctionやModuleなどを構成するクラスを使います
-Value *NumberAST::codegen() {
+Value *ExprAST::codegen() {
+    return CodegenWalker<ExprAST *>().run(this,
+            [](CodegenWalker<ExprAST *> &W, ExprAST *E, unsigned Stage) {
+                E->codegenStep(W, Stage);
+            });
+}
+
+void NumberAST::codegenStep(CodegenWalker<ExprAST *> &W, unsigned) {
     // 64bit整数型のValueを返す
-    return ConstantInt::get(Context, APInt(64, Val, true));
+    W.ret(ConstantInt::get(Context, APInt(64, Val, true)));
 }
 
 Value *LogErrorV(const char *str) {
@@ -29,48 +115,435 @@ Value *LogErrorV(const char *str) {
     return nullptr;
 }
 
-// TODO 2.4: 引数のcodegenを実装してみよう
-Value *VariableExprAST::codegen() {
-    // NamedValuesの中にVariableExprAST::NameとマッチするValueがあるかチェックし、
-    // あったらそのValueを返す。
-    Value *V = NamedValues[variableName];
-    if (!V)
+// createEntryBlockAlloca - 関数のエントリーブロックの先頭に変数Nameのallocaを作る。
+// mem2regが昇格できるのはエントリーブロックのallocaだけなので、ループの中で作る変数もここに置く。
+static AllocaInst *createEntryBlockAlloca(Function *F, const Twine &Name) {
+    IRBuilder<> TmpB(&F->getEntryBlock(), F->getEntryBlock().begin());
+    return TmpB.CreateAlloca(Type::getInt64Ty(Context), nullptr, Name);
+}
+
+// emitVariable - スロットSlotの変数の今の値を読む。
+static Value *emitVariable(int Slot) {
+    if (Slot < 0 || !SlotValues[Slot])
+        return LogErrorV(Slot >= 0 && SlotArrays[Slot].first ? "array used as a value"
+                                                              : "Unknown variable name");
+    // loadには名前を付けない。引数と同じ名前だと関数内の名前の通し番号が進み、
+    // mem2regで消えた後も他の命令の名前が変わってしまう。
+    return Builder.CreateLoad(Type::getInt64Ty(Context), SlotValues[Slot]);
+}
+
+// emitAssign - スロットSlotの変数にVを書き込み、Vを返す。
+static Value *emitAssign(int Slot, Value *V) {
+    if (Slot < 0 || !SlotValues[Slot])
         return LogErrorV("Unknown variable name");
+    Builder.CreateStore(V, SlotValues[Slot]);
     return V;
 }
 
-// TODO 2.5: 関数呼び出しのcodegenを実装してみよう
-Value *CallExprAST::codegen() {
-    // 1. myModule->getFunctionを用いてcalleeがdefineされているかを
-    // チェックし、されていればそのポインタを得る。
-    Function *CalleeF = myModule->getFunction(callee);
-    if (!CalleeF)
-        return LogErrorV("Unknown function referenced");
-
-    // 2. llvm::Function::arg_sizeと実際に渡されたargsのサイズを比べ、
-    // サイズが間違っていたらエラーを出力。
-    if (CalleeF->arg_size() != args.size())
+// bindVariable - 新しいallocaをInitで初期化してスロットSlotの変数にし、そのallocaを返す。
+// 束縛ごとにスロットが違うので、スコープを抜けても元に戻す必要は無い。
+static AllocaInst *bindVariable(int Slot, Value *Init) {
+    AllocaInst *Alloca = createEntryBlockAlloca(Builder.GetInsertBlock()->getParent(),
+            CurSlotNames[Slot]);
+    Builder.CreateStore(Init, Alloca);
+    SlotValues[Slot] = Alloca;
+    return Alloca;
+}
+
+// beginLoop - ループの条件のブロックを作ってそこに入り、(CondBB, BodyBB, EndBB)をWに積む。
+// forとwhileで共有する。条件を先頭で調べる形にしておくと、-O1以上ではLoopRotateが
+// do-while型の自然なループに直し、LICMやベクトル化が扱えるようになる。
+template <typename NodeT> static void beginLoop(CodegenWalker<NodeT> &W) {
+    Function *ParentFunc = Builder.GetInsertBlock()->getParent();
+    BasicBlock *CondBB = BasicBlock::Create(Context, "loopcond", ParentFunc);
+    Builder.CreateBr(CondBB);
+    Builder.SetInsertPoint(CondBB);
+    W.push(CondBB);
+    W.push(BasicBlock::Create(Context, "loopbody"));
+    W.push(BasicBlock::Create(Context, "loopend"));
+}
+
+// enterLoopBody - 条件CondVが0でなければBodyBBへ、0ならEndBBへ分岐し、BodyBBに入る。
+static void enterLoopBody(Value *CondV, Value *BodyBB, Value *EndBB) {
+    CondV = Builder.CreateICmpNE(
+            CondV, ConstantInt::get(Context, APInt(64, 0)), "loopcond");
+    Builder.CreateCondBr(CondV, cast<BasicBlock>(BodyBB), cast<BasicBlock>(EndBB));
+    Function *ParentFunc = Builder.GetInsertBlock()->getParent();
+    ParentFunc->getBasicBlockList().push_back(cast<BasicBlock>(BodyBB));
+    Builder.SetInsertPoint(cast<BasicBlock>(BodyBB));
+}
+
+// endLoop - bodyの最後から条件のブロックCondBBに戻り、ループの後のEndBBに入る。ループの値は0。
+static Value *endLoop(Value *CondBB, Value *EndBB) {
+    Builder.CreateBr(cast<BasicBlock>(CondBB));
+    Function *ParentFunc = Builder.GetInsertBlock()->getParent();
+    ParentFunc->getBasicBlockList().push_back(cast<BasicBlock>(EndBB));
+    Builder.SetInsertPoint(cast<BasicBlock>(EndBB));
+    return ConstantInt::get(Context, APInt(64, 0));
+}
+
+// emitWhileStep - `while Cond do Body`のcodegen。WhileExprASTとFlatASTで共有する。
+template <typename NodeT>
+static void emitWhileStep(CodegenWalker<NodeT> &W, unsigned Stage, NodeT Cond, NodeT Body) {
+    // 値のスタックには(CondBB, BodyBB, EndBB, CondV, BodyV)が並ぶ。
+    switch (Stage) {
+        case 0:
+            beginLoop(W);
+            return W.eval(Cond);
+        case 1:
+            if (!W[3])
+                return W.ret(nullptr);
+            enterLoopBody(W[3], W[1], W[2]);
+            return W.eval(Body);
+        default:
+            W.ret(W[4] ? endLoop(W[0], W[2]) : nullptr);
+    }
+}
+
+// emitForStep - `for i = Start, Cond, Step in Body`のcodegen。ForExprASTとFlatASTで共有する。
+// SlotはiのスロットでiはCond, Step, Bodyから見える。Bodyの後にStepの値(省略したら1)を足す。
+template <typename NodeT>
+static void emitForStep(CodegenWalker<NodeT> &W, unsigned Stage, int Slot, NodeT Start,
+        NodeT Cond, NodeT Step, NodeT Body) {
+    // 値のスタックには(StartV, 変数のalloca, CondBB, BodyBB, EndBB, CondV, BodyV, StepV)が並ぶ。
+    switch (Stage) {
+        case 0:
+            return W.eval(Start);
+        case 1:
+            if (!W[0])
+                return W.ret(nullptr);
+            W.push(bindVariable(Slot, W[0]));
+            beginLoop(W);
+            return W.eval(Cond);
+        case 2:
+            if (!W[5])
+                return W.ret(nullptr);
+            enterLoopBody(W[5], W[3], W[4]);
+            return W.eval(Body);
+        case 3:
+            if (!W[6])
+                return W.ret(nullptr);
+            if (Step)
+                return W.eval(Step);
+            return W.push(ConstantInt::get(Context, APInt(64, 1)));
+        default: {
+            if (!W[7])
+                return W.ret(nullptr);
+            Value *CurV = Builder.CreateLoad(Type::getInt64Ty(Context), W[1]);
+            Builder.CreateStore(Builder.CreateAdd(CurV, W[7], "nextvar"), W[1]);
+            W.ret(endLoop(W[2], W[4]));
+        }
+    }
+}
+
+//===----------------------------------------------------------------------===//
+// Arrays
+// `def f(a[] n)`のように宣言した配列の引数は、i64*の先頭のポインタとi64の長さの二つの
+// 引数になり、C++からはf(long *a, long a_len, long n)として呼び出せる。ポインタにはnoaliasと
+// align 8を付けるので、Cのrestrictと同じく、書き込む配列が他の配列の引数と重なってはいけない。
+// 添字の範囲は調べない。
+// 組み込み関数len, sum, min, max, dotは配列の変数を受け取り、ReductionWidth個ずつの
+// ベクトルのループとして直接IRを作る。同じ名前の関数が定義されていればそちらを呼ぶ。
+//===----------------------------------------------------------------------===//
+
+namespace {
+    // 組み込みのリダクションが一度に処理する要素の数。<8 x i64>はAVX2では二つ、
+    // SSE2では四つのレジスタに分かれるので、その分だけ独立した累積値を持つことになる。
+    const unsigned ReductionWidth = 8;
+
+    enum ReductionKind { RK_Sum, RK_Min, RK_Max, RK_Dot };
+} // end anonymous namespace
+
+// lookupArray - スロットSlotの配列の(ポインタ, 長さ)を返す。配列でなければnullptr。
+static const std::pair<Value *, Value *> *lookupArray(int Slot) {
+    if (Slot < 0 || !SlotArrays[Slot].first)
+        return nullptr;
+    return &SlotArrays[Slot];
+}
+
+// emitElementPtr - スロットSlotの配列のi番目の要素のアドレス
+static Value *emitElementPtr(int Slot, Value *Index) {
+    const std::pair<Value *, Value *> *Arr = lookupArray(Slot);
+    if (!Arr)
+        return LogErrorV("Unknown array name");
+    return Builder.CreateInBoundsGEP(Type::getInt64Ty(Context), Arr->first, Index, "arrayidx");
+}
+
+static Value *emitLoadElement(int Slot, Value *Index) {
+    Value *Ptr = emitElementPtr(Slot, Index);
+    if (!Ptr)
+        return nullptr;
+    return Builder.CreateAlignedLoad(Type::getInt64Ty(Context), Ptr, Align(8), "elt");
+}
+
+static Value *emitStoreElement(int Slot, Value *Index, Value *V) {
+    Value *Ptr = emitElementPtr(Slot, Index);
+    if (!Ptr)
+        return nullptr;
+    Builder.CreateAlignedStore(V, Ptr, Align(8));
+    return V;
+}
+
+// vectorizedLoopID - 既にベクトル化したループに付けるメタデータ。LoopVectorizeが
+// もう一度ベクトル化しようとしないようにする。
+static MDNode *vectorizedLoopID() {
+    Metadata *Flag[] = {MDString::get(Context, "llvm.loop.isvectorized"),
+        ConstantAsMetadata::get(Builder.getInt32(1))};
+    Metadata *Ops[] = {nullptr, MDNode::get(Context, Flag)};
+    MDNode *ID = MDNode::getDistinct(Context, Ops);
+    ID->replaceOperandWith(0, ID);
+    return ID;
+}
+
+// combineReduction - 累積値AccにVを合わせる。スカラーでもベクトルでも良い。
+static Value *combineReduction(ReductionKind K, Value *Acc, Value *V) {
+    switch (K) {
+        case RK_Min:
+            return Builder.CreateBinaryIntrinsic(Intrinsic::smin, Acc, V, nullptr, "red.min");
+        case RK_Max:
+            return Builder.CreateBinaryIntrinsic(Intrinsic::smax, Acc, V, nullptr, "red.max");
+        default:
+            return Builder.CreateAdd(Acc, V, "red.add");
+    }
+}
+
+// emitReduction - 配列AのLen個の要素(dotならAとBの要素の積)をKで畳み込む。
+// 先頭からReductionWidth個ずつベクトルで読んで累積し、横方向に畳み込んだ後、
+// 残りの要素をスカラーで処理する。要素が無い場合はKの単位元を返す。
+static Value *emitReduction(ReductionKind K, Value *A, Value *B, Value *Len) {
+    Type *I64 = Type::getInt64Ty(Context);
+    auto *VecTy = FixedVectorType::get(I64, ReductionWidth);
+    Function *ParentFunc = Builder.GetInsertBlock()->getParent();
+    BasicBlock *EntryBB = Builder.GetInsertBlock();
+    BasicBlock *VecCondBB = BasicBlock::Create(Context, "red.vec.cond", ParentFunc);
+    BasicBlock *VecBodyBB = BasicBlock::Create(Context, "red.vec.body", ParentFunc);
+    BasicBlock *VecEndBB = BasicBlock::Create(Context, "red.vec.end", ParentFunc);
+    BasicBlock *CondBB = BasicBlock::Create(Context, "red.cond", ParentFunc);
+    BasicBlock *BodyBB = BasicBlock::Create(Context, "red.body", ParentFunc);
+    BasicBlock *EndBB = BasicBlock::Create(Context, "red.end", ParentFunc);
+
+    int64_t IdentityVal = K == RK_Min ? INT64_MAX : K == RK_Max ? INT64_MIN : 0;
+    Constant *Identity = ConstantInt::get(I64, IdentityVal, true);
+    Value *VecLen = Builder.CreateAnd(Len, ~uint64_t(ReductionWidth - 1), "red.veclen");
+    Builder.CreateBr(VecCondBB);
+
+    auto Load = [&](Type *Ty, Value *Base, Value *Index) -> Value * {
+        Value *Ptr = Builder.CreateInBoundsGEP(I64, Base, Index);
+        if (Ty != I64)
+            Ptr = Builder.CreateBitCast(Ptr, Ty->getPointerTo());
+        return Builder.CreateAlignedLoad(Ty, Ptr, Align(8));
+    };
+    auto LoadOperand = [&](Type *Ty, Value *Index) {
+        Value *V = Load(Ty, A, Index);
+        return B ? Builder.CreateMul(V, Load(Ty, B, Index), "red.mul") : V;
+    };
+
+    // ベクトルのループ
+    Builder.SetInsertPoint(VecCondBB);
+    PHINode *VecI = Builder.CreatePHI(I64, 2, "red.vec.i");
+    PHINode *VecAcc = Builder.CreatePHI(VecTy, 2, "red.vec.acc");
+    Builder.CreateCondBr(Builder.CreateICmpULT(VecI, VecLen), VecBodyBB, VecEndBB);
+
+    Builder.SetInsertPoint(VecBodyBB);
+    Value *NewVecAcc = combineReduction(K, VecAcc, LoadOperand(VecTy, VecI));
+    Value *NextVecI = Builder.CreateAdd(VecI, ConstantInt::get(I64, ReductionWidth));
+    Builder.CreateBr(VecCondBB)->setMetadata(LLVMContext::MD_loop, vectorizedLoopID());
+    VecI->addIncoming(ConstantInt::get(I64, 0), EntryBB);
+    VecI->addIncoming(NextVecI, VecBodyBB);
+    VecAcc->addIncoming(ConstantVector::getSplat(VecTy->getElementCount(), Identity), EntryBB);
+    VecAcc->addIncoming(NewVecAcc, VecBodyBB);
+
+    Builder.SetInsertPoint(VecEndBB);
+    Value *Partial = K == RK_Min ? Builder.CreateIntMinReduce(VecAcc, true)
+                   : K == RK_Max ? Builder.CreateIntMaxReduce(VecAcc, true)
+                                 : Builder.CreateAddReduce(VecAcc);
+    Builder.CreateBr(CondBB);
+
+    // 残りの要素のスカラーのループ
+    Builder.SetInsertPoint(CondBB);
+    PHINode *I = Builder.CreatePHI(I64, 2, "red.i");
+    PHINode *Acc = Builder.CreatePHI(I64, 2, "red.acc");
+    Builder.CreateCondBr(Builder.CreateICmpULT(I, Len), BodyBB, EndBB);
+
+    Builder.SetInsertPoint(BodyBB);
+    Value *NewAcc = combineReduction(K, Acc, LoadOperand(I64, I));
+    Value *NextI = Builder.CreateAdd(I, ConstantInt::get(I64, 1));
+    Builder.CreateBr(CondBB)->setMetadata(LLVMContext::MD_loop, vectorizedLoopID());
+    I->addIncoming(VecLen, VecEndBB);
+    I->addIncoming(NextI, BodyBB);
+    Acc->addIncoming(Partial, VecEndBB);
+    Acc->addIncoming(NewAcc, BodyBB);
+
+    Builder.SetInsertPoint(EndBB);
+    return Acc;
+}
+
+static bool isArrayBuiltin(StringRef Name) {
+    return Name == "len" || Name == "sum" || Name == "min" || Name == "max" || Name == "dot";
+}
+
+// emitArrayBuiltin - 組み込み関数Nameの呼び出し。ArgSlot(i, S)はi番目の引数が変数なら
+// そのスロットをSに入れてtrueを返す。
+static Value *emitArrayBuiltin(StringRef Name, unsigned NumArgs,
+        function_ref<bool(unsigned, int &)> ArgSlot) {
+    unsigned NumArrays = Name == "dot" ? 2 : 1;
+    if (NumArgs != NumArrays)
         return LogErrorV("Incorrect # arguments passed");
+    const std::pair<Value *, Value *> *Arrays[2];
+    for (unsigned i = 0; i < NumArrays; ++i) {
+        int S;
+        if (!ArgSlot(i, S) || !(Arrays[i] = lookupArray(S)))
+            return LogErrorV("expected an array argument");
+    }
 
-    std::vector<Value *> argsV;
-    // 3. argsをそれぞれcodegenしllvm::Valueにし、argsVにpush_backする。
-    for (unsigned i = 0, e = args.size(); i != e; ++i) {
-        argsV.push_back(args[i]->codegen());
-        if (!argsV.back())
-            return nullptr;
+    if (Name == "len")
+        return Arrays[0]->second;
+    if (Name == "dot")
+        return emitReduction(RK_Dot, Arrays[0]->first, Arrays[1]->first,
+                Builder.CreateBinaryIntrinsic(Intrinsic::umin, Arrays[0]->second,
+                    Arrays[1]->second, nullptr, "dot.len"));
+    ReductionKind K = Name == "sum" ? RK_Sum : Name == "min" ? RK_Min : RK_Max;
+    return emitReduction(K, Arrays[0]->first, nullptr, Arrays[0]->second);
+}
+
+// getNumMCArgs - MC言語から見たFの引数の数。配列の引数はポインタと長さの二つで一つ。
+static unsigned getNumMCArgs(Function *F) {
+    unsigned N = 0;
+    for (auto &Arg : F->args())
+        if (!Arg.getType()->isPointerTy())
+            ++N;
+    return N;
+}
+
+// createFunction - 引数がArgsの関数NameをmyModuleに作る。
+// MC言語では変数の型も関数の返り値もintの為、関数の返り値をInt64にする。
+// 配列の引数(ArrayArgs[i]がtrue)はi64*のポインタとi64の長さの二つになる。
+static Function *createFunction(StringRef Name, ArrayRef<StringRef> Args,
+        ArrayRef<bool> ArrayArgs) {
+    std::vector<Type *> prototype;
+    for (unsigned i = 0; i < Args.size(); ++i) {
+        if (ArrayArgs[i])
+            prototype.push_back(Type::getInt64PtrTy(Context));
+        prototype.push_back(Type::getInt64Ty(Context));
+    }
+    FunctionType *FT =
+        FunctionType::get(Type::getInt64Ty(Context), prototype, false);
+    // https://llvm.org/doxygen/classllvm_1_1Function.html
+    // llvm::Functionは関数のIRを表現するクラス
+    Function *F =
+        Function::Create(FT, Function::ExternalLinkage, Name, myModule.get());
+
+    // 引数の名前を付ける
+    unsigned LI = 0;
+    for (unsigned i = 0; i < Args.size(); ++i) {
+        if (ArrayArgs[i]) {
+            F->addParamAttr(LI, Attribute::NoAlias);
+            F->addParamAttr(LI, Attribute::getWithAlignment(Context, Align(8)));
+            F->getArg(LI++)->setName(Args[i]);
+            F->getArg(LI++)->setName(Args[i] + ".len");
+        } else {
+            F->getArg(LI++)->setName(Args[i]);
+        }
     }
 
-    // 4. IRBuilderのCreateCallを呼び出し、Valueをreturnする。
-    return Builder.CreateCall(CalleeF, argsV, "calltmp");
+    return F;
 }
 
-Value *BinaryAST::codegen() {
-    // 二項演算子の両方の引数をllvm::Valueにする。
-    Value *L = LHS->codegen();
-    Value *R = RHS->codegen();
-    if (!L || !R)
+// declareEarlierFunction - パイプラインのワーカーで、今codegenしている定義より前に
+// 定義された関数Symを宣言する。そのような関数が無ければnullptr。
+// 中身は他のワーカーのモジュールにあり、リンクする時に解決される。
+static Function *declareEarlierFunction(unsigned Sym) {
+    if (!PipelineSignatures)
         return nullptr;
+    const FunctionSignature &S = PipelineSignatures[Sym];
+    unsigned Ordinal = S.Ordinal.load(std::memory_order_acquire);
+    if (!Ordinal || Ordinal >= PipelineOrdinal)
+        return nullptr;
+    return createFunction(SymbolSource->getSymbolName(Sym), S.Args, S.ArrayArgs);
+}
+
+// getFunction - シンボルSymの名前のmyModuleの関数。無ければnullptr。
+// 見つかった関数はSymbolFunctionsに覚えておき、次からは名前で探さない。
+static Function *getFunction(unsigned Sym) {
+    if (Sym >= SymbolFunctions.size())
+        SymbolFunctions.resize(SymbolSource->getNumSymbols());
+    Function *&F = SymbolFunctions[Sym];
+    if (!F)
+        F = myModule->getFunction(SymbolSource->getSymbolName(Sym));
+    if (!F)
+        F = declareEarlierFunction(Sym);
+    return F;
+}
+
+// emitCallStep - シンボルCalleeの関数の呼び出しのcodegen。CallExprASTとFlatASTで共有する。
+// Argsは引数の式で、ArgSlotはemitArrayBuiltinと同じ。Stage番目の段階でStage番目の引数を扱う。
+// 配列の引数には配列の変数を渡し、そのポインタと長さをそのまま渡す。
+template <typename NodeT>
+static void emitCallStep(CodegenWalker<NodeT> &W, unsigned Stage, unsigned Callee,
+        ArrayRef<NodeT> Args, function_ref<bool(unsigned, int &)> ArgSlot) {
+    // 値のスタックには呼び出す関数と、IRの引数が並ぶ。
+    if (Stage == 0) {
+        Function *CalleeF = getFunction(Callee);
+        if (!CalleeF) {
+            StringRef Name = SymbolSource->getSymbolName(Callee);
+            if (isArrayBuiltin(Name))
+                return W.ret(emitArrayBuiltin(Name, Args.size(), ArgSlot));
+            return W.ret(LogErrorV("Unknown function referenced"));
+        }
+        if (getNumMCArgs(CalleeF) != Args.size())
+            return W.ret(LogErrorV("Incorrect # arguments passed"));
+        W.push(CalleeF);
+    } else if (!W.back()) {
+        // 一つ前の引数のcodegenに失敗した
+        return W.ret(nullptr);
+    }
+
+    Function *CalleeF = cast<Function>(W[0]);
+    if (Stage == Args.size())
+        return W.ret(Builder.CreateCall(CalleeF, W.values().drop_front(), "calltmp"));
+    if (!CalleeF->getArg(W.size() - 1)->getType()->isPointerTy())
+        return W.eval(Args[Stage]);
+    int S;
+    const std::pair<Value *, Value *> *Arr;
+    if (!ArgSlot(Stage, S) || !(Arr = lookupArray(S)))
+        return W.ret(LogErrorV("expected an array argument"));
+    W.push(Arr->first);
+    W.push(Arr->second);
+}
+
+// TODO 2.4: 引数のcodegenを実装してみよう
+void VariableExprAST::codegenStep(CodegenWalker<ExprAST *> &W, unsigned) {
+    // パーサーが変数の束縛をスロットに解決しているので、そのスロットのallocaから値を読む。
+    W.ret(emitVariable(Slot));
+}
+
+// TODO 2.5: 関数呼び出しのcodegenを実装してみよう
+void CallExprAST::codegenStep(CodegenWalker<ExprAST *> &W, unsigned Stage) {
+    // 1. getFunctionでcalleeを探し、無ければ組み込み関数か確かめる。
+    // 2. 呼び出し先の引数の数とargsのサイズを比べる。
+    // 3. argsをそれぞれcodegenし、配列の引数なら配列のポインタと長さを渡す。
+    // 4. IRBuilderのCreateCallを呼び出し、Valueをreturnする。
+    // これらはFlatASTと共有するemitCallStepで行う。
+    emitCallStep(W, Stage, callee, args, [&](unsigned i, int &Slot) {
+        ExprAST *Index;
+        return args[i]->getAssignTarget(Slot, Index) && !Index;
+    });
+}
+
+// emitIndexStep - `a[Index]`のcodegen。IndexExprASTとFlatASTで共有する。Slotはaのスロット。
+template <typename NodeT>
+static void emitIndexStep(CodegenWalker<NodeT> &W, unsigned Stage, int Slot, NodeT Index) {
+    if (Stage == 0)
+        return W.eval(Index);
+    W.ret(W[0] ? emitLoadElement(Slot, W[0]) : nullptr);
+}
 
+void IndexExprAST::codegenStep(CodegenWalker<ExprAST *> &W, unsigned Stage) {
+    emitIndexStep(W, Stage, Slot, Index);
+}
+
+// emitBinaryOp - 二項演算子のIRを作る。BinaryASTとFlatASTで共有する。
+static Value *emitBinaryOp(char Op, Value *L, Value *R) {
     switch (Op) {
         case '+':
             // LLVM IR Builerを使い、この二項演算のIRを作る
@@ -90,32 +563,43 @@ Value *BinaryAST::codegen() {
         case '<':
             L = Builder.CreateICmp(llvm::CmpInst::ICMP_SLT, L, R, "slttmp");
             return Builder.CreateIntCast(L, Type::getInt64Ty(Context), true, "cast_i1_to_i64");
+        case ':':
+            // 両方を評価した後、右の値を返す
+            return R;
         default:
             return LogErrorV("invalid binary operator");
     }
 }
 
-Function *PrototypeAST::codegen() {
-    // MC言語では変数の型も関数の返り値もintの為、関数の返り値をInt64にする。
-    std::vector<Type *> prototype(args.size(), Type::getInt64Ty(Context));
-    FunctionType *FT =
-        FunctionType::get(Type::getInt64Ty(Context), prototype, false);
-    // https://llvm.org/doxygen/classllvm_1_1Function.html
-    // llvm::Functionは関数のIRを表現するクラス
-    Function *F =
-        Function::Create(FT, Function::ExternalLinkage, Name, myModule.get());
+// emitBinaryStep - `L Op R`のcodegen。BinaryASTとFlatASTで共有する。
+template <typename NodeT>
+static void emitBinaryStep(CodegenWalker<NodeT> &W, unsigned Stage, char Op, NodeT L, NodeT R) {
+    // 二項演算子の両方の引数をllvm::Valueにしてから、この二項演算のIRを作る。
+    switch (Stage) {
+        case 0:
+            return W.eval(L);
+        case 1:
+            return W.eval(R);
+        default:
+            W.ret(W[0] && W[1] ? emitBinaryOp(Op, W[0], W[1]) : nullptr);
+    }
+}
 
-    // 引数の名前を付ける
-    unsigned i = 0;
-    for (auto &Arg : F->args())
-        Arg.setName(args[i++]);
+void BinaryAST::codegenStep(CodegenWalker<ExprAST *> &W, unsigned Stage) {
+    emitBinaryStep(W, Stage, Op, LHS, RHS);
+}
 
-    return F;
+Function *PrototypeAST::codegen() {
+    return createFunction(Name, args, arrayArgs);
 }
 
-Function *FunctionAST::codegen() {
+// beginFunction - protoの関数を用意し、エントリーブロックと引数のスロットをセットする。
+// SlotNamesはこの関数のスロットごとの変数名。
+static Function *beginFunction(PrototypeAST *proto, ArrayRef<StringRef> SlotNames) {
     // この関数が既にModuleに登録されているか確認
-    Function *function = myModule->getFunction(proto->getFunctionName());
+    unsigned Sym = proto->getSymbol();
+    Function *function = Sym == NoSymbol ? myModule->getFunction(proto->getFunctionName())
+                                         : getFunction(Sym);
     // 関数名が見つからなかったら、新しくこの関数のIRクラスを作る。
     if (!function)
         function = proto->codegen();
@@ -126,18 +610,49 @@ Function *FunctionAST::codegen() {
     BasicBlock *BB = BasicBlock::Create(Context, "entry", function);
     Builder.SetInsertPoint(BB);
 
-    // Record the function arguments in the NamedValues map.
-    NamedValues.clear();
-    for (auto &Arg : function->args())
-        NamedValues[Arg.getName()] = &Arg;
+    // 引数にも代入できるように、引数の値をallocaに入れてスロットに登録する。
+    // i番目の引数のスロットはiで、配列の引数はポインタと長さをSlotArraysに登録する。
+    CurSlotNames = SlotNames;
+    SlotValues.assign(SlotNames.size(), nullptr);
+    SlotArrays.assign(SlotNames.size(), {nullptr, nullptr});
+    auto ArgIt = function->arg_begin();
+    for (unsigned i = 0; i < proto->getArgs().size(); ++i) {
+        Argument *Arg = &*ArgIt++;
+        if (proto->isArrayArg(i)) {
+            SlotArrays[i] = {Arg, &*ArgIt++};
+            continue;
+        }
+        AllocaInst *Alloca = createEntryBlockAlloca(function, Arg->getName() + ".addr");
+        Builder.CreateStore(Arg, Alloca);
+        SlotValues[i] = Alloca;
+    }
+    return function;
+}
 
-    // 関数のbody(ExprASTから継承されたNumberASTかBinaryAST)をcodegenする
-    if (Value *RetVal = body->codegen()) {
+// promoteAllocas - エントリーブロックの変数のallocaを全てSSAのレジスタに昇格する(mem2reg)。
+// 代入もループも無い関数では、引数をallocaに入れる前と全く同じIRに戻る。
+static void promoteAllocas(Function &F) {
+    std::vector<AllocaInst *> Allocas;
+    for (auto &I : F.getEntryBlock())
+        if (auto *AI = dyn_cast<AllocaInst>(&I))
+            if (isAllocaPromotable(AI))
+                Allocas.push_back(AI);
+    if (Allocas.empty())
+        return;
+    DominatorTree DT(F);
+    PromoteMemToReg(Allocas, DT);
+}
+
+// finishFunction - bodyの値をreturnして関数を検証する。bodyがnullptrなら関数を消す。
+static Function *finishFunction(Function *function, Value *RetVal) {
+    if (RetVal) {
         // returnのIRを作る
         Builder.CreateRet(RetVal);
+        promoteAllocas(*function);
 
         // https://llvm.org/doxygen/Verifier_8h.html
         // 関数の検証
+        PhaseTimer Timer(PhaseVerify);
         verifyFunction(*function);
 
         return function;
@@ -145,117 +660,312 @@ Function *FunctionAST::codegen() {
 
     // もし関数のbodyがnullptrなら、この関数をModuleから消す。
     function->eraseFromParent();
+    SymbolFunctions.clear();
     return nullptr;
 }
 
-Value *IfExprAST::codegen() {
-    // if x < 5 then x + 3 else x - 5;
-    // というコードが入力だと考える。
-    // Cond->codegen()によって"x < 5"のcondition部分がcodegenされ、その返り値(int)が
-    // CondVに格納される。
-    Value *CondV = Cond->codegen();
-    if (!CondV)
+Function *FunctionAST::codegen() {
+    Function *function = beginFunction(proto, slotNames);
+    if (!function)
         return nullptr;
 
-    // CondVはint64でtrueなら0以外、falseなら0が入っているため、CreateICmpNEを用いて
-    // CondVが0(false)とnot-equalかどうか判定し、CondVをbool型にする。
-    CondV = Builder.CreateICmpNE(
-            CondV, ConstantInt::get(Context, APInt(64, 0)), "ifcond");
-    // if文を呼んでいる関数の名前
+    // 関数のbody(ExprASTから継承されたNumberASTかBinaryAST)をcodegenする
+    return finishFunction(function, body->codegen());
+}
+
+// emitIfStep - `if Cond then Then else Else`のcodegen。IfExprASTとFlatASTで共有する。
+template <typename NodeT>
+static void emitIfStep(CodegenWalker<NodeT> &W, unsigned Stage, NodeT Cond, NodeT Then,
+        NodeT Else) {
+    // 値のスタックには(CondV, ThenBB, ElseBB, MergeBB, ThenV, ElseV)が並ぶ。
     Function *ParentFunc = Builder.GetInsertBlock()->getParent();
+    switch (Stage) {
+        case 0:
+            // if x < 5 then x + 3 else x - 5;
+            // というコードが入力だと考える。
+            // まず"x < 5"のcondition部分をcodegenし、その値(int)がW[0]に積まれる。
+            return W.eval(Cond);
+        case 1: {
+            if (!W[0])
+                return W.ret(nullptr);
+            // CondVはint64でtrueなら0以外、falseなら0が入っているため、CreateICmpNEを用いて
+            // CondVが0(false)とnot-equalかどうか判定し、CondVをbool型にする。
+            Value *CondV = Builder.CreateICmpNE(
+                    W[0], ConstantInt::get(Context, APInt(64, 0)), "ifcond");
 
-    // "thenだった場合"と"elseだった場合"のブロックを作り、ラベルを付ける。
-    // "ifcont"はif文が"then"と"else"の処理の後、二つのコントロールフローを
-    // マージするブロック。
-    BasicBlock *ThenBB =
-        BasicBlock::Create(Context, "then", ParentFunc);
-    BasicBlock *ElseBB = BasicBlock::Create(Context, "else");
-    BasicBlock *MergeBB = BasicBlock::Create(Context, "ifcont");
-    // condition, trueだった場合のブロック、falseだった場合のブロックを登録する。
-    // https://llvm.org/doxygen/classllvm_1_1IRBuilder.html#a3393497feaca1880ab3168ee3db1d7a4
-    Builder.CreateCondBr(CondV, ThenBB, ElseBB);
-
-    // "then"のブロックを作り、その内容(expression)をcodegenする。
-    Builder.SetInsertPoint(ThenBB);
-    Value *ThenV = Then->codegen();
-    if (!ThenV)
-        return nullptr;
-    // "then"のブロックから出る時は"ifcont"ブロックに飛ぶ。
-    Builder.CreateBr(MergeBB);
-    // ThenBBをアップデートする。
-    ThenBB = Builder.GetInsertBlock();
-
-    // TODO 3.4: "else"ブロックのcodegenを実装しよう
-    // "then"ブロックを参考に、"else"ブロックのcodegenを実装して下さい。
-    // 注意: 20行下のコメントアウトを外して下さい。
-    ParentFunc->getBasicBlockList().push_back(ElseBB);
-    Builder.SetInsertPoint(ElseBB);
-    Value *ElseV = Else->codegen();
-    if (!ElseV)
+            // "thenだった場合"と"elseだった場合"のブロックを作り、ラベルを付ける。
+            // "ifcont"はif文が"then"と"else"の処理の後、二つのコントロールフローを
+            // マージするブロック。
+            BasicBlock *ThenBB =
+                BasicBlock::Create(Context, "then", ParentFunc);
+            BasicBlock *ElseBB = BasicBlock::Create(Context, "else");
+            BasicBlock *MergeBB = BasicBlock::Create(Context, "ifcont");
+            // condition, trueだった場合のブロック、falseだった場合のブロックを登録する。
+            // https://llvm.org/doxygen/classllvm_1_1IRBuilder.html#a3393497feaca1880ab3168ee3db1d7a4
+            Builder.CreateCondBr(CondV, ThenBB, ElseBB);
+            W.push(ThenBB);
+            W.push(ElseBB);
+            W.push(MergeBB);
+
+            // "then"のブロックに入り、その内容(expression)をcodegenする。
+            Builder.SetInsertPoint(ThenBB);
+            return W.eval(Then);
+        }
+        case 2: {
+            if (!W[4])
+                return W.ret(nullptr);
+            // "then"のブロックから出る時は"ifcont"ブロックに飛ぶ。
+            Builder.CreateBr(cast<BasicBlock>(W[3]));
+            // ThenBBをアップデートする。
+            W[1] = Builder.GetInsertBlock();
+
+            // TODO 3.4: "else"ブロックのcodegenを実装しよう
+            // "then"ブロックを参考に、"else"ブロックのcodegenを実装して下さい。
+            BasicBlock *ElseBB = cast<BasicBlock>(W[2]);
+            ParentFunc->getBasicBlockList().push_back(ElseBB);
+            Builder.SetInsertPoint(ElseBB);
+            return W.eval(Else);
+        }
+        default: {
+            if (!W[5])
+                return W.ret(nullptr);
+            BasicBlock *MergeBB = cast<BasicBlock>(W[3]);
+            Builder.CreateBr(MergeBB);
+            BasicBlock *ElseBB = Builder.GetInsertBlock();
+
+            // "ifcont"ブロックのcodegen
+            ParentFunc->getBasicBlockList().push_back(MergeBB);
+            Builder.SetInsertPoint(MergeBB);
+            // https://llvm.org/docs/LangRef.html#phi-instruction
+            // PHINodeは、"then"ブロックのValueか"else"ブロックのValue
+            // どちらをifブロック全体の返り値にするかを実行時に選択します。
+            // もちろん、"then"ブロックに入るconditionなら前者が選ばれ、そうでなければ後者な訳です。
+            // LLVM IRはSSAという"全ての変数が一度だけassignされる"規約があるため、
+            // 値を上書きすることが出来ません。従って、このように実行時にコントロールフローの
+            // 値を選択する機能が必要です。
+            PHINode *PN =
+                Builder.CreatePHI(Type::getInt64Ty(Context), 2, "iftmp");
+
+            PN->addIncoming(W[4], cast<BasicBlock>(W[1]));
+            PN->addIncoming(W[5], ElseBB);
+            W.ret(PN);
+        }
+    }
+}
+
+void IfExprAST::codegenStep(CodegenWalker<ExprAST *> &W, unsigned Stage) {
+    emitIfStep(W, Stage, Cond, Then, Else);
+}
+
+// emitVarStep - `var x = Init, ... in Body`のcodegen。VarExprASTとFlatASTで共有する。
+// Slot(i)とInit(i)はi番目の変数のスロットと初期値の式。パーサーがスコープを解決しているので、
+// 初期値を評価した順に変数を作るだけで良い。
+template <typename NodeT, typename SlotFnT, typename InitFnT>
+static void emitVarStep(CodegenWalker<NodeT> &W, unsigned Stage, unsigned NumVars, SlotFnT Slot,
+        InitFnT Init, NodeT Body) {
+    // 値のスタックには変数ごとの初期値が並び、最後にbodyの値が来る。
+    if (Stage > 0 && Stage <= NumVars) {
+        Value *InitV = W.back();
+        if (!InitV)
+            return W.ret(nullptr);
+        bindVariable(Slot(Stage - 1), InitV);
+    }
+    if (Stage < NumVars)
+        return W.eval(Init(Stage));
+    if (Stage == NumVars)
+        return W.eval(Body);
+    W.ret(W.back());
+}
+
+void VarExprAST::codegenStep(CodegenWalker<ExprAST *> &W, unsigned Stage) {
+    emitVarStep(W, Stage, Vars.size(), [&](unsigned i) { return Vars[i].first; },
+            [&](unsigned i) { return Vars[i].second; }, Body);
+}
+
+// emitAssignStep - `x = Val`か`a[Index] = Val`のcodegen。AssignExprASTとFlatASTで共有する。
+// Slotはxかaのスロット。Indexは配列の要素に代入する場合の添字で、変数に代入する場合は
+// nullptr(FlatASTなら0)。
+template <typename NodeT>
+static void emitAssignStep(CodegenWalker<NodeT> &W, unsigned Stage, int Slot, NodeT Index,
+        NodeT Val) {
+    // 値のスタックには(IndexV, V)が並ぶ。
+    switch (Stage) {
+        case 0:
+            if (Index)
+                return W.eval(Index);
+            return W.push(nullptr);
+        case 1:
+            if (Index && !W[0])
+                return W.ret(nullptr);
+            return W.eval(Val);
+        default:
+            if (!W[1])
+                return W.ret(nullptr);
+            W.ret(Index ? emitStoreElement(Slot, W[0], W[1]) : emitAssign(Slot, W[1]));
+    }
+}
+
+void AssignExprAST::codegenStep(CodegenWalker<ExprAST *> &W, unsigned Stage) {
+    emitAssignStep(W, Stage, Slot, Index, Val);
+}
+
+void ForExprAST::codegenStep(CodegenWalker<ExprAST *> &W, unsigned Stage) {
+    emitForStep(W, Stage, Slot, Start, Cond, Step, Body);
+}
+
+void WhileExprAST::codegenStep(CodegenWalker<ExprAST *> &W, unsigned Stage) {
+    emitWhileStep(W, Stage, Cond, Body);
+}
+
+// FlatAST::codegenStep - flatast.hの配列で表したASTのcodegenの一段階。
+// 各ノードの種類でswitchし、上のクラス階層のcodegenと同じemit*Stepを呼んで全く同じIRを作る。
+void FlatAST::codegenStep(CodegenWalker<uint32_t> &W, uint32_t Node, unsigned Stage) {
+    switch (Kinds[Node]) {
+        case NumberNode:
+            return W.ret(ConstantInt::get(Context, APInt(64, Consts[Lhs[Node]], true)));
+        case VariableNode:
+            return W.ret(emitVariable(int(Lhs[Node])));
+        case BinaryNode:
+            return emitBinaryStep(W, Stage, (char)Third[Node], Lhs[Node], Rhs[Node]);
+        case CallNode: {
+            ArrayRef<uint32_t> Args = makeArrayRef(ArgList).slice(Rhs[Node], Third[Node]);
+            return emitCallStep(W, Stage, Lhs[Node], Args, [&](unsigned i, int &Slot) {
+                if (Kinds[Args[i]] != VariableNode)
+                    return false;
+                Slot = int(Lhs[Args[i]]);
+                return true;
+            });
+        }
+        case IfNode:
+            return emitIfStep(W, Stage, Lhs[Node], Rhs[Node], Third[Node]);
+        case VarNode: {
+            const uint32_t *Vars = &ArgList[Lhs[Node]];
+            return emitVarStep(W, Stage, Rhs[Node], [&](unsigned i) { return int(Vars[2 * i]); },
+                    [&](unsigned i) { return Vars[2 * i + 1]; }, Third[Node]);
+        }
+        case AssignNode:
+            return emitAssignStep(W, Stage, int(Lhs[Node]), Third[Node], Rhs[Node]);
+        case IndexNode:
+            return emitIndexStep(W, Stage, int(Lhs[Node]), Rhs[Node]);
+        case ForNode: {
+            const uint32_t *Ops = &ArgList[Lhs[Node]];
+            return emitForStep(W, Stage, int(Ops[0]), Ops[1], Ops[2], Ops[3], Ops[4]);
+        }
+        case WhileNode:
+            return emitWhileStep(W, Stage, Lhs[Node], Rhs[Node]);
+        default:
+            return W.ret(LogErrorV("invalid flat AST node"));
+    }
+}
+
+Function *FlatAST::codegen() {
+    Function *function = beginFunction(Proto, SlotNames);
+    if (!function)
         return nullptr;
-    Builder.CreateBr(MergeBB);
-    ElseBB = Builder.GetInsertBlock();
-
-    // "ifcont"ブロックのcodegen
-    ParentFunc->getBasicBlockList().push_back(MergeBB);
-    Builder.SetInsertPoint(MergeBB);
-    // https://llvm.org/docs/LangRef.html#phi-instruction
-    // PHINodeは、"then"ブロックのValueか"else"ブロックのValue
-    // どちらをifブロック全体の返り値にするかを実行時に選択します。
-    // もちろん、"then"ブロックに入るconditionなら前者が選ばれ、そうでなければ後者な訳です。
-    // LLVM IRはSSAという"全ての変数が一度だけassignされる"規約があるため、
-    // 値を上書きすることが出来ません。従って、このように実行時にコントロールフローの
-    // 値を選択する機能が必要です。
-    PHINode *PN =
-        Builder.CreatePHI(Type::getInt64Ty(Context), 2, "iftmp");
-
-    PN->addIncoming(ThenV, ThenBB);
-    // TODO 3.4:を実装したらコメントアウトを外して下さい。
-    PN->addIncoming(ElseV, ElseBB);
-    return PN;
+    return finishFunction(function, CodegenWalker<uint32_t>().run(Body,
+                [this](CodegenWalker<uint32_t> &W, uint32_t Node, unsigned Stage) {
+                    codegenStep(W, Node, Stage);
+                }));
 }
 
 //===----------------------------------------------------------------------===//
 // MC コンパイラエントリーポイント
 // mc.cppでMainLoop()が呼ばれます。MainLoopは各top level expressionに対して
-// HandleTopLevelExpressionを呼び、その中でASTを作り再帰的にcodegenをしています。
+// HandleTopLevelExpressionを呼び、その中でASTを作りcodegenをしています。
 //===----------------------------------------------------------------------===//
 
-static std::string streamstr;
-static llvm::raw_string_ostream stream(streamstr);
-static void HandleDefinition() {
-    if (auto FnAST = ParseDefinition()) {
-        if (auto *FnIR = FnAST->codegen()) {
-            FnIR->print(stream);
-        }
-    } else {
+// --emit=llの出力先。各関数のIRは、codegenと関数単位の最適化が終わったらすぐにここに書き出す。
+// IRを出力しない場合はnullptrで、IRのテキストを作る手間も掛からない。
+static thread_local raw_ostream *IRStream = nullptr;
+
+// codegenOrSkip - パースしたFnASTをcodegenする。パースに失敗していたらトークンを一つ読み飛ばす。
+// FnASTはクラス階層のFunctionASTか、--flat-astの場合はFlatAST。
+template <typename FnASTT> static Function *codegenOrSkip(FnASTT *FnAST) {
+    if (!FnAST) {
+        getNextToken();
+        return nullptr;
+    }
+    PhaseTimer Timer(PhaseCodegen);
+    return FnAST->codegen();
+}
+
+// codegenDefinition - Bで関数定義をパースし、codegenして最適化する。--cache-dirが指定されていれば、
+// この定義のトークン列で、キャッシュからIRを読むか、キャッシュに保存する。
+template <typename BuilderT> static Function *codegenDefinition(BuilderT &B) {
+    size_t TokBegin = lexer.getTokIndex();
+    unsigned Evaluated = ConstCallsEvaluated;
+    auto FnAST = ParseDefinition(B);
+    if (!FnAST) {
         getNextToken();
+        return nullptr;
+    }
+
+    // コンパイル時に評価した呼び出しの結果は呼び出し先の中身で決まり、それはキーに
+    // 含まれていないので、そのような定義はキャッシュしない。プロファイルのカウンタや回数も
+    // キーに含まれていないので、--profile-generate/--profile-useでもキャッシュしない。
+    bool UseCache = FnCache.enabled() && ConstCallsEvaluated == Evaluated &&
+                    Opts.ProfileGenerate.empty() && Opts.ProfileUse.empty();
+    std::string Key;
+    Function *FnIR = nullptr;
+    if (UseCache) {
+        // CurTokは定義の次のトークンなので、その手前までがこの定義。
+        Key = FnCache.computeKey(TokBegin, lexer.getTokIndex(), *myModule);
+        FnIR = FnCache.load(Key, *myModule);
+    }
+
+    if (!FnIR) {
+        PhaseTimer Timer(PhaseCodegen);
+        FnIR = FnAST->codegen();
+        if (!FnIR)
+            return nullptr;
+        applyProfile(*FnIR);
+        optimizeFunction(*FnIR);
+        if (UseCache)
+            FnCache.store(Key, *FnIR);
     }
+    addConstEvalFunction(*FnAST);
+    return FnIR;
+}
+
+static void HandleDefinition() {
+    Function *FnIR = Opts.FlatAST ? codegenDefinition(FlatBuilder)
+                                  : codegenDefinition(ClassBuilder);
+    if (FnIR) {
+        recordFunction(*FnIR);
+        if (IRStream)
+            FnIR->print(*IRStream);
+    }
+    // この定義のASTはもう使わないので、まとめて解放する。
+    ASTArena.Reset();
+    FlatBuilder.AST.clear();
 }
 
 // その名の通りtop level expressionをcodegenします。例えば、「2+1;3+3;」というファイルが
 // 入力だった場合、この関数は最初の「2+1」をcodegenして返ります。(そしてMainLoopからまだ呼び出されます)
 static void HandleTopLevelExpression() {
-    // ここでテキストファイルを全てASTにします。
-    if (auto FnAST = ParseTopLevelExpr()) {
-        // できたASTをcodegenします。
-        if (auto *FnIR = FnAST->codegen()) {
-            streamstr = "";
-            FnIR->print(stream);
-        }
-    } else {
-        // エラー
-        getNextToken();
+    // ここでテキストファイルを全てASTにし、できたASTをcodegenします。
+    Function *FnIR = Opts.FlatAST ? codegenOrSkip(ParseTopLevelExpr(FlatBuilder))
+                                  : codegenOrSkip(ParseTopLevelExpr());
+    if (FnIR) {
+        optimizeFunction(*FnIR);
+        recordFunction(*FnIR);
+        if (IRStream)
+            FnIR->print(*IRStream);
     }
+    ASTArena.Reset();
+    FlatBuilder.AST.clear();
 }
 
 static void MainLoop() {
     myModule = std::make_unique<Module>("my cool jit", Context);
+    SymbolFunctions.clear();
+    // 最適化パスがターゲットの情報を使えるように、先にtriple/data layoutをセットしておく。
+    myModule->setTargetTriple(TheTargetMachine->getTargetTriple().str());
+    myModule->setDataLayout(TheTargetMachine->createDataLayout());
+    attachProfileSummary(*myModule);
     while (true) {
         switch (CurTok) {
             case tok_eof:
-                // ここで最終的なLLVM IRをプリントしています。
-                fprintf(stderr, "%s", stream.str().c_str());
                 return;
             case tok_def:
                 HandleDefinition();
@@ -0,0 +1,117 @@
+//===----------------------------------------------------------------------===//
+// Compiler Library
+// mc::Compilerは、一つの.mcファイルをLLVM IRにし、オブジェクトファイルを書き出すための
+// インターフェースです。mc.cppのmain関数も、--batchのドライバーもこれを使います。
+// コンパイラの状態(lexer, CurTok, BinopPrecedence, Context, Builder, myModule,
+// SlotValues, IRStream, TheTargetMachine等)は全てthread_localになっているので、
+// 別々のスレッドで動くCompilerは互いに干渉せず、並列にコンパイルできます。
+// Compiler自身は状態を持たず、呼び出したスレッドの状態を使うので、一つのスレッドで同時に
+// 使えるのは一つだけです。二つ目を作った場合は、状態を壊す前にエラーで終了します。
+//===----------------------------------------------------------------------===//
+
+namespace mc {
+
+// このスレッドにmc::Compilerがあるか
+static thread_local bool CompilerActive = false;
+
+class Compiler {
+    public:
+        Compiler() {
+            if (CompilerActive)
+                report_fatal_error("only one mc::Compiler can be used on a thread at a time",
+                        false);
+            CompilerActive = true;
+        }
+        ~Compiler() { CompilerActive = false; }
+        Compiler(const Compiler &) = delete;
+        Compiler &operator=(const Compiler &) = delete;
+
+        // compile - InputFileを読み込み、全ての関数定義とtop level expressionをmyModuleに
+        // codegenする。前にcompileしたファイルの状態は捨てる。
+        bool compile(const std::string &InputFile, unsigned LexThreads = 1) {
+            if (!initTargetMachine())
+                return false;
+            initOptimizer();
+            initBinopPrecedence();
+            reset();
+
+            {
+                PhaseTimer Timer(PhaseLex);
+                if (!lexer.initStream(InputFile))
+                    return false;
+                lexer.tokenize(LexThreads);
+            }
+            getNextToken();
+            MainLoop();
+            if (!Opts.ProfileGenerate.empty())
+                emitProfileWriter(*myModule);
+            return true;
+        }
+
+        // setIRStream - これからcompileする各関数のLLVM IRのテキストを、出来た順にOSに書き出す。
+        // nullptrならIRを出力しない。
+        void setIRStream(raw_ostream *OS) { IRStream = OS; }
+
+        Module &getModule() { return *myModule; }
+
+        // writeObject - 最適化してFilenameにオブジェクトファイルを書き出す。
+        bool writeObject(StringRef Filename) { return writeObjectFile(Filename); }
+
+        // writeOutput - Opts.Emitの種類の出力をFilename("-"ならstdout)に書き出す。
+        bool writeOutput(StringRef Filename) { return writeOutputFile(Filename); }
+
+        // run - JITで実行する(--run)。
+        int run() { return runJIT(); }
+
+    private:
+        // reset - このスレッドの前のファイルのASTとIRを全て捨てる。
+        // AnalysisManagerは関数へのポインタをキャッシュしているので、モジュールより先に消す。
+        void reset() {
+            FAM.clear();
+            MAM.clear();
+            myModule.reset();
+            SymbolFunctions.clear();
+            ASTArena.Reset();
+            FlatBuilder.AST.clear();
+            ConstEvalProgram = BytecodeProgram();
+            ConstEvalFuelUsed = 0;
+            AnonExprCount = 0;
+        }
+};
+
+} // end namespace mc
+
+//===----------------------------------------------------------------------===//
+// Batch Driver
+// --batchが指定された場合、全ての入力ファイルを一つのプロセスでコンパイルし、
+// file.mcをfile.oに書き出します。-j N個のスレッドがそれぞれmc::Compilerを持ち、
+// 残っているファイルを一つずつ取っていきます。LLVMのターゲットの初期化は一度しか行いません。
+//===----------------------------------------------------------------------===//
+
+static int runBatch() {
+    const std::vector<std::string> &Files = Opts.InputFiles;
+    std::atomic<size_t> Next(0), Failed(0);
+
+    auto Start = std::chrono::steady_clock::now();
+    std::vector<std::thread> Workers;
+    for (unsigned t = 0; t < std::min<size_t>(Opts.Jobs, Files.size()); ++t)
+        Workers.emplace_back([&] {
+            mc::Compiler C;
+            for (size_t i; (i = Next++) < Files.size();) {
+                SmallString<128> Output(Files[i]);
+                sys::path::replace_extension(Output, "o");
+                if (!C.compile(Files[i]) || !C.writeObject(Output)) {
+                    fprintf(stderr, "Error: failed to compile %s\n", Files[i].c_str());
+                    ++Failed;
+                }
+            }
+        });
+    for (auto &W : Workers)
+        W.join();
+    std::chrono::duration<double> Elapsed = std::chrono::steady_clock::now() - Start;
+
+    outs() << format("Compiled %zu files in %.3fs (%.1f files/s)\n", Files.size() - Failed,
+            Elapsed.count(), (Files.size() - Failed) / Elapsed.count());
+    finishCache();
+    return Failed ? -1 : 0;
+}
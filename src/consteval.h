@@ -0,0 +1,61 @@
+//===----------------------------------------------------------------------===//
+// Compile-time Evaluation
+// 引数が全て数値リテラルの呼び出し(例えばtop level expressionの`fib(30)`)は、
+// パーサーがASTを作る時にここで評価し、結果の数値リテラルに置き換えます。
+// codegenできた関数定義はvm.hのバイトコードにも変換してConstEvalProgramに溜めておき、
+// 評価はバイトコードVMで行います。MC言語の関数は純粋なので、実行時に呼んでも結果は同じです。
+// 止まらない再帰等でコンパイルが終わらなくならないように、一つの呼び出しの評価で行う
+// 関数呼び出しと後ろ向きのジャンプの回数を--consteval-fuelまでに制限し、使い切ったら
+// 評価を諦めて普通の呼び出しとしてcodegenします。定数の呼び出しが沢山あってもコンパイル時間が
+// 呼び出しの数に比例して伸びないように、一つのコンパイルで使う回数の合計も--consteval-budgetまでに
+// 制限し、使い切ったら残りの呼び出しは評価しません。VMのスタックが大きくなり過ぎないように、
+// 呼び出しの深さもConstEvalMaxDepthまでに制限します。
+// FlatASTはバイトコードに変換できないので、--flat-astの場合は呼び出しを評価しません。
+//===----------------------------------------------------------------------===//
+
+namespace {
+    const size_t ConstEvalMaxDepth = 100000;
+} // end anonymous namespace
+
+static thread_local BytecodeProgram ConstEvalProgram;
+// このスレッドでコンパイル時に評価した呼び出しの数
+static thread_local unsigned ConstCallsEvaluated;
+// このスレッドの今のコンパイルで、呼び出しの評価に使った関数呼び出しと後ろ向きのジャンプの回数。
+// コンパイルの度にmc::Compilerと--serveのprepareRequestで0に戻す。
+static thread_local uint64_t ConstEvalFuelUsed;
+
+static bool evalConstCall(StringRef Callee, ArrayRef<uint64_t> Args, uint64_t &Result) {
+    if (Opts.ConstEvalFuel == 0 || ConstEvalFuelUsed >= Opts.ConstEvalBudget)
+        return false;
+    // 未定義の関数や引数の数の間違いは、評価せずにcodegenでエラーにする。
+    auto It = ConstEvalProgram.FunctionIndex.find(Callee);
+    if (It == ConstEvalProgram.FunctionIndex.end() ||
+            ConstEvalProgram.Functions[It->second].NumArgs != Args.size())
+        return false;
+
+    SmallVector<int64_t, 4> IntArgs(Args.begin(), Args.end());
+    // 一つの呼び出しの上限と、このコンパイルの残りの小さい方まで評価する。
+    uint64_t Limit = std::min(Opts.ConstEvalFuel, Opts.ConstEvalBudget - ConstEvalFuelUsed);
+    uint64_t Fuel = Limit;
+    int64_t Val;
+    bool Evaluated = runBytecode(ConstEvalProgram, It->second, IntArgs, Val, &Fuel,
+                                 ConstEvalMaxDepth);
+    ConstEvalFuelUsed += Limit - Fuel;
+    if (!Evaluated)
+        return false;
+    Result = Val;
+    ++ConstCallsEvaluated;
+    return true;
+}
+
+// addConstEvalFunction - codegenできた関数定義を、後の定義や式から評価できるようにする。
+// 配列の引数を持つ関数はVMで扱えず、定数の引数で呼ばれることも無いので加えない。
+// bodyが深過ぎてバイトコードにできない関数も加えない。
+static void addConstEvalFunction(FunctionAST &FnAST) {
+    if (FnAST.getProto()->hasArrayArgs() || ParsedExprDepth > BytecodeMaxExprDepth)
+        return;
+    BytecodeBuilder B(ConstEvalProgram);
+    FnAST.bytecodegen(B);
+}
+
+static void addConstEvalFunction(FlatAST &) {}
@@ -0,0 +1,174 @@
+//===----------------------------------------------------------------------===//
+// Flat AST
+// --flat-astが指定された場合、parser.hのクラス階層の代わりに、このファイルで定義する
+// 配列で表したAST(struct-of-arrays)を作ります。
+// ノードはポインタではなく配列のインデックスで指し、種類や子ノードはノードごとに
+// 別々の配列に並べるので、一つのノードは13バイトで済み、仮想関数テーブルもありません。
+// 配列は定義ごとにclearして使い回すので、二つ目以降の定義ではメモリの確保も起きません。
+// パーサーはFlatASTBuilderを渡すとこのASTを直接作り、codegenはswitch文で行います。
+//===----------------------------------------------------------------------===//
+
+namespace {
+struct FlatAST {
+    enum NodeKind : uint8_t {
+        // インデックス0はnullptrの代わりに使う
+        InvalidNode,
+        NumberNode,
+        VariableNode,
+        BinaryNode,
+        CallNode,
+        IfNode,
+        VarNode,
+        AssignNode,
+        ForNode,
+        WhileNode,
+        IndexNode,
+    };
+
+    // ノードの種類
+    std::vector<uint8_t> Kinds;
+    // ノードのオペランド。ノードの種類によって意味が変わる。
+    // 変数のスロットは未定義の変数なら-1をuint32_tにしたもの。
+    //   NumberNode:   Lhs = Constsでのインデックス
+    //   VariableNode: Lhs = 変数のスロット
+    //   BinaryNode:   Lhs, Rhs = 子ノード, Third = 演算子
+    //   CallNode:     Lhs = 関数名のシンボル番号, 引数はArgListのRhsからThird個
+    //   IfNode:       Lhs, Rhs, Third = Cond, Then, Elseのノード
+    //   VarNode:      ArgListのLhsからRhs組の(変数のスロット, 初期値), Third = body
+    //   AssignNode:   Lhs = 変数のスロット, Rhs = 代入する値,
+    //                 Third = 配列の要素に代入する場合は添字, 変数なら0
+    //   ForNode:      ArgListのLhsから(変数のスロット, Start, Cond, Step, Body)
+    //                 Stepが省略された場合は0
+    //   WhileNode:    Lhs, Rhs = Cond, Body
+    //   IndexNode:    Lhs = 配列のスロット, Rhs = 添字
+    std::vector<uint32_t> Lhs, Rhs, Third;
+    std::vector<uint64_t> Consts;
+    std::vector<uint32_t> ArgList;
+    // スロットごとの変数名
+    std::vector<StringRef> SlotNames;
+
+    // 関数のプロトタイプとbodyのノード
+    PrototypeAST *Proto = nullptr;
+    uint32_t Body = 0;
+
+    FlatAST() { clear(); }
+
+    // clear - 全てのノードを消す。確保した配列はそのまま次の定義で使い回す。
+    void clear() {
+        Kinds.clear();
+        Lhs.clear();
+        Rhs.clear();
+        Third.clear();
+        Consts.clear();
+        ArgList.clear();
+        SlotNames.clear();
+        Proto = nullptr;
+        Body = 0;
+        addNode(InvalidNode, 0, 0, 0);
+    }
+
+    uint32_t addNode(NodeKind Kind, uint32_t L, uint32_t R, uint32_t T) {
+        Stats.ASTNodes += Kind != InvalidNode;
+        Kinds.push_back(Kind);
+        Lhs.push_back(L);
+        Rhs.push_back(R);
+        Third.push_back(T);
+        return Kinds.size() - 1;
+    }
+
+    uint32_t addConst(uint64_t Val) {
+        Consts.push_back(Val);
+        return Consts.size() - 1;
+    }
+
+    size_t size() const { return Kinds.size(); }
+
+    void codegenStep(CodegenWalker<uint32_t> &W, uint32_t Node, unsigned Stage);
+    Function *codegen();
+};
+
+// FlatASTBuilder - ClassASTBuilderと同じインターフェースでFlatASTにノードを追加する。
+struct FlatASTBuilder {
+    // パーサーからはポインタと同じように扱えるノードのインデックス
+    struct Ref {
+        uint32_t Index;
+        Ref(std::nullptr_t) : Index(0) {}
+        explicit Ref(uint32_t Index) : Index(Index) {}
+        explicit operator bool() const { return Index != 0; }
+    };
+    typedef Ref Expr;
+    typedef FlatAST *Function;
+
+    FlatAST AST;
+
+    Expr number(uint64_t Val) {
+        return Ref(AST.addNode(FlatAST::NumberNode, AST.addConst(Val), 0, 0));
+    }
+    Expr variable(int Slot) {
+        return Ref(AST.addNode(FlatAST::VariableNode, Slot, 0, 0));
+    }
+    Expr binary(char Op, Expr LHS, Expr RHS) {
+        uint64_t L, R, V;
+        if (getConstant(LHS, L) && getConstant(RHS, R) && foldBinary(Op, L, R, V))
+            return number(V);
+        return Ref(AST.addNode(FlatAST::BinaryNode, LHS.Index, RHS.Index, Op));
+    }
+    Expr call(unsigned Callee, ArrayRef<Expr> Args) {
+        uint64_t V;
+        if (foldCall(*this, Callee, Args, V))
+            return number(V);
+        // 引数の中の呼び出しは先に作られているので、この呼び出しの引数はArgListの末尾に連続して並ぶ。
+        uint32_t Start = AST.ArgList.size();
+        for (Expr Arg : Args)
+            AST.ArgList.push_back(Arg.Index);
+        return Ref(AST.addNode(FlatAST::CallNode, Callee, Start, Args.size()));
+    }
+    Expr ifExpr(Expr Cond, Expr Then, Expr Else) {
+        uint64_t C;
+        if (getConstant(Cond, C))
+            return C ? Then : Else;
+        return Ref(AST.addNode(FlatAST::IfNode, Cond.Index, Then.Index, Else.Index));
+    }
+    Expr index(int Slot, Expr Index) {
+        return Ref(AST.addNode(FlatAST::IndexNode, Slot, Index.Index, 0));
+    }
+    Expr assign(Expr Dest, Expr Val) {
+        uint8_t Kind = AST.Kinds[Dest.Index];
+        if (Kind != FlatAST::VariableNode && Kind != FlatAST::IndexNode)
+            return LogError("destination of '=' must be a variable or an array element");
+        return Ref(AST.addNode(FlatAST::AssignNode, AST.Lhs[Dest.Index], Val.Index,
+                    Kind == FlatAST::IndexNode ? AST.Rhs[Dest.Index] : 0));
+    }
+    Expr varExpr(ArrayRef<std::pair<int, Expr>> Vars, Expr Body) {
+        uint32_t Start = AST.ArgList.size();
+        for (auto &Var : Vars) {
+            AST.ArgList.push_back(Var.first);
+            AST.ArgList.push_back(Var.second.Index);
+        }
+        return Ref(AST.addNode(FlatAST::VarNode, Start, Vars.size(), Body.Index));
+    }
+    Expr forExpr(int Slot, Expr Start, Expr Cond, Expr Step, Expr Body) {
+        uint32_t First = AST.ArgList.size();
+        for (uint32_t Op : {uint32_t(Slot), Start.Index, Cond.Index, Step.Index, Body.Index})
+            AST.ArgList.push_back(Op);
+        return Ref(AST.addNode(FlatAST::ForNode, First, 0, 0));
+    }
+    Expr whileExpr(Expr Cond, Expr Body) {
+        return Ref(AST.addNode(FlatAST::WhileNode, Cond.Index, Body.Index, 0));
+    }
+    Function function(PrototypeAST *Proto, Expr Body, ArrayRef<StringRef> SlotNames) {
+        AST.Proto = Proto;
+        AST.Body = Body.Index;
+        AST.SlotNames.assign(SlotNames.begin(), SlotNames.end());
+        return &AST;
+    }
+    bool getConstant(Expr E, uint64_t &Val) {
+        if (AST.Kinds[E.Index] != FlatAST::NumberNode)
+            return false;
+        Val = AST.Consts[AST.Lhs[E.Index]];
+        return true;
+    }
+};
+} // end anonymous namespace
+
+static thread_local FlatASTBuilder FlatBuilder;
@@ -1,54 +1,100 @@
-static void write_output(void) {
-    // Initialize the target registry etc.
-    InitializeAllTargetInfos();
-    InitializeAllTargets();
-    InitializeAllTargetMCs();
-    InitializeAllAsmParsers();
-    InitializeAllAsmPrinters();
-
-    auto TargetTriple = sys::getDefaultTargetTriple();
-    myModule->setTargetTriple(TargetTriple);
-
-    std::string Error;
-    auto Target = TargetRegistry::lookupTarget(TargetTriple, Error);
-
-    // Print an error and exit if we couldn't find the requested target.
-    // This generally occurs if we've forgotten to initialise the
-    // TargetRegistry or we have a bogus target triple.
-    if (!Target) {
-        errs() << Error;
-        return;
+// getOutputFilename - -oで指定された出力先。無ければ--emitの種類に合わせてoutput.o等。
+static std::string getOutputFilename() {
+    if (!Opts.OutputFile.empty())
+        return Opts.OutputFile;
+    switch (Opts.Emit) {
+        case EmitLL:
+            return "output.ll";
+        case EmitBC:
+            return "output.bc";
+        case EmitAsm:
+            return "output.s";
+        default:
+            return "output.o";
     }
+}
 
-    auto CPU = "generic";
-    auto Features = "";
+// openOutputFile - Filenameを書き込み用に開く。"-"ならstdoutに書き出す。
+static std::unique_ptr<raw_fd_ostream> openOutputFile(StringRef Filename) {
+    auto Flags = Opts.Emit == EmitLL || Opts.Emit == EmitAsm ? sys::fs::OF_Text
+                                                              : sys::fs::OF_None;
+    std::error_code EC;
+    auto OS = std::make_unique<raw_fd_ostream>(Filename, EC, Flags);
+    if (EC) {
+        errs() << "Could not open file: " << EC.message() << "\n";
+        return nullptr;
+    }
+    return OS;
+}
 
-    TargetOptions opt;
-    auto RM = Optional<Reloc::Model>();
-    auto TheTargetMachine =
-        Target->createTargetMachine(TargetTriple, CPU, Features, opt, RM);
+// transformModule - --memoizeと--multiversionの、モジュール全体を書き換える変換をかける。
+static void transformModule() {
+    PhaseTimer Timer(PhaseOptimize);
+    if (Opts.Memoize)
+        memoizeModule(*myModule);
+    if (Opts.Multiversion)
+        multiversionModule(*myModule);
+}
 
-    myModule->setDataLayout(TheTargetMachine->createDataLayout());
+// writeObjectFile - myModuleを最適化してFilenameにオブジェクトファイルとして書き出す。
+static bool writeObjectFile(StringRef Filename) {
+    if (!TheTargetMachine)
+        return false;
 
-    auto Filename = "output.o";
-    std::error_code EC;
-    raw_fd_ostream dest(Filename, EC, sys::fs::OF_None);
+    transformModule();
 
-    if (EC) {
-        errs() << "Could not open file: " << EC.message();
-        return;
-    }
+    // -jの場合はモジュールを分割して並列に最適化・出力する。
+    // --batchの場合はファイルごとに並列になっているので分割しない。
+    if (Opts.Jobs > 1 && !Opts.Batch)
+        return writeObjectParallel(Filename, Opts.Jobs);
 
-    legacy::PassManager pass;
-    auto FileType = CGFT_ObjectFile;
+    optimizeModule(*myModule);
+
+    auto dest = openOutputFile(Filename);
+    if (!dest)
+        return false;
+    return emitObject(*myModule, *TheTargetMachine, *dest);
+}
 
-    if (TheTargetMachine->addPassesToEmitFile(pass, dest, nullptr, FileType)) {
-        errs() << "TheTargetMachine can't emit a file of this type";
-        return;
+// writeOutputFile - Opts.Emitの種類の出力をFilenameに書き出す。
+// --emit=llのIRはcodegenしながら書き出しているので、ここでは何もしない。
+static bool writeOutputFile(StringRef Filename) {
+    switch (Opts.Emit) {
+        case EmitObj:
+            return writeObjectFile(Filename);
+        case EmitLL:
+        case EmitNone:
+            return true;
+        default:
+            break;
     }
+    if (!TheTargetMachine)
+        return false;
 
-    pass.run(*myModule);
-    dest.flush();
+    // ビットコードとアセンブリは-jでも分割しない。
+    transformModule();
+    optimizeModule(*myModule);
+
+    auto dest = openOutputFile(Filename);
+    if (!dest)
+        return false;
+    if (Opts.Emit == EmitBC) {
+        PhaseTimer Timer(PhaseEmit);
+        WriteBitcodeToFile(*myModule, *dest);
+        return true;
+    }
+    return emitObject(*myModule, *TheTargetMachine, *dest, CGFT_AssemblyFile);
+}
 
+// write_output - Opts.Emitの種類の出力をFilenameに書き出し、ファイルに書いたならそう表示する。
+// 書き出せなければfalseを返す。
+static bool write_output(StringRef Filename) {
+    if (!writeOutputFile(Filename))
+        return false;
+    if (Opts.Emit == EmitNone || Filename == "-")
+        return true;
     outs() << "Wrote " << Filename << "\n";
+    if (Opts.Emit == EmitObj)
+        recordObjectFile(Filename);
+    return true;
 }
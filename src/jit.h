@@ -0,0 +1,108 @@
+//===----------------------------------------------------------------------===//
+// JIT
+// --runが指定された場合、output.oを書き出してclang++でリンクする代わりに、
+// ORC LLJIT(https://llvm.org/docs/ORCv2.html)でモジュールをその場で実行します。
+// LLLazyJITは各関数を最初に呼ばれた時に初めて機械語にコンパイルするので、
+// 呼ばれない関数のコンパイル時間はかかりません。
+//===----------------------------------------------------------------------===//
+
+static ExitOnError ExitOnErr;
+
+// cloneModuleToContext - モジュールをビットコード経由で別のLLVMContextに複製する。
+// JITや別スレッドに渡すモジュールはContextごと所有権を渡す必要があるが、
+// codegen.hのContextはstaticなので、一度ビットコードにして新しいContextに読み直す。
+static std::unique_ptr<Module> cloneModuleToContext(Module &M, LLVMContext &Ctx) {
+    SmallVector<char, 0> Buffer;
+    raw_svector_ostream OS(Buffer);
+    WriteBitcodeToFile(M, OS);
+    return ExitOnErr(parseBitcodeFile(
+                MemoryBufferRef(StringRef(Buffer.data(), Buffer.size()), M.getName()), Ctx));
+}
+
+// callJITFunction - 引数が全てi64のMC言語の関数を呼び出す。
+static bool callJITFunction(JITTargetAddress Addr, ArrayRef<int64_t> Args,
+        int64_t &Result) {
+    typedef int64_t I;
+    void *FP = jitTargetAddressToPointer<void *>(Addr);
+    switch (Args.size()) {
+        case 0: Result = ((I(*)())FP)(); return true;
+        case 1: Result = ((I(*)(I))FP)(Args[0]); return true;
+        case 2: Result = ((I(*)(I, I))FP)(Args[0], Args[1]); return true;
+        case 3: Result = ((I(*)(I, I, I))FP)(Args[0], Args[1], Args[2]); return true;
+        case 4: Result = ((I(*)(I, I, I, I))FP)(Args[0], Args[1], Args[2], Args[3]); return true;
+        case 5: Result = ((I(*)(I, I, I, I, I))FP)(Args[0], Args[1], Args[2], Args[3],
+                        Args[4]); return true;
+        case 6: Result = ((I(*)(I, I, I, I, I, I))FP)(Args[0], Args[1], Args[2], Args[3],
+                        Args[4], Args[5]); return true;
+        default:
+            errs() << "--call supports at most 6 arguments\n";
+            return false;
+    }
+}
+
+// runJIT - myModuleをJITに登録し、top level expressionと--callで指定された関数を実行する。
+static int runJIT() {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+
+    if (Opts.Memoize)
+        memoizeModule(*myModule);
+    // --profile-generateのカウンタは、atexitに任せずに実行後に書き出す。
+    Function *ProfileWriter = detachProfileWriter(*myModule);
+    optimizeModule(*myModule);
+
+    // top level expression(__anon_expr, __anon_expr.1, ...)はモジュールに現れた順に評価する。
+    std::vector<std::string> AnonExprs;
+    for (auto &F : *myModule)
+        if (!F.isDeclaration() && F.getName().startswith("__anon_expr"))
+            AnonExprs.push_back(F.getName().str());
+
+    auto J = ExitOnErr(orc::LLLazyJITBuilder().create());
+    // --profile-generateの書き出す関数が呼ぶfopen等は、このプロセスのlibcから探す。
+    J->getMainJITDylib().addGenerator(ExitOnErr(
+                orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+                    J->getDataLayout().getGlobalPrefix())));
+    auto Ctx = std::make_unique<LLVMContext>();
+    auto M = cloneModuleToContext(*myModule, *Ctx);
+    M->setDataLayout(J->getDataLayout());
+    ExitOnErr(J->addLazyIRModule(orc::ThreadSafeModule(std::move(M), std::move(Ctx))));
+
+    for (auto &Name : AnonExprs) {
+        int64_t Result;
+        auto Sym = ExitOnErr(J->lookup(Name));
+        callJITFunction(Sym.getAddress(), None, Result);
+        outs() << "Evaluated to " << Result << "\n";
+    }
+
+    if (!Opts.CallFunction.empty()) {
+        Function *F = myModule->getFunction(Opts.CallFunction);
+        if (!F || F->isDeclaration()) {
+            errs() << "Error: Unknown function " << Opts.CallFunction << "\n";
+            return -1;
+        }
+        if (getNumMCArgs(F) != F->arg_size()) {
+            errs() << "Error: --call cannot pass arrays to " << Opts.CallFunction << "\n";
+            return -1;
+        }
+        // 引数の数が違う呼び出しは、関数ポインタのキャストが合わず未定義の動作になる。
+        if (Opts.CallArgs.size() != getNumMCArgs(F)) {
+            errs() << "Error: " << Opts.CallFunction << " takes " << getNumMCArgs(F)
+                   << " arguments but --call passed " << Opts.CallArgs.size() << "\n";
+            return -1;
+        }
+        int64_t Result;
+        auto Sym = ExitOnErr(J->lookup(Opts.CallFunction));
+        if (!callJITFunction(Sym.getAddress(), Opts.CallArgs, Result))
+            return -1;
+        outs() << "Call " << Opts.CallFunction << " with";
+        for (int64_t A : Opts.CallArgs)
+            outs() << " " << A;
+        outs() << ": " << Result << "\n";
+    }
+
+    if (ProfileWriter) {
+        auto Sym = ExitOnErr(J->lookup(ProfileWriterName));
+        jitTargetAddressToFunction<void (*)()>(Sym.getAddress())();
+    }
+    return 0;
+}
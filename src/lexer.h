@@ -5,6 +5,12 @@
 //
 // 全体的な流れとしては、gettokをParserから呼ぶことにより「次のトークン」を読み、
 // それが数値リテラルだった場合はnumValという変数にセットする。
+//
+// mcコマンドでは、パースを始める前にtokenizeでファイル全体を一度にトークンの配列に
+// してしまい、Parserはnextで配列から順にトークンを取り出す。大きなファイルは
+// 関数定義の境界で分割して複数のスレッドでトークナイズする。
+// 識別子はnextで取り出す時にシンボル表に登録して整数のシンボル番号にするので、
+// パーサーやcodegenは名前の文字列を比べたりハッシュしたりしない。
 //===----------------------------------------------------------------------===//
 
 // このLexerでは、EOF、数値、"def"、識別子以外は[0-255]を返す('+'や'-'を含む)。
@@ -15,30 +21,201 @@ enum Token {
     tok_number = -4,
     tok_if = -5,
     tok_then = -6,
-    tok_else = -7
+    tok_else = -7,
+    tok_for = -8,
+    tok_while = -9,
+    tok_do = -10,
+    tok_var = -11,
+    tok_in = -12
+};
+
+// LexedToken - tokenizeが作るトークンの配列の要素
+// キャッシュに乗るように8バイトに詰めている。数値リテラルの値はnextで取り出す時に
+// ソースから計算する。Kindは文字の0から255とTokenの負の値を区別できるように9ビットにしている
+// (8ビットだと0xffのバイトがtok_eofと同じ-1になってしまう)。
+struct LexedToken {
+    int32_t Kind : 9;
+    uint32_t Length : 23;
+    uint32_t Offset;
 };
 
+//===----------------------------------------------------------------------===//
+// SIMDを使った文字の分類
+// SSE2が使える場合は64バイトずつまとめて各バイトが「空白か」「英数字か」「'#'か」を
+// 判定してビットマスクにし、トークンの開始位置と長さをビット演算で求める。
+// コメントを含むブロックと、64バイト読めない末尾の部分は一文字ずつ調べる。
+//===----------------------------------------------------------------------===//
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#define MC_SIMD_LEXER 1
+
+// InRange - 各バイトが[Lo, Lo+Len]に入っているかを0xff/0x00で返す
+static inline __m128i InRange(__m128i C, char Lo, char Len) {
+    __m128i D = _mm_sub_epi8(C, _mm_set1_epi8(Lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(D, _mm_set1_epi8(Len)), D);
+}
+
+struct CharMasks {
+    uint64_t Space, Digit, Alnum, Hash;
+};
+
+// classify64 - P[0..63]を分類し、i番目のバイトをi番目のビットにしたマスクを返す。
+static inline CharMasks classify64(const char *P) {
+    CharMasks M = {0, 0, 0, 0};
+    for (int i = 0; i < 4; ++i) {
+        __m128i C = _mm_loadu_si128((const __m128i *)(P + 16 * i));
+        // ' 'か'\t', '\n', '\v', '\f', '\r'
+        __m128i Space = _mm_or_si128(_mm_cmpeq_epi8(C, _mm_set1_epi8(' ')),
+                InRange(C, '\t', 4));
+        __m128i Lower = _mm_or_si128(C, _mm_set1_epi8(0x20));
+        __m128i Digit = InRange(C, '0', 9);
+        __m128i Alnum = _mm_or_si128(Digit, InRange(Lower, 'a', 25));
+        __m128i Hash = _mm_cmpeq_epi8(C, _mm_set1_epi8('#'));
+        M.Space |= uint64_t(uint16_t(_mm_movemask_epi8(Space))) << (16 * i);
+        M.Digit |= uint64_t(uint16_t(_mm_movemask_epi8(Digit))) << (16 * i);
+        M.Alnum |= uint64_t(uint16_t(_mm_movemask_epi8(Alnum))) << (16 * i);
+        M.Hash |= uint64_t(uint16_t(_mm_movemask_epi8(Hash))) << (16 * i);
+    }
+    return M;
+}
+#endif
+
+// identifierKind - 識別子が予約語ならそのトークンを、そうでなければtok_identifierを返す。
+static inline int32_t identifierKind(const char *S, size_t Len) {
+    switch (Len) {
+        case 2:
+            if (S[0] == 'i' && S[1] == 'f')
+                return tok_if;
+            if (S[0] == 'i' && S[1] == 'n')
+                return tok_in;
+            if (S[0] == 'd' && S[1] == 'o')
+                return tok_do;
+            break;
+        case 3:
+            if (!memcmp(S, "def", 3))
+                return tok_def;
+            if (!memcmp(S, "for", 3))
+                return tok_for;
+            if (!memcmp(S, "var", 3))
+                return tok_var;
+            break;
+        case 4:
+            if (!memcmp(S, "then", 4))
+                return tok_then;
+            if (!memcmp(S, "else", 4))
+                return tok_else;
+            break;
+        case 5:
+            if (!memcmp(S, "while", 5))
+                return tok_while;
+            break;
+    }
+    return tok_identifier;
+}
+
+// tokenizeRange - [Begin, End)をトークナイズしてOutに追加する。
+// BeginとEndは行の先頭でなければならない(トークンもコメントも行をまたがないので、
+// 行の先頭で区切れば別々にトークナイズしても結果は変わらない)。
+static void tokenizeRange(const char *BufStart, const char *Begin, const char *End,
+        std::vector<LexedToken> &Out) {
+    const char *P = Begin;
+    while (true) {
+#ifdef MC_SIMD_LEXER
+        // Pは常にトークンの境界にあるので、ブロックの先頭の英数字はトークンの先頭になる。
+        if (End - P >= 64) {
+            CharMasks M = classify64(P);
+            if (!M.Hash) {
+                // トークンの開始位置: 英数字の連続の先頭か、空白でも英数字でもない文字
+                uint64_t Starts = (M.Alnum & ~(M.Alnum << 1)) | ~(M.Space | M.Alnum);
+                const char *Next = P + 64;
+                while (Starts) {
+                    unsigned i = __builtin_ctzll(Starts);
+                    Starts &= Starts - 1;
+                    const char *S = P + i;
+                    uint32_t Offset = S - BufStart;
+                    if (!((M.Alnum >> i) & 1)) {
+                        Out.push_back({int32_t((unsigned char)*S), 1, Offset});
+                        continue;
+                    }
+                    uint64_t Rest = ~(M.Alnum >> i);
+                    unsigned Len = Rest ? __builtin_ctzll(Rest) : 64 - i;
+                    // 英数字がブロックの末尾まで続く場合は、そのトークンから次のブロックを始める。
+                    if (i + Len == 64) {
+                        Next = S;
+                        break;
+                    }
+                    if (!((M.Digit >> i) & 1)) {
+                        Out.push_back({identifierKind(S, Len), Len, Offset});
+                        continue;
+                    }
+                    // "12ab"のように数字の後に英字が続く場合は、数字の部分だけを
+                    // tok_numberにして、残りから次のブロックを始める。
+                    unsigned NumLen = __builtin_ctzll(~(M.Digit >> i));
+                    Out.push_back({tok_number, NumLen, Offset});
+                    if (NumLen != Len) {
+                        Next = S + NumLen;
+                        break;
+                    }
+                }
+                // ブロックの先頭から末尾まで英数字が続く場合は一文字ずつの処理に任せる。
+                if (Next != P) {
+                    P = Next;
+                    continue;
+                }
+            }
+        }
+#endif
+        while (P != End && isspace((unsigned char)*P))
+            ++P;
+        if (P == End)
+            return;
+
+        const char *Start = P;
+        uint32_t Offset = Start - BufStart;
+        unsigned char C = *P;
+        if (isalpha(C)) {
+            while (++P != End && isalnum((unsigned char)*P))
+                ;
+            Out.push_back({identifierKind(Start, P - Start), uint32_t(P - Start), Offset});
+        } else if (isdigit(C)) {
+            while (++P != End && isdigit((unsigned char)*P))
+                ;
+            Out.push_back({tok_number, uint32_t(P - Start), Offset});
+        } else if (C == '#') {
+            // Comment until end of line.
+            const void *NL = memchr(P, '\n', End - P);
+            P = NL ? static_cast<const char *>(NL) : End;
+        } else {
+            Out.push_back({int32_t(C), 1, Offset});
+            ++P;
+        }
+    }
+}
+
 class Lexer {
     public:
         // gettok - トークンが数値だった場合はnumValにその数値をセットした上でtok_number
         // を返し、トークンが識別子だった場合はidentifierStrにその文字をセットした上でtok_identifierを返す。
         // '+'や他のunknown tokenだった場合はそのascii codeを返す。
+        // ソースはメモリ上にあるので、一文字ずつ読み込む代わりにcurPtrを進めていく。
+        // MemoryBufferの末尾には必ず'\0'があるので、識別子や数字のループは
+        // 範囲チェック無しで'\0'で止まる。
         int gettok() {
-            static int lastChar = getNextChar(iFile);
-
             // スペースをスキップ
-            while (isspace(lastChar))
-                lastChar = getNextChar(iFile);
+            while (isspace(*curPtr))
+                ++curPtr;
 
             // TODO 2.1: 識別子をトークナイズする
             // 1.3と同様に、今読んでいる文字がアルファベットだった場合はアルファベットで
             // なくなるまで読み込み、その値をidentifierStrにセットする。
             // 読み込んだ文字が"def"だった場合は関数定義であるためtok_defをreturnし、
             // そうでなければ引数の参照か関数呼び出しであるためtok_identifierをreturnする。
-            if (isalpha(lastChar)) {
-                identifierStr = lastChar;
-                while (isalnum((lastChar = getNextChar(iFile))))
-                    identifierStr += lastChar;
+            // identifierStrはコピーせず、ソースの該当部分を指すStringRefにする。
+            if (isalpha(*curPtr)) {
+                const char *start = curPtr;
+                while (isalnum(*++curPtr))
+                    ;
+                identifierStr = StringRef(start, curPtr - start);
 
                 if (identifierStr == "def")
                     return tok_def;
@@ -50,60 +227,49 @@ class Lexer {
                     return tok_then;
                 if (identifierStr == "else")
                     return tok_else;
+                if (identifierStr == "for")
+                    return tok_for;
+                if (identifierStr == "while")
+                    return tok_while;
+                if (identifierStr == "do")
+                    return tok_do;
+                if (identifierStr == "var")
+                    return tok_var;
+                if (identifierStr == "in")
+                    return tok_in;
                 return tok_identifier;
             }
 
             // TODO 1.3: 数字のパーシングを実装してみよう
-            // 今読んでいる文字(lastChar)が数字だった場合(isdigit(lastChar) == true)は、
+            // 今読んでいる文字が数字だった場合(isdigit(*curPtr) == true)は、
             // 数字が終わるまで読み、その数値をnumValにセットする。
-            // 1. lastCharが数字かチェックする e.g. if (isdigit(lastChar)) {..
-            // 2. 数字を格納するための変数を作る e.g. std::string str = "";
-            // 3. 入力が'456'という数字だったとして、今の文字は'4'なので、
-            //    次の文字が数字ではなくなるまで読み込み、2で作った変数に格納する
-            //    e.g. str += lastChar;
-            // 4. 次の文字が数字でなくなるまで読み込む。ファイルから次の文字を読み込むのは、
-            //    getNextChar(iFile)で出来る。 e.g. while(isdigit(lastChar = getNextChar(iFile))) {..
-            // 5. 2と同様に、4が数字であれば2で作った変数に格納する
-            // 6. 次の文字が数字でなくなったら、setnumValを読んでnumValに数値を格納する。その際、
-            //   strtodというcharからintにする関数が利用できる。
-            // 7. このトークンは数値だったので、tok_numberをreturnする。
-            //
-            // ここに実装して下さい
-            if (isdigit(lastChar)) {
-                std::string numStr = "";
-                numStr += lastChar;
-                while (isdigit(lastChar = getNextChar(iFile)))
-                    numStr += lastChar;
-                setnumVal(strtod(numStr.c_str(), nullptr));
+            // 一旦文字列にしてからstrtodを呼ぶ代わりに、読みながら10倍して足していく。
+            if (isdigit(*curPtr)) {
+                uint64_t val = 0;
+                do {
+                    val = val * 10 + (*curPtr - '0');
+                } while (isdigit(*++curPtr));
+                setnumVal(val);
                 return tok_number;
             }
 
             // TODO 1.4: コメントアウトを実装してみよう
             // '#'を読んだら、その行の末尾まで無視をするコメントアウトを実装する。
-            // 1. 今の文字(LastChar)が'#'かどうかをチェック
-            // 2. lastCharに次のトークンを読み込む(getNextChar(iFile)を使う)
-            // 3. lastCharが'\n'か、EOFになるまで読み込む。e.g. while(lastChar != EOF && lastChar != '\n')
-            // 4. lastCharがEOFでない場合、行末まで読み込んだので次のトークンに進むためにgettok()をreturnする。
-            //
-            // ここに実装して下さい
-            if (lastChar == '#') {
+            if (*curPtr == '#') {
                 // Comment until end of line.
-                lastChar = getNextChar(iFile);
-                while (lastChar != EOF && lastChar != '\n')
-                    lastChar = getNextChar(iFile);
+                while (curPtr != bufferEnd && *curPtr != '\n')
+                    ++curPtr;
 
-                if (lastChar != EOF)
+                if (curPtr != bufferEnd)
                     return gettok();
             }
 
             // EOFならtok_eofを返す
-            if (iFile.eof())
+            if (curPtr == bufferEnd)
                 return tok_eof;
 
             // tok_numberでもtok_eofでもなければそのcharのasciiを返す
-            int thisChar = lastChar;
-            lastChar = getNextChar(iFile);
-            return thisChar;
+            return (unsigned char)*curPtr++;
         }
 
         // 数字を格納するnumValのgetter, setter
@@ -111,21 +277,147 @@ class Lexer {
         void setnumVal(uint64_t numval) { numVal = numval; }
 
         // 識別子を格納するIdentifierStrのgetter, setter
-        std::string getIdentifier() { return identifierStr; }
-        void setIdentifier(std::string str) { identifierStr = str; }
+        StringRef getIdentifier() { return identifierStr; }
+        void setIdentifier(StringRef str) { identifierStr = str; }
 
-        void initStream(std::string fileName) { iFile.open(fileName); }
+        // getSymbol - 最後にnextで返した識別子のシンボル番号。同じ名前なら同じ番号になる。
+        unsigned getSymbol() { return identifierSym; }
+        StringRef getSymbolName(unsigned Sym) const { return symbolNames[Sym]; }
+        unsigned getNumSymbols() const { return symbolNames.size(); }
 
-            private:
-        std::ifstream iFile;
-        uint64_t numVal;
-        // tok_identifierなら文字を入れる
-        std::string identifierStr;
-        static char getNextChar(std::ifstream &is) {
-            char c = '\0';
-            if (is.good())
-                is.get(c);
+        // internAll - tokenizeした全ての識別子を、nextで読むのと同じ順にシンボル表に登録する。
+        // この後はnextでシンボル表が変わらないので、パースしている間に他のスレッドが
+        // getSymbolNameを呼んでも良い(pipeline.hを参照)。
+        void internAll() {
+            for (const LexedToken &T : tokens)
+                if (T.Kind == tok_identifier)
+                    intern(StringRef(buffer->getBufferStart() + T.Offset, T.Length));
+        }
+
+        // tokenize - バッファ全体をトークナイズし、tokensに格納する。
+        // NumThreadsが0ならハードウェアのスレッド数を使う。小さいファイルは分割しない。
+        void tokenize(unsigned NumThreads = 0) {
+            const char *Begin = buffer->getBufferStart();
+            size_t Size = bufferEnd - Begin;
+            if (NumThreads == 0)
+                NumThreads = std::max(1u, std::thread::hardware_concurrency());
+            NumThreads = std::min<size_t>(NumThreads, Size / MinChunkSize + 1);
 
-            return c;
+            // 分割点は、おおよそ均等な位置から後ろに探した最初のトップレベルの"def"にする。
+            std::vector<const char *> Bounds{Begin};
+            StringRef Buf(Begin, Size);
+            for (unsigned i = 1; i < NumThreads; ++i) {
+                size_t From = std::max<size_t>(Size * i / NumThreads,
+                        Bounds.back() - Begin);
+                size_t Pos = Buf.find("\ndef", From);
+                if (Pos == StringRef::npos)
+                    break;
+                Bounds.push_back(Begin + Pos + 1);
+            }
+            Bounds.push_back(bufferEnd);
+
+            // 一つのチャンクならtokensに直接書き込み、そうでなければ各スレッドの結果を
+            // 一つの連続した配列にまとめる。
+            tokens.clear();
+            if (Bounds.size() == 2) {
+                tokens.reserve(Size / 3);
+                tokenizeRange(Begin, Begin, bufferEnd, tokens);
+            } else {
+                std::vector<std::vector<LexedToken>> Parts(Bounds.size() - 1);
+                std::vector<std::thread> Workers;
+                for (unsigned i = 0; i < Parts.size(); ++i)
+                    Workers.emplace_back([&, i] {
+                        Parts[i].reserve((Bounds[i + 1] - Bounds[i]) / 3);
+                        tokenizeRange(Begin, Bounds[i], Bounds[i + 1], Parts[i]);
+                    });
+                for (auto &W : Workers)
+                    W.join();
+
+                size_t Total = 1;
+                for (auto &Part : Parts)
+                    Total += Part.size();
+                tokens.reserve(Total);
+                for (auto &Part : Parts)
+                    tokens.insert(tokens.end(), Part.begin(), Part.end());
+            }
+            tokens.push_back({tok_eof, 0, uint32_t(Size)});
+            tokPos = 0;
         }
-        };
+
+        // next - tokenizeで作った配列から次のトークンを取り出す。
+        // gettokと同様にnumValとidentifierStrをセットし、識別子ならidentifierSymもセットする。
+        int next() {
+            const LexedToken &T = tokens[tokPos];
+            curTokIndex = tokPos;
+            if (T.Kind == tok_eof)
+                return tok_eof;
+            ++tokPos;
+            const char *Start = buffer->getBufferStart() + T.Offset;
+            if (T.Kind == tok_number) {
+                uint64_t val = 0;
+                for (const char *D = Start, *E = Start + T.Length; D != E; ++D)
+                    val = val * 10 + (*D - '0');
+                numVal = val;
+            } else {
+                identifierStr = StringRef(Start, T.Length);
+                if (T.Kind == tok_identifier)
+                    identifierSym = intern(identifierStr);
+            }
+            return T.Kind;
+        }
+
+        size_t getNumTokens() const { return tokens.size(); }
+
+        // rewind - tokenizeし直さずに、最初のトークンから読み直す。
+        void rewind() { tokPos = 0; }
+
+        // getTokIndex - 最後にnextで返したトークンの、配列でのインデックス
+        size_t getTokIndex() const { return curTokIndex; }
+        // getTokKind, getTokText - 配列のI番目のトークンの種類とソース中の文字列
+        int getTokKind(size_t I) const { return tokens[I].Kind; }
+        StringRef getTokText(size_t I) const {
+            return StringRef(buffer->getBufferStart() + tokens[I].Offset, tokens[I].Length);
+        }
+
+        // initStream - ファイルをメモリにマップして読み込む。ファイル名が"-"の場合は
+        // stdinから読み込む(パイプ等mmapできない場合は全体をメモリに読み込む)。
+        bool initStream(const std::string &fileName) {
+            auto BufOrErr = MemoryBuffer::getFileOrSTDIN(fileName);
+            if (std::error_code EC = BufOrErr.getError()) {
+                errs() << "Could not open " << fileName << ": " << EC.message() << "\n";
+                return false;
+            }
+            buffer = std::move(*BufOrErr);
+            curPtr = buffer->getBufferStart();
+            bufferEnd = buffer->getBufferEnd();
+            // シンボルの名前は前のバッファを指しているので捨てる。
+            symbolIds.clear();
+            symbolNames.clear();
+            return true;
+        }
+
+    private:
+        // intern - Nameのシンボル番号を返す。初めて見た名前なら新しい番号を割り当てる。
+        unsigned intern(StringRef Name) {
+            auto Result = symbolIds.try_emplace(Name, symbolNames.size());
+            if (Result.second)
+                symbolNames.push_back(Name);
+            return Result.first->second;
+        }
+
+        // これより小さいチャンクはスレッドに分けても速くならない
+        static const size_t MinChunkSize = 1 << 20;
+        std::unique_ptr<MemoryBuffer> buffer;
+        std::vector<LexedToken> tokens;
+        size_t tokPos = 0;
+        size_t curTokIndex = 0;
+        const char *curPtr = "";
+        const char *bufferEnd = curPtr;
+        uint64_t numVal;
+        // tok_identifierなら文字を入れる
+        StringRef identifierStr;
+        unsigned identifierSym = 0;
+        // シンボル表。名前からシンボル番号へのマップと、シンボル番号ごとの名前(ソースを指す)
+        StringMap<unsigned> symbolIds;
+        std::vector<StringRef> symbolNames;
+};
@@ -1,81 +1,211 @@
 #include "llvm/ADT/APInt.h"
 #include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SCCIterator.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/ProfileData/ProfileCommon.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/CachePruning.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/Host.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/SHA1.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/Scalar/TailRecursionElimination.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
 #include <fstream>
 #include <sstream>
 #include <iostream>
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <cmath>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
+#include <deque>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <system_error>
+#include <thread>
 #include <utility>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <csignal>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 using namespace llvm;
 using namespace llvm::sys;
 
+#include "options.h"
+
 #include "lexer.h"
 
-Lexer lexer;
+// コンパイラの状態はスレッドごとに持つ(compiler.hを参照)。
+thread_local Lexer lexer;
+
+#include "stats.h"
 
 #include "parser.h"
 
+#include "flatast.h"
+
+#include "vm.h"
+
+#include "consteval.h"
+
+#include "optimizer.h"
+
+#include "cache.h"
+
+#include "pgo.h"
+
 #include "codegen.h"
 
+#include "memoize.h"
+
+#include "multiversion.h"
+
+#include "jit.h"
+
+#include "parallel.h"
+
 #include "helper/helper.h"
 
+#include "pipeline.h"
+
+#include "compiler.h"
+
+#include "serve_protocol.h"
+
+#include "serve.h"
+
 //===----------------------------------------------------------------------===//
 // Main driver code.
 // コンパイラのインターフェースをドライバーと言ったりしますが、このメイン関数がまさにそれです。
 //===----------------------------------------------------------------------===//
 
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        std::cout << "./mc file.mc" << std::endl;
+// ベンチマークはMC_NO_MAINを定義してこのファイルをincludeし、コンパイラの関数を直接呼ぶ。
+#ifndef MC_NO_MAIN
+// runCommand - Optsの一回分のコンパイル(か実行)を行い、mainの戻り値を返す。
+// --serveのサーバーはリクエストごとにforkした子プロセスでこれを呼ぶ。
+static int runCommand() {
+    if (!Opts.CacheDir.empty())
+        FnCache.init(Opts.CacheDir, Opts.CacheSize);
+    if (!Opts.ProfileUse.empty() && !loadProfile(Opts.ProfileUse))
         return -1;
+
+    // --batchの場合は全てのファイルを一つのプロセスでコンパイルする。
+    if (Opts.Batch)
+        return runBatch();
+
+    // --pipelineの場合はパースしながら別のスレッドでcodegenとオブジェクトの出力を行う。
+    if (Opts.Pipeline)
+        return runPipeline();
+
+    // --vmの場合はLLVMを一切初期化せずにバイトコードVMで実行する。
+    if (Opts.VM) {
+        // mc言語のテキストファイルの読み込み
+        if (!lexer.initStream(Opts.InputFile))
+            return -1;
+        lexer.tokenize(Opts.LexThreads);
+        initBinopPrecedence();
+        getNextToken();
+        return VMMainLoop();
     }
 
-    // mc言語のテキストファイルの読み込み
-    std::string fileName = argv[1];
-    lexer.initStream(fileName);
+    mc::Compiler C;
+    std::string Output = getOutputFilename();
+    // --emit=llの場合は、各関数のLLVM IRを出来た順にそのまま出力先に書き出す。
+    std::unique_ptr<raw_fd_ostream> IROut;
+    if (Opts.Emit == EmitLL) {
+        IROut = openOutputFile(Output);
+        if (!IROut)
+            return -1;
+        C.setIRStream(IROut.get());
+    }
+    if (!C.compile(Opts.InputFile, Opts.LexThreads))
+        return -1;
+    C.setIRStream(nullptr);
+    IROut.reset();
+    finishCache();
 
-    // 二項演算子の定義
-    // 数字が低いほど結合度が低い
-    // TODO 3.1: '<'を実装してみよう
-    // BinopPrecedenceに'<'を登録して下さい。
-    BinopPrecedence['<'] = 10;
-    BinopPrecedence['+'] = 20;
-    BinopPrecedence['-'] = 20;
-    BinopPrecedence['*'] = 40;
+    // --runの場合はoutput.oを書き出さずにJITで実行する。
+    if (Opts.Run) {
+        int Ret = C.run();
+        finishStats();
+        return Ret;
+    }
+
+    bool Written = write_output(Output);
+    finishStats();
+
+    return Written ? 0 : -1;
+}
 
-    getNextToken();
+int main(int argc, char *argv[]) {
+    if (!parseOptions(argc, argv)) {
+        printUsage();
+        return -1;
+    }
 
-    MainLoop();
-    
-    write_output();
+    // --serveの場合はソケットで待ち受け、リクエストごとにrunCommandを実行する。
+    if (Opts.Serve)
+        return runServer(runCommand);
 
-    return 0;
+    return runCommand();
 }
+#endif // MC_NO_MAIN
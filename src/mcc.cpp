@@ -0,0 +1,49 @@
+//===----------------------------------------------------------------------===//
+// mcc - `./mc --serve`のクライアント
+// `./mcc [--socket=<path>] [options] file.mc`は、optionsとfile.mcをサーバーに送って
+// `./mc [options] file.mc`と同じコンパイルをさせ、同じ終了コードで終了します。
+// 起動を速くするためにLLVMをリンクせず、serve_protocol.hだけを使います。
+//===----------------------------------------------------------------------===//
+
+#include "serve_protocol.h"
+
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+
+int main(int argc, char *argv[]) {
+    std::string Path = mc::serve::getDefaultSocketPath();
+    std::vector<std::string> Args;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--socket=", 9) == 0)
+            Path = argv[i] + 9;
+        else
+            Args.push_back(argv[i]);
+    }
+
+    sockaddr_un Addr;
+    if (!mc::serve::makeAddress(Path, Addr)) {
+        fprintf(stderr, "Socket path is too long: %s\n", Path.c_str());
+        return -1;
+    }
+    int Sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (Sock < 0 || connect(Sock, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr)) != 0) {
+        fprintf(stderr, "Could not connect to %s: %s (start the server with ./mc --serve)\n",
+                Path.c_str(), strerror(errno));
+        return -1;
+    }
+
+    char Cwd[PATH_MAX];
+    if (!getcwd(Cwd, sizeof(Cwd))) {
+        fprintf(stderr, "Could not get the current directory: %s\n", strerror(errno));
+        return -1;
+    }
+    const int Fds[3] = {0, 1, 2};
+    int32_t Status;
+    if (!mc::serve::sendRequest(Sock, Fds, Cwd, Args) || !mc::serve::recvStatus(Sock, Status)) {
+        // 終了コードを送る前にサーバーの子プロセスが落ちた。
+        fprintf(stderr, "The compile server did not finish the request\n");
+        return -1;
+    }
+    return Status;
+}
@@ -0,0 +1,198 @@
+//===----------------------------------------------------------------------===//
+// Memoization
+// --memoizeが指定された場合、純粋な再帰関数の結果を表に覚えておき、同じ引数で
+// 呼ばれたら計算せずに返すようにします。MC言語の関数はi64を受け取ってi64を返すだけで、
+// 副作用のある操作はありません。なので、モジュール内で定義された純粋な関数しか呼ばない関数は
+// 純粋です(ただし配列を読み書きする関数は除きます)。コールグラフをSCCごとに呼ばれる側から
+// 調べて、これを確かめます。
+//
+// 例えばfibは次のように書き換わります。
+//   fib(x)          : memo表を引き、ヒットすればその値を返し、ミスならfib.nomemo(x)を呼んで覚える
+//   fib.nomemo(x)   : 元のfibの中身。再帰呼び出しはfibを呼ぶので、それも表を通る
+// 表はdirect-mappedで、衝突したら上書きするだけなので、大きさは一定(MemoTableSize個)です。
+// 表は関数ごとに一つで全てのスレッドから使うので、エントリはseqlockで守ります。
+//===----------------------------------------------------------------------===//
+
+namespace {
+    // 表のエントリの数(2のべき乗)
+    const unsigned MemoTableBits = 12;
+    const uint64_t MemoTableSize = 1ull << MemoTableBits;
+    // これより引数の多い関数は、表のエントリが大きくなるのでメモ化しない
+    const unsigned MaxMemoArgs = 4;
+} // end anonymous namespace
+
+// findPureRecursiveFunctions - Mの中の、純粋で再帰している関数を返す。
+static std::vector<Function *> findPureRecursiveFunctions(Module &M) {
+    CallGraph CG(M);
+    SmallPtrSet<Function *, 16> Pure;
+    std::vector<Function *> Result;
+
+    // scc_iteratorは呼ばれる側のSCCから先に返すので、呼び出し先の純粋性は既に分かっている。
+    for (auto I = scc_begin(&CG); !I.isAtEnd(); ++I) {
+        const std::vector<CallGraphNode *> &SCC = *I;
+        SmallPtrSet<Function *, 4> Members;
+        for (CallGraphNode *N : SCC)
+            if (Function *F = N->getFunction())
+                Members.insert(F);
+
+        bool IsPure = !Members.empty();
+        for (CallGraphNode *N : SCC) {
+            Function *F = N->getFunction();
+            // 外部のノード(宣言だけの関数や間接呼び出し)が入っていたら純粋とは言えない。
+            if (!F || F->isDeclaration()) {
+                IsPure = false;
+                break;
+            }
+            // 配列を読み書きする関数は、同じ引数でも配列の中身によって結果が変わる。
+            for (auto &I : instructions(F))
+                if (I.mayReadOrWriteMemory() && !isa<CallInst>(I))
+                    IsPure = false;
+            for (auto &Call : *N) {
+                Function *Callee = Call.second->getFunction();
+                if (!Callee || (!Members.count(Callee) && !Pure.count(Callee)))
+                    IsPure = false;
+            }
+        }
+        if (!IsPure)
+            continue;
+        Pure.insert(Members.begin(), Members.end());
+
+        if (!I.hasCycle())
+            continue;
+        for (Function *F : Members)
+            if (F->arg_size() >= 1 && F->arg_size() <= MaxMemoArgs)
+                Result.push_back(F);
+    }
+    return Result;
+}
+
+// memoizeFunction - Fの中身をF.nomemoに移し、Fを表を引くラッパーにする。
+static void memoizeFunction(Function &F) {
+    Module &M = *F.getParent();
+    LLVMContext &Ctx = M.getContext();
+    Type *I64 = Type::getInt64Ty(Ctx);
+    unsigned NumArgs = F.arg_size();
+
+    Function *Impl = Function::Create(F.getFunctionType(), Function::InternalLinkage,
+            F.getName() + ".nomemo", &M);
+    Impl->getBasicBlockList().splice(Impl->begin(), F.getBasicBlockList());
+    for (unsigned i = 0; i < NumArgs; ++i) {
+        Impl->getArg(i)->takeName(F.getArg(i));
+        F.getArg(i)->replaceAllUsesWith(Impl->getArg(i));
+        F.getArg(i)->setName(Impl->getArg(i)->getName());
+    }
+
+    // エントリは{引数..., 値, バージョン}。ゼロ初期化なので最初は全て無効。
+    // 表は全てのスレッドで共有するので、エントリはseqlockで読み書きする。バージョンは0なら未使用、
+    // 奇数なら書き込み中で、書き終わる度に2ずつ増える。読む側は前後で読んだバージョンが同じ偶数の
+    // 場合だけヒットとし、書き込み中のエントリを途中まで読んだ値を返さない。
+    std::vector<Type *> Fields(NumArgs + 2, I64);
+    StructType *EntryTy = StructType::get(Ctx, Fields);
+    ArrayType *TableTy = ArrayType::get(EntryTy, MemoTableSize);
+    auto *Table = new GlobalVariable(M, TableTy, false, GlobalValue::InternalLinkage,
+            ConstantAggregateZero::get(TableTy), F.getName() + ".memo");
+
+    BasicBlock *Entry = BasicBlock::Create(Ctx, "entry", &F);
+    BasicBlock *Hit = BasicBlock::Create(Ctx, "memo.hit", &F);
+    BasicBlock *Miss = BasicBlock::Create(Ctx, "memo.miss", &F);
+    BasicBlock *Store = BasicBlock::Create(Ctx, "memo.store", &F);
+    BasicBlock *Done = BasicBlock::Create(Ctx, "memo.done", &F);
+    IRBuilder<> B(Entry);
+    auto AtomicLoad = [&](Value *Ptr, AtomicOrdering Order, const Twine &Name = "") {
+        LoadInst *L = B.CreateAlignedLoad(I64, Ptr, Align(8), Name);
+        L->setAtomic(Order);
+        return L;
+    };
+    auto AtomicStore = [&](Value *Val, Value *Ptr, AtomicOrdering Order) {
+        B.CreateAlignedStore(Val, Ptr, Align(8))->setAtomic(Order);
+    };
+
+    // Fibonacci hashingで引数を混ぜ、上位ビットを表のインデックスにする。
+    Value *Hash = ConstantInt::get(I64, 0);
+    for (auto &Arg : F.args())
+        Hash = B.CreateMul(B.CreateXor(Hash, &Arg),
+                ConstantInt::get(I64, 0x9E3779B97F4A7C15ull), "memo.hash");
+    Value *Index = B.CreateLShr(Hash, 64 - MemoTableBits, "memo.index");
+    Value *Slot = B.CreateInBoundsGEP(TableTy, Table, {ConstantInt::get(I64, 0), Index},
+            "memo.slot");
+    Value *VersionPtr = B.CreateStructGEP(EntryTy, Slot, NumArgs + 1);
+
+    Value *Version = AtomicLoad(VersionPtr, AtomicOrdering::Acquire, "memo.version");
+    std::vector<Value *> Keys;
+    for (unsigned i = 0; i < NumArgs; ++i)
+        Keys.push_back(AtomicLoad(B.CreateStructGEP(EntryTy, Slot, i),
+                AtomicOrdering::Monotonic));
+    Value *Memo = AtomicLoad(B.CreateStructGEP(EntryTy, Slot, NumArgs),
+            AtomicOrdering::Monotonic, "memo.value");
+    B.CreateFence(AtomicOrdering::Acquire);
+    Value *Recheck = AtomicLoad(VersionPtr, AtomicOrdering::Monotonic, "memo.recheck");
+
+    Value *IsHit = B.CreateAnd(
+            B.CreateICmpNE(Version, ConstantInt::get(I64, 0)),
+            B.CreateICmpEQ(B.CreateAnd(Version, ConstantInt::get(I64, 1)),
+                    ConstantInt::get(I64, 0)), "memo.valid");
+    IsHit = B.CreateAnd(IsHit, B.CreateICmpEQ(Version, Recheck), "memo.stable");
+    for (unsigned i = 0; i < NumArgs; ++i)
+        IsHit = B.CreateAnd(IsHit, B.CreateICmpEQ(Keys[i], F.getArg(i)), "memo.match");
+    B.CreateCondBr(IsHit, Hit, Miss);
+
+    B.SetInsertPoint(Hit);
+    B.CreateRet(Memo);
+
+    // ミスの場合は計算してから覚える。計算中の再帰呼び出しが同じエントリを上書きしても、
+    // 最後に書いたものが残るだけなので問題無い。他のスレッドが書き込み中(バージョンが奇数)なら
+    // compare-exchangeが失敗するので、覚えずに返す。
+    B.SetInsertPoint(Miss);
+    std::vector<Value *> Args;
+    for (auto &Arg : F.args())
+        Args.push_back(&Arg);
+    Value *Result = B.CreateCall(Impl, Args, "memo.result");
+    Value *Old = B.CreateAnd(AtomicLoad(VersionPtr, AtomicOrdering::Monotonic),
+            ConstantInt::get(I64, ~1ull), "memo.old");
+    Value *Lock = B.CreateAtomicCmpXchg(VersionPtr, Old,
+            B.CreateAdd(Old, ConstantInt::get(I64, 1)), Align(8),
+            AtomicOrdering::Monotonic, AtomicOrdering::Monotonic);
+    B.CreateCondBr(B.CreateExtractValue(Lock, 1, "memo.locked"), Store, Done);
+
+    B.SetInsertPoint(Store);
+    B.CreateFence(AtomicOrdering::Release);
+    for (unsigned i = 0; i < NumArgs; ++i)
+        AtomicStore(F.getArg(i), B.CreateStructGEP(EntryTy, Slot, i), AtomicOrdering::Monotonic);
+    AtomicStore(Result, B.CreateStructGEP(EntryTy, Slot, NumArgs), AtomicOrdering::Monotonic);
+    AtomicStore(B.CreateAdd(Old, ConstantInt::get(I64, 2)), VersionPtr, AtomicOrdering::Release);
+    B.CreateBr(Done);
+
+    B.SetInsertPoint(Done);
+    B.CreateRet(Result);
+
+    verifyFunction(F);
+}
+
+// eliminateTailCalls - Mの関数の、自分自身の末尾呼び出しとアキュムレータを導入できる呼び出しを
+// ループにする。メモ化するとFの再帰がFからF.nomemo、F.nomemoからFへの呼び出しに分かれて、
+// 後のoptimizeModuleのTailCallElimPassがループにできなくなるので、メモ化より先に行う。
+static void eliminateTailCalls(Module &M) {
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PassBuilder PB;
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    ModulePassManager MPM;
+    MPM.addPass(createModuleToFunctionPassAdaptor(TailCallElimPass()));
+    MPM.run(M, MAM);
+}
+
+// memoizeModule - Mの純粋な再帰関数を全てメモ化する。
+// 末尾呼び出しの除去で再帰が全てループになった関数(例えば`n + sum(n - 1)`)は、再帰していないので
+// メモ化しない。
+static void memoizeModule(Module &M) {
+    eliminateTailCalls(M);
+    for (Function *F : findPureRecursiveFunctions(M))
+        memoizeFunction(*F);
+}
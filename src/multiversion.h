@@ -0,0 +1,132 @@
+//===----------------------------------------------------------------------===//
+// Function Multiversioning
+// --multiversionが指定された場合、モジュール中の全ての関数について
+// generic版、AVX2版、AVX-512版のクローンを作り、元の関数はifuncに置き換えます。
+// ifuncのresolverはプログラムのロード時に一度だけ呼ばれ、cpuidの結果(__cpu_model)を見て
+// 実行中のCPUで使える一番新しいクローンを選びます。クローンは-mcpuや-mattrに関係なく
+// generic(x86-64)のCPUにそれぞれの機能だけを足してコンパイルするので、default版はどのx86-64でも動きます。
+// クローンの中の関数呼び出しは同じバージョンのクローンを直接呼ぶので、
+// 再帰呼び出しの度にifuncを経由することはありません。
+//===----------------------------------------------------------------------===//
+
+namespace {
+    struct MultiversionVariant {
+        // クローンの名前に付けるsuffix e.g. fib.avx2
+        const char *Suffix;
+        // genericのCPUに追加するtarget-features
+        const char *Features;
+        // Featuresの全ての機能に対応する__cpu_model.__cpu_features[0]のビット。
+        // 0ならresolverのフォールバック
+        uint32_t CPUFeatureMask;
+    };
+
+    // compiler-rt/libgccのProcessorFeaturesと同じビット番号
+    enum : uint32_t {
+        CPUFeatureAVX = 1u << 9,
+        CPUFeatureAVX2 = 1u << 10,
+        CPUFeatureFMA = 1u << 14,
+        CPUFeatureAVX512F = 1u << 15,
+    };
+
+    // resolverは後ろの要素から順に試すので、新しい命令セットほど後ろに置く。
+    const MultiversionVariant MultiversionVariants[] = {
+        {"default", "", 0},
+        {"avx2", "+avx,+avx2,+fma", CPUFeatureAVX | CPUFeatureAVX2 | CPUFeatureFMA},
+        {"avx512", "+avx,+avx2,+fma,+avx512f",
+            CPUFeatureAVX | CPUFeatureAVX2 | CPUFeatureFMA | CPUFeatureAVX512F},
+    };
+} // end anonymous namespace
+
+// createResolver - 実行中のCPUに合ったクローンのアドレスを返すifunc resolverを作る。
+static Function *createResolver(Function *F, ArrayRef<Function *> Clones) {
+    Module &M = *F->getParent();
+    PointerType *FnPtrTy = F->getFunctionType()->getPointerTo();
+    Function *Resolver = Function::Create(FunctionType::get(FnPtrTy, false),
+            Function::ExternalLinkage, F->getName() + ".resolver", &M);
+    Resolver->setVisibility(GlobalValue::HiddenVisibility);
+
+    // ifunc resolverはコンストラクタより先に走るので、__cpu_modelを自分で初期化する。
+    Type *Int32Ty = Type::getInt32Ty(Context);
+    StructType *CPUModelTy = StructType::get(Context,
+            {Int32Ty, Int32Ty, Int32Ty, ArrayType::get(Int32Ty, 1)});
+    FunctionCallee InitFn = M.getOrInsertFunction("__cpu_indicator_init",
+            Type::getVoidTy(Context));
+    Constant *CPUModel = M.getOrInsertGlobal("__cpu_model", CPUModelTy);
+
+    IRBuilder<> B(BasicBlock::Create(Context, "entry", Resolver));
+    B.CreateCall(InitFn);
+    Value *FeaturesPtr = B.CreateConstInBoundsGEP2_32(CPUModelTy, CPUModel, 0, 3);
+    FeaturesPtr = B.CreateConstInBoundsGEP2_32(ArrayType::get(Int32Ty, 1), FeaturesPtr, 0, 0);
+    Value *Features = B.CreateLoad(Int32Ty, FeaturesPtr, "cpu_features");
+
+    Value *Selected = Clones[0];
+    // クローンが使う機能が一つでも無ければ選ばない。例えばAVX2があってもFMAが無いCPUでは
+    // avx2版は使えない。
+    for (unsigned i = 1; i < Clones.size(); ++i) {
+        uint32_t Mask = MultiversionVariants[i].CPUFeatureMask;
+        Value *Has = B.CreateICmpEQ(B.CreateAnd(Features, Mask),
+                ConstantInt::get(Int32Ty, Mask), "has_features");
+        Selected = B.CreateSelect(Has, Clones[i], Selected);
+    }
+    B.CreateRet(Selected);
+    return Resolver;
+}
+
+// multiversionModule - モジュール中の定義済み関数を全てifunc経由の呼び出しに置き換える。
+static void multiversionModule(Module &M) {
+    Triple TT(M.getTargetTriple());
+    if (TT.getArch() != Triple::x86_64 || !TT.isOSBinFormatELF()) {
+        errs() << "--multiversion is only supported on x86-64 ELF targets\n";
+        return;
+    }
+
+    std::vector<Function *> Fs;
+    for (auto &F : M)
+        if (!F.isDeclaration())
+            Fs.push_back(&F);
+
+    const unsigned NumVariants = array_lengthof(MultiversionVariants);
+
+    // まず全てのクローンの宣言を作り、VMapで元の関数からクローンへの対応を作っておく。
+    // こうするとCloneFunctionIntoがクローン内の呼び出し先を同じバージョンに書き換えてくれる。
+    std::vector<std::vector<Function *>> Clones(Fs.size());
+    for (unsigned v = 0; v < NumVariants; ++v) {
+        const MultiversionVariant &Variant = MultiversionVariants[v];
+        ValueToValueMapTy VMap;
+        for (unsigned i = 0; i < Fs.size(); ++i) {
+            Function *Clone = Function::Create(Fs[i]->getFunctionType(),
+                    Function::ExternalLinkage,
+                    Fs[i]->getName() + "." + Variant.Suffix, &M);
+            Clone->setVisibility(GlobalValue::HiddenVisibility);
+            Clones[i].push_back(Clone);
+            VMap[Fs[i]] = Clone;
+        }
+
+        for (unsigned i = 0; i < Fs.size(); ++i) {
+            Function *Clone = Clones[i].back();
+            auto NewArg = Clone->arg_begin();
+            for (auto &Arg : Fs[i]->args()) {
+                NewArg->setName(Arg.getName());
+                VMap[&Arg] = &*NewArg++;
+            }
+            SmallVector<ReturnInst *, 4> Returns;
+            CloneFunctionInto(Clone, Fs[i], VMap,
+                    CloneFunctionChangeType::LocalChangesOnly, Returns);
+
+            // -mcpu=native等の機能を引き継ぐと、default版が他のCPUで動かなくなる。
+            Clone->addFnAttr("target-cpu", "x86-64");
+            Clone->addFnAttr("target-features", Variant.Features);
+        }
+    }
+
+    // 元の関数をifuncに置き換える。
+    for (unsigned i = 0; i < Fs.size(); ++i) {
+        Function *F = Fs[i];
+        Function *Resolver = createResolver(F, Clones[i]);
+        GlobalIFunc *IFunc = GlobalIFunc::create(F->getFunctionType(), 0,
+                F->getLinkage(), "", Resolver, &M);
+        IFunc->takeName(F);
+        F->replaceAllUsesWith(IFunc);
+        F->eraseFromParent();
+    }
+}
@@ -0,0 +1,198 @@
+//===----------------------------------------------------------------------===//
+// Target & Optimizer
+// このファイルでは、オブジェクトファイルを出力するターゲット(TargetMachine)を作り、
+// codegen.hで生成したLLVM IRにnew PassManagerで最適化をかけます。
+// -O1以上が指定された場合、各関数のcodegen直後に関数単位のパイプラインを、
+// write_outputでオブジェクトファイルを出力する直前にモジュール単位のパイプラインを走らせます。
+// https://llvm.org/docs/NewPassManager.html
+//===----------------------------------------------------------------------===//
+
+// TargetMachineはスレッドセーフではないので、スレッドごとに作る。
+static thread_local std::unique_ptr<TargetMachine> TheTargetMachine;
+// createTargetMachineが使う、initTargetで決めたターゲットの情報
+static const Target *TheTarget;
+static std::string TargetTriple, TargetCPU, TargetFeatures;
+
+// createTargetMachine - TheTargetMachineと同じ設定のTargetMachineを新しく作る。
+// -jの各スレッドはそれぞれ自分のものを使う。
+static std::unique_ptr<TargetMachine> createTargetMachine() {
+    TargetOptions opt;
+    // 最近のリンカはデフォルトでPIEを作るので、グローバル変数(--memoizeの表等)を参照しても
+    // リンクできるようにPICで出力する。
+    auto RM = Optional<Reloc::Model>(Reloc::PIC_);
+    // -O0ではFastISelと高速なレジスタ割り当てを使う。SelectionDAGは基本ブロックの大きさに対して
+    // 線形より遅くなるので、長い式を持つ関数ではオブジェクトの出力が大半の時間を占めてしまう。
+    auto OL = Opts.OptLevel == 0 ? CodeGenOpt::None : CodeGenOpt::Default;
+    return std::unique_ptr<TargetMachine>(TheTarget->createTargetMachine(
+                TargetTriple, TargetCPU, TargetFeatures, opt, RM, None, OL));
+}
+
+// selectTargetCPU - Optsの-mcpuと-mattrから、TargetCPUとTargetFeaturesを決める。
+static void selectTargetCPU() {
+    // -mcpu=nativeの場合は、ビルドマシンのCPU名と機能をLLVMに問い合わせる。
+    std::string CPU = Opts.CPU;
+    SubtargetFeatures Features;
+    if (CPU == "native") {
+        CPU = sys::getHostCPUName().str();
+        StringMap<bool> HostFeatures;
+        if (sys::getHostCPUFeatures(HostFeatures))
+            for (auto &F : HostFeatures)
+                Features.AddFeature(F.first(), F.second);
+    }
+    if (!Opts.Attrs.empty()) {
+        SmallVector<StringRef, 8> Attrs;
+        StringRef(Opts.Attrs).split(Attrs, ',', -1, false);
+        for (StringRef A : Attrs)
+            Features.AddFeature(A);
+    }
+
+    TargetCPU = CPU;
+    TargetFeatures = Features.getString();
+}
+
+// initTarget - ターゲットを初期化し、ホストのターゲットトリプルとCPUを決める。
+// プロセス全体で一度だけinitTargetMachineから呼ばれる。
+static bool initTarget() {
+    // Initialize the target registry etc.
+    InitializeAllTargetInfos();
+    InitializeAllTargets();
+    InitializeAllTargetMCs();
+    InitializeAllAsmParsers();
+    InitializeAllAsmPrinters();
+
+    TargetTriple = sys::getDefaultTargetTriple();
+
+    std::string Error;
+    TheTarget = TargetRegistry::lookupTarget(TargetTriple, Error);
+
+    // Print an error and exit if we couldn't find the requested target.
+    // This generally occurs if we've forgotten to initialise the
+    // TargetRegistry or we have a bogus target triple.
+    if (!TheTarget) {
+        errs() << Error;
+        return false;
+    }
+
+    selectTargetCPU();
+    return true;
+}
+
+// initTargetMachine - このスレッドのTheTargetMachineを作る。
+static bool initTargetMachine() {
+    static std::once_flag Once;
+    static bool TargetFound;
+    std::call_once(Once, [] { TargetFound = initTarget(); });
+    if (!TargetFound)
+        return false;
+    if (!TheTargetMachine)
+        TheTargetMachine = createTargetMachine();
+    return true;
+}
+
+// 各AnalysisManagerは解析結果をキャッシュする。PassBuilderを使って互いに登録しておく必要がある。
+// codegen.hの状態と同じく、スレッドごとに持つ。
+static thread_local LoopAnalysisManager LAM;
+static thread_local FunctionAnalysisManager FAM;
+static thread_local CGSCCAnalysisManager CGAM;
+static thread_local ModuleAnalysisManager MAM;
+static thread_local std::unique_ptr<PassBuilder> PB;
+// 関数単位の最適化パイプライン(instcombine, GVN, simplifycfg等)
+static thread_local FunctionPassManager FPM;
+
+static OptimizationLevel getOptimizationLevel() {
+    switch (Opts.OptLevel) {
+        case 0:
+            return OptimizationLevel::O0;
+        case 1:
+            return OptimizationLevel::O1;
+        case 2:
+            return OptimizationLevel::O2;
+        default:
+            return OptimizationLevel::O3;
+    }
+}
+
+static void initOptimizer() {
+    if (PB)
+        return;
+    PB = std::make_unique<PassBuilder>(TheTargetMachine.get());
+    PB->registerModuleAnalyses(MAM);
+    PB->registerCGSCCAnalyses(CGAM);
+    PB->registerFunctionAnalyses(FAM);
+    PB->registerLoopAnalyses(LAM);
+    PB->crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    // -O0の場合は何も最適化しない。
+    if (Opts.OptLevel > 0)
+        FPM = PB->buildFunctionSimplificationPipeline(getOptimizationLevel(),
+                ThinOrFullLTOPhase::None);
+}
+
+// resetOptimizer - PassBuilderと関数単位の最適化パイプラインを捨て、次のinitOptimizerで作り直させる。
+// 登録した解析はTheTargetMachineを参照しているので、AnalysisManagerも新しくする。
+static void resetOptimizer() {
+    FPM = FunctionPassManager();
+    LAM = LoopAnalysisManager();
+    FAM = FunctionAnalysisManager();
+    CGAM = CGSCCAnalysisManager();
+    MAM = ModuleAnalysisManager();
+    PB.reset();
+}
+
+// optimizeFunction - FunctionAST::codegenで作った関数に関数単位の最適化をかける。
+static void optimizeFunction(Function &F) {
+    if (Opts.OptLevel == 0)
+        return;
+    PhaseTimer Timer(PhaseOptimize);
+    FPM.run(F, FAM);
+}
+
+// optimizeModule - モジュール全体にインライン展開等を含むパイプラインをかける。
+// -jの各スレッドからも呼ばれるので、AnalysisManagerとPassBuilderは呼び出しごとに作る。
+static void optimizeModule(Module &M, TargetMachine *TM = TheTargetMachine.get()) {
+    PhaseTimer Timer(PhaseOptimize);
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PassBuilder PB(TM);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    // MC言語の関数は繰り返しを再帰で書くことが多く、例えば`sum(10000000)`のような深い再帰でも
+    // スタックが溢れないように、-O0でも自分自身の末尾呼び出しをループにする。
+    // TailCallElimPassは"n * f(n - 1)"や"f(n - 1) + k"のような結合的な演算も、
+    // アキュムレータを導入してループにする。
+    ModulePassManager MPM;
+    MPM.addPass(createModuleToFunctionPassAdaptor(TailCallElimPass()));
+    if (Opts.OptLevel > 0)
+        MPM.addPass(PB.buildPerModuleDefaultPipeline(getOptimizationLevel()));
+    MPM.run(M, MAM);
+
+    if (Opts.PrintAfterOpt) {
+        // 複数のスレッドの出力が混ざらないようにする。
+        static std::mutex PrintMutex;
+        std::lock_guard<std::mutex> Lock(PrintMutex);
+        M.print(errs(), nullptr);
+    }
+}
+
+// emitObject - TMでMをオブジェクトファイルにしてdestに書き出す。
+// FileTypeがCGFT_AssemblyFileならアセンブリを書き出す(--emit=asm)。
+static bool emitObject(Module &M, TargetMachine &TM, raw_pwrite_stream &dest,
+        CodeGenFileType FileType = CGFT_ObjectFile) {
+    PhaseTimer Timer(PhaseEmit);
+    legacy::PassManager pass;
+
+    if (TM.addPassesToEmitFile(pass, dest, nullptr, FileType)) {
+        errs() << "TheTargetMachine can't emit a file of this type";
+        return false;
+    }
+
+    pass.run(M);
+    dest.flush();
+    return true;
+}
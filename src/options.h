@@ -0,0 +1,233 @@
+//===----------------------------------------------------------------------===//
+// Options
+// mcコマンドのオプションを保持する。mc.cppのmain関数でparseOptionsを呼び、
+// 各ファイルからはOptsを参照する。
+//===----------------------------------------------------------------------===//
+
+// --emit=で選ぶ出力の種類
+enum EmitKind {
+    // オブジェクトファイル(デフォルト)
+    EmitObj,
+    // 関数ごとのLLVM IRのテキスト。codegenと関数単位の最適化が終わった順に書き出す
+    EmitLL,
+    // モジュール単位の最適化が終わったモジュールのビットコード
+    EmitBC,
+    // モジュール単位の最適化が終わったモジュールのアセンブリ
+    EmitAsm,
+    // 何も出力しない
+    EmitNone,
+};
+
+struct MCOptions {
+    // 入力の.mcファイル("-"ならstdin)
+    std::string InputFile;
+    // --batchの場合の全ての入力ファイル
+    std::vector<std::string> InputFiles;
+    // -O0/-O1/-O2/-O3
+    unsigned OptLevel = 0;
+    // --print-after-opt: 最適化後のモジュール全体をstderrに出力する
+    bool PrintAfterOpt = false;
+    // --emit={obj,ll,bc,asm,none}: 出力の種類
+    EmitKind Emit = EmitObj;
+    // -o <file>: 出力先。"-"ならstdout。空ならoutput.o, output.ll等
+    std::string OutputFile;
+    // -mcpu=: 出力するオブジェクトをチューニングするCPU。"native"ならビルドマシンのCPU
+    std::string CPU = "generic";
+    // -mattr=: "+avx2,-sse4a"のようなCPU機能のリスト
+    std::string Attrs;
+    // --multiversion: generic/AVX2/AVX-512版の関数を全て出力し、実行時にifuncで選択する
+    bool Multiversion = false;
+    // --run: output.oを書き出さずにJITで実行する
+    bool Run = false;
+    // -lex-threads=N: トークナイズに使うスレッド数。0ならハードウェアのスレッド数
+    unsigned LexThreads = 0;
+    // --vm: LLVMを使わずにバイトコードVMで実行する
+    bool VM = false;
+    // --call <関数名> <引数>...: --run/--vmの時に呼び出す関数とその引数
+    std::string CallFunction;
+    std::vector<int64_t> CallArgs;
+    // --flat-ast: クラス階層の代わりに配列で表したAST(flatast.h)を作ってcodegenする
+    bool FlatAST = false;
+    // -j N: モジュールをN個に分割し、最適化とオブジェクトの出力をNスレッドで行う
+    // --batchの場合は、同時にコンパイルするファイルの数
+    unsigned Jobs = 1;
+    // --batch: 全ての入力ファイルを一つのプロセスでコンパイルし、file.mcをfile.oに出力する
+    bool Batch = false;
+    // --pipeline: パースと並行して、-j N個のスレッドでcodegen、最適化、オブジェクトの出力を行う
+    // (pipeline.h)
+    bool Pipeline = false;
+    // --memoize: 純粋な再帰関数の結果を表に覚えておく(memoize.h)
+    bool Memoize = false;
+    // --cache-dir=DIR: 関数ごとのIRをDIRにキャッシュする(cache.h)
+    std::string CacheDir;
+    // --cache-size=N[k|m|g]: キャッシュのディレクトリの上限のバイト数。単位が無ければMB
+    uint64_t CacheSize = 256 << 20;
+    // --cache-stats: キャッシュのヒット数、ミス数等をstderrに出力する
+    bool CacheStats = false;
+    // --consteval-fuel=N: 引数が全て定数の呼び出しをコンパイル時に評価する時の、
+    // 一つの呼び出しあたりの関数呼び出しとループの回数の上限。0なら評価しない(consteval.h)
+    uint64_t ConstEvalFuel = 10000000;
+    // --consteval-budget=N: 一つのコンパイルで、全ての呼び出しの評価に使う回数の合計の上限。
+    // 使い切ったら残りの呼び出しは評価しない
+    uint64_t ConstEvalBudget = 100000000;
+    // --profile-generate[=FILE]: 関数の入口と条件分岐にカウンタを入れ、終了時にFILEに書き出す(pgo.h)
+    std::string ProfileGenerate;
+    // --profile-use=FILE: FILEのプロファイルをentry countとbranch weightsとして使って最適化する
+    std::string ProfileUse;
+    // -time-phases: 字句解析、構文解析、codegen等のフェーズごとの時間をstderrに出力する(stats.h)
+    bool TimePhases = false;
+    // -stats=json: フェーズごとの時間、トークン数、IRの命令数、コードサイズ等をJSONでstdoutに出力する
+    bool StatsJSON = false;
+    // --serve: ソケットで待ち受け、./mccから受け取ったコマンドラインをコンパイルする(serve.h)
+    bool Serve = false;
+    // --socket=PATH: --serveで待ち受けるUnixドメインソケット。空なら/tmp/mc-<uid>.sock
+    std::string SocketPath;
+};
+
+static MCOptions Opts;
+
+static void printUsage() {
+    std::cout << "./mc [-O0|-O1|-O2|-O3] [--emit=obj|ll|bc|asm|none] [-o <file>|-] "
+              << "[--print-after-opt] [-mcpu=<cpu>|native] "
+              << "[-mattr=<+feature,...>] [--multiversion] [--memoize] [-lex-threads=N] [--flat-ast] [-j N] "
+              << "[--consteval-fuel=N] [--consteval-budget=N] [--profile-generate[=<file>]|--profile-use=<file>] "
+              << "[-time-phases] [-stats=json] "
+              << "[--cache-dir=<dir> [--cache-size=N[k|m|g]] [--cache-stats]] "
+              << "[--run|--vm [--call <function> <args>...]] file.mc" << std::endl;
+    std::cout << "./mc --batch [-j N] [options] file.mc..." << std::endl;
+    std::cout << "./mc --pipeline [-j N] [-o <file>] [-O0|-O1|-O2|-O3] [-mcpu=<cpu>|native] "
+              << "[-mattr=<+feature,...>] "
+              << "[--multiversion] [--memoize] [-lex-threads=N] file.mc" << std::endl;
+    std::cout << "./mc --serve [--socket=<path>] [-O0|-O1|-O2|-O3] [-mcpu=<cpu>|native] "
+              << "[-mattr=<+feature,...>]" << std::endl;
+}
+
+// parseOptions - argvを読んでOptsにセットする。不正なオプションがあればfalseを返す。
+static bool parseOptions(int argc, char *argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        StringRef Arg = argv[i];
+        if (Arg.size() == 3 && Arg.startswith("-O") && Arg[2] >= '0' && Arg[2] <= '3') {
+            Opts.OptLevel = Arg[2] - '0';
+        } else if (Arg == "--print-after-opt") {
+            Opts.PrintAfterOpt = true;
+        } else if (Arg.startswith("--emit=")) {
+            StringRef Kind = Arg.substr(7);
+            if (Kind == "obj")
+                Opts.Emit = EmitObj;
+            else if (Kind == "ll")
+                Opts.Emit = EmitLL;
+            else if (Kind == "bc")
+                Opts.Emit = EmitBC;
+            else if (Kind == "asm")
+                Opts.Emit = EmitAsm;
+            else if (Kind == "none")
+                Opts.Emit = EmitNone;
+            else
+                return false;
+        } else if (Arg == "-o") {
+            if (++i == argc)
+                return false;
+            Opts.OutputFile = argv[i];
+        } else if (Arg.startswith("-mcpu=")) {
+            Opts.CPU = Arg.substr(6).str();
+        } else if (Arg.startswith("-mattr=")) {
+            Opts.Attrs = Arg.substr(7).str();
+        } else if (Arg == "--multiversion") {
+            Opts.Multiversion = true;
+        } else if (Arg == "--memoize") {
+            Opts.Memoize = true;
+        } else if (Arg.startswith("-lex-threads=")) {
+            if (Arg.substr(13).getAsInteger(10, Opts.LexThreads))
+                return false;
+        } else if (Arg.startswith("-j")) {
+            // -j Nと-jNのどちらも受け付ける
+            StringRef N = Arg.substr(2);
+            if (N.empty() && ++i < argc)
+                N = argv[i];
+            if (N.getAsInteger(10, Opts.Jobs) || Opts.Jobs == 0)
+                return false;
+        } else if (Arg.startswith("--cache-dir=")) {
+            Opts.CacheDir = Arg.substr(12).str();
+        } else if (Arg.startswith("--cache-size=")) {
+            StringRef Size = Arg.substr(13);
+            unsigned Shift = 20;
+            switch (Size.empty() ? 0 : tolower(Size.back())) {
+                case 'k': Shift = 10; Size = Size.drop_back(); break;
+                case 'm': Shift = 20; Size = Size.drop_back(); break;
+                case 'g': Shift = 30; Size = Size.drop_back(); break;
+            }
+            if (Size.getAsInteger(10, Opts.CacheSize) || Opts.CacheSize == 0)
+                return false;
+            Opts.CacheSize <<= Shift;
+        } else if (Arg.startswith("--consteval-fuel=")) {
+            if (Arg.substr(17).getAsInteger(10, Opts.ConstEvalFuel))
+                return false;
+        } else if (Arg.startswith("--consteval-budget=")) {
+            if (Arg.substr(19).getAsInteger(10, Opts.ConstEvalBudget))
+                return false;
+        } else if (Arg == "--profile-generate") {
+            Opts.ProfileGenerate = "default.mcprof";
+        } else if (Arg.startswith("--profile-generate=")) {
+            Opts.ProfileGenerate = Arg.substr(19).str();
+        } else if (Arg.startswith("--profile-use=")) {
+            Opts.ProfileUse = Arg.substr(14).str();
+        } else if (Arg == "-time-phases") {
+            Opts.TimePhases = true;
+        } else if (Arg == "-stats=json") {
+            Opts.StatsJSON = true;
+        } else if (Arg == "--cache-stats") {
+            Opts.CacheStats = true;
+        } else if (Arg == "--batch") {
+            Opts.Batch = true;
+        } else if (Arg == "--pipeline") {
+            Opts.Pipeline = true;
+        } else if (Arg == "--serve") {
+            Opts.Serve = true;
+        } else if (Arg.startswith("--socket=")) {
+            Opts.SocketPath = Arg.substr(9).str();
+        } else if (Arg == "--flat-ast") {
+            Opts.FlatAST = true;
+        } else if (Arg == "--run") {
+            Opts.Run = true;
+        } else if (Arg == "--vm") {
+            Opts.VM = true;
+        } else if (Arg == "--call") {
+            if (++i == argc)
+                return false;
+            Opts.CallFunction = argv[i];
+            // 続く整数を全て引数として読む
+            int64_t Val;
+            while (i + 1 < argc && !StringRef(argv[i + 1]).getAsInteger(10, Val)) {
+                Opts.CallArgs.push_back(Val);
+                ++i;
+            }
+        } else if (Arg.startswith("-") && Arg != "-") {
+            errs() << "Unknown option: " << Arg << "\n";
+            return false;
+        } else {
+            Opts.InputFile = Arg.str();
+            Opts.InputFiles.push_back(Arg.str());
+        }
+    }
+    // カウンタを入れたIRにプロファイルを付けても意味が無いので、同時には使えない。
+    if (!Opts.ProfileGenerate.empty() && !Opts.ProfileUse.empty())
+        return false;
+    // パイプラインはクラス階層のASTを別のスレッドでcodegenしてオブジェクトファイルを出力するだけで、
+    // 一つのモジュールを必要とする機能とは組み合わせられない。
+    if (Opts.Pipeline && (Opts.Batch || Opts.Run || Opts.VM || Opts.FlatAST ||
+                !Opts.CacheDir.empty() || !Opts.ProfileGenerate.empty() ||
+                !Opts.ProfileUse.empty() || Opts.Emit != EmitObj)) {
+        errs() << "--pipeline cannot be used with --batch, --run, --vm, --flat-ast, "
+               << "--cache-dir, --profile-* or --emit other than obj\n";
+        return false;
+    }
+    // --batchはファイルごとにfile.oを書き出す。
+    if (Opts.Batch && (Opts.Emit != EmitObj || !Opts.OutputFile.empty())) {
+        errs() << "--batch cannot be used with --emit or -o\n";
+        return false;
+    }
+    // サーバーは入力ファイルをリクエストで受け取る。
+    if (Opts.Serve)
+        return Opts.InputFile.empty();
+    return !Opts.InputFile.empty();
+}
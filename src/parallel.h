@@ -0,0 +1,116 @@
+//===----------------------------------------------------------------------===//
+// Parallel Backend
+// -j Nが指定された場合、write_outputはmyModuleをSplitModuleでN個に分割し、
+// 各部分の最適化とオブジェクトファイルの出力をNスレッドで並列に行います。
+// LLVMContextはスレッドセーフではないので、各部分はビットコードにして
+// スレッドごとの新しいLLVMContextに読み直します。TargetMachineもスレッドごとに作ります。
+// 各部分のオブジェクトファイルは一時ファイルに出力し、`ld -r`で一つのoutput.o(-oの出力先)に
+// まとめます。同時に走る別のコンパイルと名前がぶつからないように、一時ファイルは
+// sys::fs::createTemporaryFileで作り、成功しても失敗しても最後に消します。
+// 関数の中身は直列の場合と同じですが、部分をまたいだインライン展開は行われません。
+//===----------------------------------------------------------------------===//
+
+// emitPartObject - ビットコードのBitcodeを読み直し、最適化してFilenameに出力する。
+static bool emitPartObject(StringRef Bitcode, const std::string &Filename) {
+    LLVMContext Ctx;
+    auto MOrErr = parseBitcodeFile(MemoryBufferRef(Bitcode, Filename), Ctx);
+    if (!MOrErr) {
+        errs() << Filename << ": " << toString(MOrErr.takeError()) << "\n";
+        return false;
+    }
+    std::unique_ptr<TargetMachine> TM = createTargetMachine();
+    optimizeModule(**MOrErr, TM.get());
+
+    std::error_code EC;
+    raw_fd_ostream dest(Filename, EC, sys::fs::OF_None);
+    if (EC) {
+        errs() << "Could not open file: " << EC.message() << "\n";
+        return false;
+    }
+    return emitObject(**MOrErr, *TM, dest);
+}
+
+// removePartFiles - createPartFilesで作った一時ファイルを消す。
+static void removePartFiles(std::vector<std::string> &Parts) {
+    for (auto &P : Parts)
+        sys::fs::remove(P);
+    Parts.clear();
+}
+
+// createPartFiles - Filenameの部分のオブジェクトファイルをN個、一時ファイルとして作り、
+// そのパスをPartsに入れる。作れなければ、作った分を消してfalseを返す。
+static bool createPartFiles(StringRef Filename, unsigned N, std::vector<std::string> &Parts) {
+    for (unsigned i = 0; i < N; ++i) {
+        SmallString<128> Path;
+        if (std::error_code EC = sys::fs::createTemporaryFile(sys::path::stem(Filename), "o",
+                    Path)) {
+            errs() << "Could not create a temporary file: " << EC.message() << "\n";
+            removePartFiles(Parts);
+            return false;
+        }
+        Parts.push_back(Path.str().str());
+    }
+    return true;
+}
+
+// linkRelocatable - Partsを`ld -r`で一つのオブジェクトファイルFilenameにまとめ、Partsを消す。
+static bool linkRelocatable(StringRef Filename, std::vector<std::string> &Parts) {
+    auto Ld = sys::findProgramByName("ld");
+    std::vector<StringRef> Args;
+    if (Ld) {
+        Args = {*Ld, "-r", "-o", Filename};
+        for (auto &P : Parts)
+            Args.push_back(P);
+    }
+    bool Linked = Ld && sys::ExecuteAndWait(*Ld, Args) == 0;
+    removePartFiles(Parts);
+    if (!Linked)
+        errs() << "Could not combine objects into " << Filename << " with ld -r\n";
+    return Linked;
+}
+
+// writeObjectParallel - myModuleをN個に分割し、Nスレッドで最適化してFilenameに出力する。
+static bool writeObjectParallel(StringRef Filename, unsigned N) {
+    // SplitModuleはifunc(--multiversion)を複製しないので、resolverが入った部分に作り直す。
+    struct IFuncInfo {
+        std::string Name, Resolver;
+        Type *FnTy;
+    };
+    std::vector<IFuncInfo> IFuncs;
+    for (auto &IF : myModule->ifuncs())
+        IFuncs.push_back({IF.getName().str(), IF.getResolverFunction()->getName().str(),
+                IF.getValueType()});
+
+    std::vector<SmallVector<char, 0>> Bitcodes;
+    SplitModule(*myModule, N, [&](std::unique_ptr<Module> MPart) {
+        for (auto &I : IFuncs) {
+            Function *Resolver = MPart->getFunction(I.Resolver);
+            if (!Resolver || Resolver->isDeclaration())
+                continue;
+            GlobalIFunc::create(I.FnTy, 0, GlobalValue::ExternalLinkage, I.Name,
+                    Resolver, MPart.get());
+        }
+        Bitcodes.emplace_back();
+        raw_svector_ostream OS(Bitcodes.back());
+        WriteBitcodeToFile(*MPart, OS);
+    });
+
+    std::vector<std::string> Parts;
+    if (!createPartFiles(Filename, Bitcodes.size(), Parts))
+        return false;
+
+    std::vector<char> Ok(Bitcodes.size());
+    std::vector<std::thread> Workers;
+    for (unsigned i = 0; i < Bitcodes.size(); ++i)
+        Workers.emplace_back([&, i] {
+            StringRef Bitcode(Bitcodes[i].data(), Bitcodes[i].size());
+            Ok[i] = emitPartObject(Bitcode, Parts[i]);
+        });
+    for (auto &W : Workers)
+        W.join();
+    if (std::count(Ok.begin(), Ok.end(), 0)) {
+        removePartFiles(Parts);
+        return false;
+    }
+    return linkRelocatable(Filename, Parts);
+}
@@ -4,16 +4,53 @@
 // MCコンパイラの根幹であるクラスで、ParserだけではなくCodeGenでも使われているので
 // 非常に重要。イメージとしては、Lexerによって次のトークンを取ってきて、それが例えば
 // 数値リテラルであったらNumberASTに値を格納し、そのポインタを親ノードが保持する。
-// 全てのコードを無事にASTとして表現できたら、後述するcodegenを再帰的に呼び出す事に
+// 全てのコードを無事にASTとして表現できたら、後述するcodegenでASTを辿る事に
 // よりオブジェクトファイルを生成する。
+//
+// ASTのノードは一つずつmallocする代わりにASTArenaから確保し、トップレベルの定義一つ分の
+// codegenが終わったらまとめて解放する。そのためノードは解放時にデストラクタを呼ぶ必要が
+// 無いように、名前はソースを指すStringRef、子ノードは生ポインタで持つ。
+// 変数はパーサーが関数ごとに振った番号(スロット)で、呼び出す関数はシンボル番号で持つ。
 //===----------------------------------------------------------------------===//
 
+// ASTArena - ASTのノードを確保するbump pointerアロケータ
+static thread_local BumpPtrAllocator ASTArena;
+
+template <typename T, typename... ArgTs> static T *newAST(ArgTs &&... Args) {
+    ++Stats.ASTNodes;
+    return new (ASTArena.Allocate<T>()) T(std::forward<ArgTs>(Args)...);
+}
+
+// copyToArena - 引数のリスト等をアリーナにコピーする
+template <typename T> static ArrayRef<T> copyToArena(ArrayRef<T> Elts) {
+    T *Mem = ASTArena.Allocate<T>(Elts.size());
+    std::uninitialized_copy(Elts.begin(), Elts.end(), Mem);
+    return ArrayRef<T>(Mem, Elts.size());
+}
+
+// vm.hでバイトコードを生成する際の状態
+struct BytecodeBuilder;
+// codegen.hでIRを生成する際の作業スタック
+template <typename NodeT> class CodegenWalker;
+
 namespace {
+    // top level expressionの関数のように、ソースに名前が無いもののシンボル番号
+    const unsigned NoSymbol = ~0u;
+
     // ExprAST - `5+2`や`2*10-2`等のexpressionを表すクラス
     class ExprAST {
         public:
             virtual ~ExprAST() = default;
-            virtual Value *codegen() = 0;
+            // codegen - この式のIRを作る。子の式はCodegenWalkerの作業スタックに積んで処理する。
+            Value *codegen();
+            // codegenStep - codegenのStage番目の段階を行う。
+            virtual void codegenStep(CodegenWalker<ExprAST *> &W, unsigned Stage) = 0;
+            virtual int bytecodegen(BytecodeBuilder &B) = 0;
+            // getConstant(Val) - 数値リテラルならその値をValに入れてtrueを返す。
+            virtual bool getConstant(uint64_t &) const { return false; }
+            // getAssignTarget(Slot, Index) - 代入できる式(変数か配列の要素)なら、変数のスロットをSlotに、
+            // 配列の要素なら添字の式をIndexに(変数ならnullptrを)入れてtrueを返す。
+            virtual bool getAssignTarget(int &, ExprAST *&) { return false; }
     };
 
     // NumberAST - `5`や`2`等の数値リテラルを表すクラス
@@ -23,358 +60,772 @@ namespace {
 
         public:
         NumberAST(uint64_t Val) : Val(Val) {}
-        Value *codegen() override;
+        void codegenStep(CodegenWalker<ExprAST *> &W, unsigned Stage) override;
+        int bytecodegen(BytecodeBuilder &B) override;
+        bool getConstant(uint64_t &V) const override {
+            V = Val;
+            return true;
+        }
     };
 
     // BinaryAST - `+`や`*`等の二項演算子を表すクラス
     class BinaryAST : public ExprAST {
         char Op;
-        std::unique_ptr<ExprAST> LHS, RHS;
+        ExprAST *LHS, *RHS;
 
         public:
-        BinaryAST(char Op, std::unique_ptr<ExprAST> LHS,
-                std::unique_ptr<ExprAST> RHS)
-            : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+        BinaryAST(char Op, ExprAST *LHS, ExprAST *RHS)
+            : Op(Op), LHS(LHS), RHS(RHS) {}
 
-        Value *codegen() override;
+        void codegenStep(CodegenWalker<ExprAST *> &W, unsigned Stage) override;
+        int bytecodegen(BytecodeBuilder &B) override;
     };
 
-    // VariableExprAST - 変数の名前を表すクラス
+    // VariableExprAST - 変数の参照を表すクラス。Slotは変数のスロットで、未定義の変数なら-1。
     class VariableExprAST : public ExprAST {
-        std::string variableName;
+        int Slot;
 
         public:
-        VariableExprAST(const std::string &variableName) : variableName(variableName) {}
-        Value *codegen() override;
+        VariableExprAST(int Slot) : Slot(Slot) {}
+        void codegenStep(CodegenWalker<ExprAST *> &W, unsigned Stage) override;
+        int bytecodegen(BytecodeBuilder &B) override;
+        bool getAssignTarget(int &S, ExprAST *&Index) override {
+            S = Slot;
+            Index = nullptr;
+            return true;
+        }
     };
 
-    // CallExprAST - 関数呼び出しを表すクラス
+    // CallExprAST - 関数呼び出しを表すクラス。calleeは呼び出す関数のシンボル番号。
     class CallExprAST : public ExprAST {
-        std::string callee;
-        std::vector<std::unique_ptr<ExprAST>> args;
+        unsigned callee;
+        ArrayRef<ExprAST *> args;
 
         public:
-        CallExprAST(const std::string &callee,
-                std::vector<std::unique_ptr<ExprAST>> args)
-            : callee(callee), args(std::move(args)) {}
+        CallExprAST(unsigned callee, ArrayRef<ExprAST *> args)
+            : callee(callee), args(args) {}
 
-        Value *codegen() override;
+        void codegenStep(CodegenWalker<ExprAST *> &W, unsigned Stage) override;
+        int bytecodegen(BytecodeBuilder &B) override;
+    };
+
+    // IndexExprAST - `a[i]`。配列の引数aのi番目の要素を表すクラス。Slotはaのスロット。
+    class IndexExprAST : public ExprAST {
+        int Slot;
+        ExprAST *Index;
+
+        public:
+        IndexExprAST(int Slot, ExprAST *Index) : Slot(Slot), Index(Index) {}
+        void codegenStep(CodegenWalker<ExprAST *> &W, unsigned Stage) override;
+        int bytecodegen(BytecodeBuilder &B) override;
+        bool getAssignTarget(int &S, ExprAST *&I) override {
+            S = Slot;
+            I = Index;
+            return true;
+        }
     };
 
     // PrototypeAST - 関数シグネチャーのクラスで、関数の名前と引数の名前を表すクラス
+    // `a[]`と書いた引数は配列で、LLVM IRではi64*の先頭のポインタとi64の長さの二つの引数になる。
+    // i番目の引数のスロットはi。
     class PrototypeAST {
-        std::string Name;
-        std::vector<std::string> args;
+        StringRef Name;
+        // 関数名のシンボル番号。top level expressionならNoSymbol。
+        unsigned Sym;
+        ArrayRef<StringRef> args;
+        // args[i]が配列ならtrue
+        ArrayRef<bool> arrayArgs;
 
         public:
-        PrototypeAST(const std::string &Name, std::vector<std::string> args)
-            : Name(Name), args(std::move(args)) {}
+        PrototypeAST(StringRef Name, unsigned Sym, ArrayRef<StringRef> args,
+                ArrayRef<bool> arrayArgs)
+            : Name(Name), Sym(Sym), args(args), arrayArgs(arrayArgs) {}
 
         Function *codegen();
-        const std::string &getFunctionName() const { return Name; }
+        StringRef getFunctionName() const { return Name; }
+        unsigned getSymbol() const { return Sym; }
+        ArrayRef<StringRef> getArgs() const { return args; }
+        bool isArrayArg(unsigned i) const { return arrayArgs[i]; }
+        bool hasArrayArgs() const { return is_contained(arrayArgs, true); }
     };
 
     // FunctionAST - 関数シグネチャー(PrototypeAST)に加えて関数のbody(C++で言うint foo) {...}の中身)を
     // 表すクラスです。
     class FunctionAST {
-        std::unique_ptr<PrototypeAST> proto;
-        std::unique_ptr<ExprAST> body;
+        PrototypeAST *proto;
+        ExprAST *body;
+        // スロットごとの変数名。スロットの数はこの関数の引数と変数の束縛の数。
+        ArrayRef<StringRef> slotNames;
 
         public:
-        FunctionAST(std::unique_ptr<PrototypeAST> proto,
-                std::unique_ptr<ExprAST> body)
-            : proto(std::move(proto)), body(std::move(body)) {}
+        FunctionAST(PrototypeAST *proto, ExprAST *body, ArrayRef<StringRef> slotNames)
+            : proto(proto), body(body), slotNames(slotNames) {}
 
         Function *codegen();
+        int bytecodegen(BytecodeBuilder &B);
+        PrototypeAST *getProto() const { return proto; }
     };
 
     class IfExprAST : public ExprAST {
-        std::unique_ptr<ExprAST> Cond, Then, Else;
+        ExprAST *Cond, *Then, *Else;
+
+        public:
+        IfExprAST(ExprAST *Cond, ExprAST *Then, ExprAST *Else)
+            : Cond(Cond), Then(Then), Else(Else) {}
+
+        void codegenStep(CodegenWalker<ExprAST *> &W, unsigned Stage) override;
+        int bytecodegen(BytecodeBuilder &B) override;
+    };
+
+    // VarExprAST - `var x = 1, y = 2 in body`。bodyの中でだけ使えるローカル変数を作る。
+    // 初期値を省略した変数は0になる。式の値はbodyの値。Varsは(変数のスロット, 初期値)の列。
+    class VarExprAST : public ExprAST {
+        ArrayRef<std::pair<int, ExprAST *>> Vars;
+        ExprAST *Body;
 
         public:
-        IfExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Then,
-                std::unique_ptr<ExprAST> Else)
-            : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
+        VarExprAST(ArrayRef<std::pair<int, ExprAST *>> Vars, ExprAST *Body)
+            : Vars(Vars), Body(Body) {}
 
-        Value *codegen() override;
+        void codegenStep(CodegenWalker<ExprAST *> &W, unsigned Stage) override;
+        int bytecodegen(BytecodeBuilder &B) override;
+    };
+
+    // AssignExprAST - `x = expr`か`a[i] = expr`。変数(引数かローカル変数)か配列の要素に
+    // 代入し、代入した値を返す。Indexは配列の要素に代入する場合の添字で、変数ならnullptr。
+    class AssignExprAST : public ExprAST {
+        int Slot;
+        ExprAST *Index, *Val;
+
+        public:
+        AssignExprAST(int Slot, ExprAST *Index, ExprAST *Val)
+            : Slot(Slot), Index(Index), Val(Val) {}
+
+        void codegenStep(CodegenWalker<ExprAST *> &W, unsigned Stage) override;
+        int bytecodegen(BytecodeBuilder &B) override;
+    };
+
+    // ForExprAST - `for i = start, cond, step in body`。iをstartで初期化し、condが0でない間
+    // bodyを実行してiにstepを足すことを繰り返す。stepを省略すると1。式の値は常に0。
+    class ForExprAST : public ExprAST {
+        // iのスロット
+        int Slot;
+        ExprAST *Start, *Cond, *Step, *Body;
+
+        public:
+        ForExprAST(int Slot, ExprAST *Start, ExprAST *Cond, ExprAST *Step, ExprAST *Body)
+            : Slot(Slot), Start(Start), Cond(Cond), Step(Step), Body(Body) {}
+
+        void codegenStep(CodegenWalker<ExprAST *> &W, unsigned Stage) override;
+        int bytecodegen(BytecodeBuilder &B) override;
+    };
+
+    // WhileExprAST - `while cond do body`。condが0でない間bodyを繰り返す。式の値は常に0。
+    class WhileExprAST : public ExprAST {
+        ExprAST *Cond, *Body;
+
+        public:
+        WhileExprAST(ExprAST *Cond, ExprAST *Body) : Cond(Cond), Body(Body) {}
+
+        void codegenStep(CodegenWalker<ExprAST *> &W, unsigned Stage) override;
+        int bytecodegen(BytecodeBuilder &B) override;
     };
 } // end anonymous namespace
 
+// QuietErrors - trueの間はLogErrorでエラーを表示しない。パイプライン(pipeline.h)で、
+// codegenするワーカーと同じエラーをコンパイル時の評価の準備で二度表示しないようにする。
+static thread_local bool QuietErrors = false;
+
+// LogError - エラーを表示しnullptrを返してくれるエラーハンドリング関数
+std::nullptr_t LogError(const char *Str) {
+    if (!QuietErrors)
+        fprintf(stderr, "Error: %s\n", Str);
+    return nullptr;
+}
+
+//===----------------------------------------------------------------------===//
+// Constant Folding
+// Builderはノードを作る時に、オペランドが全て数値リテラルなら計算した結果の
+// 数値リテラルを代わりに返す。条件が定数のifは選ばれる方の式になる。
+// 引数が全て数値リテラルの呼び出しは、consteval.hのevalConstCallでコンパイル時に評価する。
+//===----------------------------------------------------------------------===//
+
+// foldBinary - L Op Rをcodegenと同じ結果で計算する。
+// 足し算等は2の補数で折り返し、'<'はsextしたi1と同じく-1か0になる。
+static bool foldBinary(char Op, uint64_t L, uint64_t R, uint64_t &Result) {
+    switch (Op) {
+        case '+':
+            Result = L + R;
+            return true;
+        case '-':
+            Result = L - R;
+            return true;
+        case '*':
+            Result = L * R;
+            return true;
+        case '<':
+            Result = int64_t(L) < int64_t(R) ? -1 : 0;
+            return true;
+        case ':':
+            Result = R;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// evalConstCall - Calleeを引数Argsでコンパイル時に評価する。consteval.hで定義している。
+static bool evalConstCall(StringRef Callee, ArrayRef<uint64_t> Args, uint64_t &Result);
+
+// foldCall - Argsが全てBの数値リテラルなら、シンボルCalleeの関数の呼び出しを評価する。
+template <typename BuilderT>
+static bool foldCall(BuilderT &B, unsigned Callee, ArrayRef<typename BuilderT::Expr> Args,
+        uint64_t &Result) {
+    SmallVector<uint64_t, 4> Vals(Args.size());
+    for (size_t i = 0; i < Args.size(); ++i)
+        if (!B.getConstant(Args[i], Vals[i]))
+            return false;
+    return evalConstCall(lexer.getSymbolName(Callee), Vals, Result);
+}
+
+// ClassASTBuilder - パーサーが呼ぶASTの生成関数をまとめたもの。
+// パーサーはBuilderを引数に取るテンプレートになっていて、ClassASTBuilderを渡すと
+// 上のクラス階層のASTを、flatast.hのFlatASTBuilderを渡すと配列で表したASTを直接作る。
+struct ClassASTBuilder {
+    typedef ExprAST *Expr;
+    typedef FunctionAST *Function;
+
+    Expr number(uint64_t Val) { return newAST<NumberAST>(Val); }
+    Expr variable(int Slot) { return newAST<VariableExprAST>(Slot); }
+    Expr index(int Slot, Expr Index) { return newAST<IndexExprAST>(Slot, Index); }
+    Expr binary(char Op, Expr LHS, Expr RHS) {
+        uint64_t L, R, V;
+        if (LHS->getConstant(L) && RHS->getConstant(R) && foldBinary(Op, L, R, V))
+            return number(V);
+        return newAST<BinaryAST>(Op, LHS, RHS);
+    }
+    Expr call(unsigned Callee, ArrayRef<Expr> Args) {
+        uint64_t V;
+        if (foldCall(*this, Callee, Args, V))
+            return number(V);
+        return newAST<CallExprAST>(Callee, copyToArena(Args));
+    }
+    Expr ifExpr(Expr Cond, Expr Then, Expr Else) {
+        uint64_t C;
+        if (Cond->getConstant(C))
+            return C ? Then : Else;
+        return newAST<IfExprAST>(Cond, Then, Else);
+    }
+    Expr assign(Expr Dest, Expr Val) {
+        int Slot;
+        ExprAST *Index;
+        if (!Dest->getAssignTarget(Slot, Index))
+            return LogError("destination of '=' must be a variable or an array element");
+        return newAST<AssignExprAST>(Slot, Index, Val);
+    }
+    Expr varExpr(ArrayRef<std::pair<int, Expr>> Vars, Expr Body) {
+        return newAST<VarExprAST>(copyToArena(Vars), Body);
+    }
+    Expr forExpr(int Slot, Expr Start, Expr Cond, Expr Step, Expr Body) {
+        return newAST<ForExprAST>(Slot, Start, Cond, Step, Body);
+    }
+    Expr whileExpr(Expr Cond, Expr Body) { return newAST<WhileExprAST>(Cond, Body); }
+    bool getConstant(Expr E, uint64_t &Val) { return E->getConstant(Val); }
+    Function function(PrototypeAST *Proto, Expr Body, ArrayRef<StringRef> SlotNames) {
+        return newAST<FunctionAST>(Proto, Body, copyToArena(SlotNames));
+    }
+};
+
+static ClassASTBuilder ClassBuilder;
+
 //===----------------------------------------------------------------------===//
 // Parser
-// Parserでは、ParseTopLevelExprから始まり、お互いを再帰的に呼び出すことでAST Tree(構文解析木)
-// を構成していく。
+// Parserでは、ParseTopLevelExprとParseDefinitionから始まり、ParseExpressionが明示的な
+// 作業スタックを使ってAST Tree(構文解析木)を構成していく。
 //===----------------------------------------------------------------------===//
 
 // CurTokは現在のトークン(tok_number, tok_eof, または')'や'+'などの場合そのascii)が
 // 格納されている。
 // getNextTokenにより次のトークンを読み、Curtokを更新する。
-static int CurTok;
-static int getNextToken() { return CurTok = lexer.gettok(); }
-
-// 二項演算子の結合子をmc.cppで定義している。
-static std::map<char, int> BinopPrecedence;
+// トークンはmc.cppでlexer.tokenize()によって予め配列になっている。
+static thread_local int CurTok;
+static int getNextToken() { return CurTok = lexer.next(); }
+
+// 二項演算子の結合子をinitBinopPrecedenceで定義している。
+// トークンの文字で直接引けるように256要素の表にしていて、二項演算子でなければ0。
+static thread_local int BinopPrecedence[256];
+
+// initBinopPrecedence - 二項演算子の定義
+// 数字が低いほど結合度が低い
+static void initBinopPrecedence() {
+    // TODO 3.1: '<'を実装してみよう
+    // BinopPrecedenceに'<'を登録して下さい。
+    // ':'は左の式を評価してから右の式を評価し、右の値を返す。'='は代入。
+    BinopPrecedence[':'] = 1;
+    BinopPrecedence['='] = 2;
+    BinopPrecedence['<'] = 10;
+    BinopPrecedence['+'] = 20;
+    BinopPrecedence['-'] = 20;
+    BinopPrecedence['*'] = 40;
+}
 
 // GetTokPrecedence - 二項演算子の結合度を取得
 // もし現在のトークンが二項演算子ならその結合度を返し、そうでないなら-1を返す。
 static int GetTokPrecedence() {
-    if (!isascii(CurTok))
+    // 予約語等のトークンは負の値
+    if (CurTok < 0)
         return -1;
 
-    int tokprec = BinopPrecedence[CurTok];
+    int tokprec = BinopPrecedence[(unsigned char)CurTok];
     if (tokprec <= 0)
         return -1;
     return tokprec;
 }
 
-// LogError - エラーを表示しnullptrを返してくれるエラーハンドリング関数
-std::unique_ptr<ExprAST> LogError(const char *Str) {
+PrototypeAST *LogErrorP(const char *Str) {
     fprintf(stderr, "Error: %s\n", Str);
     return nullptr;
 }
 
-std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
-    fprintf(stderr, "Error: %s\n", Str);
-    return nullptr;
+// 変数のスコープ
+// 引数とvar/forで作る変数には、関数ごとに0から順に番号(スロット)を振り、ASTには名前の代わりに
+// スロットを入れる。同じ名前でも束縛ごとに別のスロットになるので、codegenやVMはスロットで
+// 引いた配列に値を置くだけで良く、スコープを抜ける時に束縛を戻す必要も無い。
+// SymbolSlots[Sym]は今見えているシンボルSymの変数のスロットで、見えていなければ-1。
+static thread_local std::vector<int> SymbolSlots;
+// ScopeUndo - bindSlotで上書きした(シンボル, それまでのスロット)。スコープを抜ける時に戻す。
+static thread_local std::vector<std::pair<unsigned, int>> ScopeUndo;
+// 今パースしている関数のスロットごとの変数名
+static thread_local SmallVector<StringRef, 8> SlotNames;
+
+// bindSlot - シンボルSymの変数に新しいスロットを割り当て、スコープを抜けるまで見えるようにする。
+static int bindSlot(unsigned Sym) {
+    if (Sym >= SymbolSlots.size())
+        SymbolSlots.resize(lexer.getNumSymbols(), -1);
+    ScopeUndo.push_back({Sym, SymbolSlots[Sym]});
+    SymbolSlots[Sym] = SlotNames.size();
+    SlotNames.push_back(lexer.getSymbolName(Sym));
+    return SymbolSlots[Sym];
 }
 
-// Forward declaration
-static std::unique_ptr<ExprAST> ParseExpression();
-
-// 数値リテラルをパースする関数。
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
-    // NumberASTのValにlexerからnumValを読んできて、セットする。
-    auto Result = std::make_unique<NumberAST>(lexer.getNumVal());
-    getNextToken(); // トークンを一個進めて、returnする。
-    return std::move(Result);
+static int lookupSlot(unsigned Sym) {
+    return Sym < SymbolSlots.size() ? SymbolSlots[Sym] : -1;
 }
 
-// TODO 1.5: 括弧を実装してみよう
-// 括弧は`'(' ExprAST ')'`の形で表されます。最初の'('を読んだ後、次のトークンは
-// ExprAST(NumberAST or BinaryAST)のはずなのでそれをパースし、最後に')'で有ることを
-// 確認します。
-static std::unique_ptr<ExprAST> ParseParenExpr() {
-    // 1. ParseParenExprが呼ばれた時、CurTokは'('のはずなので、括弧の中身を得るために
-    //    トークンを進めます。e.g. getNextToken()
-    // 2. 現在のトークンはExprASTのはずなので、ParseExpression()を呼んでパースします。
-    //    もし返り値がnullptrならエラーなのでParseParenExprでもnullptrを返します。
-    // 3. 2で呼んだParseExpressionではトークンが一つ進められて帰ってきているはずなので、
-    // 　 CurTokが')'かどうかチェックします。もし')'でなければ、LogErrorを用いてエラーを出して下さい。
-    // 4. getNextToken()を呼んでトークンを一つ進め、2で呼んだParseExpressionの返り値を返します。
-    //
-    // 課題を解く時はこの行を消してここに実装して下さい。
-    getNextToken(); // eat (.
-    auto V = ParseExpression();
-    if (!V)
-        return nullptr;
-
-    if (CurTok != ')')
-        return LogError("expected ')'");
-    getNextToken(); // eat ).
-    return V;
+// unbindSlots - ScopeUndoがMark個になるまで束縛を戻す。0なら関数の全ての束縛を戻す。
+static void unbindSlots(size_t Mark) {
+    while (ScopeUndo.size() > Mark) {
+        SymbolSlots[ScopeUndo.back().first] = ScopeUndo.back().second;
+        ScopeUndo.pop_back();
+    }
 }
 
-// TODO 2.2: 識別子をパースしよう
-// トークンが識別子の場合は、引数(変数)の参照か関数の呼び出しの為、
-// 引数の参照である場合はVariableExprASTを返し、関数呼び出しの場合は
-// CallExprASTを返す。
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-    // 1. getIdentifierを用いて識別子を取得する。
-    std::string IdName = lexer.getIdentifier();
-
-    // 2. トークンを次に進める。
-    getNextToken();
-
-    // 3. 次のトークンが'('の場合は関数呼び出し。そうでない場合は、
-    // VariableExprASTを識別子を入れてインスタンス化し返す。
-    if (CurTok != '(')
-        return std::make_unique<VariableExprAST>(IdName);
-
-    // 4. '('を読んでトークンを次に進める。
-    getNextToken();
-
-    // 5. 関数fooの呼び出しfoo(3,4,5)の()内をパースする。
-    // 引数は数値、二項演算子、(親関数で定義された)引数である可能性があるので、
-    // ParseExpressionを用いる。
-    // 呼び出しが終わるまで(CurTok == ')'になるまで)引数をパースしていき、都度argsにpush_backする。
-    // 呼び出しの終わりと引数同士の区切りはCurTokが')'であるか','であるかで判別できることに注意。
-    std::vector<std::unique_ptr<ExprAST>> args;
-    if (CurTok != ')') {
+// ParsedExprDepth - 直前にParseExpressionでパースした式のASTの深さ(の上限)。
+// vm.hのbytecodegenは再帰で書かれているので、深過ぎる式はバイトコードにしない。
+static thread_local unsigned ParsedExprDepth;
+
+// ParseFrame - ParseExpressionの作業スタックの一要素。
+// 式の途中で別の式をパースする必要がある構文(二項演算子の右辺、括弧の中、ifの各部分等)では、
+// 関数を再帰的に呼ぶ代わりにフレームを積み、中の式をパースし終わったらそのフレームの続きから
+// 再開する。ExprStartは中の式の始まりの印で、式の終わりに来たらそこまでのBinOpを全て還元する。
+template <typename ExprT> struct ParseFrame {
+    enum FrameKind : uint8_t { ExprStart, BinOp, Paren, Index, Call, If, Var, For, While };
+    FrameKind Kind;
+    // If, Var, Forで今どの部分をパースしているか
+    uint8_t Stage = 0;
+    // BinOpの演算子と結合度
+    char Op = 0;
+    int Prec = 0;
+    // 呼び出す関数、varの変数、forの変数のシンボル
+    unsigned Sym = 0;
+    // 添字の配列、forの変数のスロット
+    int Slot = -1;
+    // Var, Forのスコープが始まった時のScopeUndoの大きさ
+    size_t Scope = 0;
+    // BinOpの左辺、ifのCond, Then、forのStart, Cond, Step
+    ExprT E[3] = {nullptr, nullptr, nullptr};
+    // Callの引数とVarの変数が、ParseExpressionのArgsとVarsのどこから始まるか
+    unsigned Begin = 0;
+    // ここまでにパースした子の式の深さの最大値
+    unsigned Depth = 0;
+
+    explicit ParseFrame(FrameKind Kind) : Kind(Kind) {}
+};
+
+// ParseExpression - 式をパースする。数値、変数、呼び出し、括弧、if/var/for/whileを
+// 二項演算子で繋いだもの。
+// 二項演算子は結合度による演算子順位法(Pratt parser)でパースする。オペランドを読んだら、
+// 次の演算子の結合度以上の演算子が左に残っていればそれを先に還元し、次の演算子を積む。
+// 例えば「4+2*3」では'*'の方が強いので'+'は残したまま'2*3'を先に作り、「4*2+3」では
+// '+'を積む前に'4*2'を作る。'='は右結合なので、`a = b = 1`は`a = (b = 1)`になるように
+// 同じ結合度の'='は還元しない。
+// 全ての構文をFramesの上で扱い、C++のスタックを使わないので、式の深さはメモリの許す限り
+// いくらでも良く、時間もトークン数に比例する。
+template <typename BuilderT>
+static typename BuilderT::Expr ParseExpression(BuilderT &B) {
+    typedef typename BuilderT::Expr Expr;
+    typedef ParseFrame<Expr> Frame;
+    SmallVector<Frame, 16> Frames;
+    // パース中の呼び出しの引数と、varの変数。それぞれのフレームのBegin以降がそのフレームのもの。
+    SmallVector<Expr, 8> Args;
+    SmallVector<std::pair<int, Expr>, 4> Vars;
+
+    // parseVarList - varの変数のリストを、初期値の式かbodyの手前まで読む。
+    // AfterInitなら初期値の式を読み終えたところから続ける。
+    // 変数は初期値の後に束縛するので、`var x = x in ...`の右のxは外側のx。
+    auto parseVarList = [&](bool AfterInit) -> bool {
+        Frame &F = Frames.back();
         while (true) {
-            if (auto Arg = ParseExpression())
-                args.push_back(std::move(Arg));
-            else
-                return nullptr;
-
-            if (CurTok == ')')
-                break;
+            if (!AfterInit) {
+                F.Sym = lexer.getSymbol();
+                getNextToken();
+                if (CurTok == '=') {
+                    // 初期値の式を読んでから続ける
+                    getNextToken();
+                    F.Stage = 0;
+                    return true;
+                }
+                // 初期値を省略したら0
+                Vars.push_back({bindSlot(F.Sym), B.number(0)});
+            }
+            AfterInit = false;
 
             if (CurTok != ',')
-                return LogError("Expected ')' or ',' in argument list");
+                break;
             getNextToken();
+            if (CurTok != tok_identifier) {
+                LogError("expected identifier list after var");
+                return false;
+            }
+        }
+        if (CurTok != tok_in) {
+            LogError("expected 'in' keyword after 'var'");
+            return false;
         }
-    }
-
-    // 6. トークンを次に進める。
-    getNextToken();
-
-    // 7. CallExprASTを構成し、返す。
-    return std::make_unique<CallExprAST>(IdName, std::move(args));
-}
-
-static std::unique_ptr<ExprAST> ParseIfExpr() {
-    // TODO 3.3: If文のパーシングを実装してみよう。
-    // 1. ParseIfExprに来るということは現在のトークンが"if"なので、
-    // トークンを次に進めます。
-    getNextToken();
-
-    // 2. ifの次はbranching conditionを表すexpressionがある筈なので、
-    // ParseExpressionを呼んでconditionをパースします。
-    auto Cond = ParseExpression();
-    if (!Cond)
-        return nullptr;
-
-    // 3. "if x < 4 then .."のような文の場合、今のトークンは"then"である筈なので
-    // それをチェックし、トークンを次に進めます。
-    if (CurTok != tok_then) {
-        std::cout << lexer.getIdentifier() << std::endl;;
-        return LogError("expected then");
-    }
-    getNextToken();
-
-    // 4. "then"ブロックのexpressionをParseExpressionを呼んでパースします。
-    auto Then = ParseExpression();
-    if (!Then)
-        return nullptr;
-
-    // 5. 3と同様、今のトークンは"else"である筈なのでチェックし、トークンを次に進めます。
-    if (CurTok != tok_else)
-        return LogError("expected else");
-    getNextToken();
-
-    // 6. "else"ブロックのexpressionをParseExpressionを呼んでパースします。
-    auto Else = ParseExpression();
-    if (!Else)
-        return nullptr;
-
-    // 7. IfExprASTを作り、returnします。
-    return std::make_unique<IfExprAST>(std::move(Cond), std::move(Then),
-            std::move(Else));
-}
-
-// ParsePrimary - NumberASTか括弧をパースする関数
-static std::unique_ptr<ExprAST> ParsePrimary() {
-    switch (CurTok) {
-        default:
-            return LogError("unknown token when expecting an expression");
-        case tok_identifier:
-            return ParseIdentifierExpr();
-        case tok_number:
-            return ParseNumberExpr();
-        case '(':
-            return ParseParenExpr();
-        case tok_if:
-            return ParseIfExpr();
-    }
-}
-
-// TODO 1.6: 二項演算のパーシングを実装してみよう
-// このパーサーの中で一番重要と言っても良い、二項演算子のパーシングを実装します。
-// LHSに二項演算子の左側が入った状態で呼び出され、LHSとRHSと二項演算子がペアになった
-// 状態で返ります。
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int CallerPrec,
-        std::unique_ptr<ExprAST> LHS) {
-    while (true) {
-        // 1. 現在の二項演算子の結合度を取得する。 e.g. int tokprec = GetTokPrecedence();
-        int tokprec = GetTokPrecedence();
-
-        // 2. もし呼び出し元の演算子(CallerPrec)よりも結合度が低ければ、ここでは演算をせずにLHSを返す。
-        // 例えば、「4*2+3」ではここで'2'が返るはずで、「4+2*3」ではここでは返らずに処理が進み、
-        // '2*3'がパースされた後に返る。
-        if (tokprec < CallerPrec)
-            return LHS;
-
-        // 3. 二項演算子をセットする。e.g. int BinOp = CurTok;
-        int BinOp = CurTok;
-
-        // 4. 次のトークン(二項演算子の右のexpression)に進む。
         getNextToken();
+        F.Stage = 1;
+        return true;
+    };
 
-        // 5. 二項演算子の右のexpressionをパースする。 e.g. auto RHS = ParsePrimary();
-        auto RHS = ParsePrimary();
-        if (!RHS)
-            return nullptr;
-
-        // GetTokPrecedence()を呼んで、もし次のトークンも二項演算子だった場合を考える。
-        // もし次の二項演算子の結合度が今の演算子の結合度よりも強かった場合、ParseBinOpRHSを再帰的に
-        // 呼んで先に次の二項演算子をパースする。
-        int NextPrec = GetTokPrecedence();
-        if (tokprec < NextPrec) {
-            RHS = ParseBinOpRHS(tokprec + 1, std::move(RHS));
-            if (!RHS)
-                return nullptr;
+    Frames.push_back(Frame(Frame::ExprStart));
+    Expr V = nullptr;
+    unsigned Depth = 0;
+    while (true) {
+        // 1. オペランドを一つ読む。中に式を含む構文なら、フレームとExprStartを積んで
+        //    中の式の最初のオペランドから読み直す。
+        switch (CurTok) {
+            default:
+                return LogError("unknown token when expecting an expression");
+            case tok_number:
+                // 数値リテラル。lexerからnumValを読んできて、トークンを一個進める。
+                V = B.number(lexer.getNumVal());
+                Depth = 1;
+                getNextToken();
+                break;
+            case tok_identifier: {
+                // TODO 2.2: 識別子は変数の参照か、'('が続けば関数呼び出し、'['が続けば配列の要素。
+                // 変数はここで今見えている束縛のスロットにする。
+                unsigned Sym = lexer.getSymbol();
+                getNextToken();
+                if (CurTok == '[') {
+                    getNextToken();
+                    Frames.push_back(Frame(Frame::Index));
+                    Frames.back().Slot = lookupSlot(Sym);
+                    Frames.push_back(Frame(Frame::ExprStart));
+                    continue;
+                }
+                if (CurTok != '(') {
+                    V = B.variable(lookupSlot(Sym));
+                    Depth = 1;
+                    break;
+                }
+                // 呼び出しの終わりと引数同士の区切りは、CurTokが')'か','かで判別する。
+                getNextToken();
+                if (CurTok == ')') {
+                    getNextToken();
+                    V = B.call(Sym, {});
+                    Depth = 1;
+                    break;
+                }
+                Frames.push_back(Frame(Frame::Call));
+                Frames.back().Sym = Sym;
+                Frames.back().Begin = Args.size();
+                Frames.push_back(Frame(Frame::ExprStart));
+                continue;
+            }
+            case '(':
+                // TODO 1.5: 括弧は`'(' Expr ')'`。中の式を読み終えたら')'を確かめる。
+                getNextToken();
+                Frames.push_back(Frame(Frame::Paren));
+                Frames.push_back(Frame(Frame::ExprStart));
+                continue;
+            case tok_if:
+                // TODO 3.3: `if Cond then Then else Else`
+                getNextToken();
+                Frames.push_back(Frame(Frame::If));
+                Frames.push_back(Frame(Frame::ExprStart));
+                continue;
+            case tok_var:
+                // `var x = 1, y in body`
+                getNextToken();
+                if (CurTok != tok_identifier)
+                    return LogError("expected identifier after var");
+                Frames.push_back(Frame(Frame::Var));
+                Frames.back().Begin = Vars.size();
+                Frames.back().Scope = ScopeUndo.size();
+                if (!parseVarList(false))
+                    return nullptr;
+                Frames.push_back(Frame(Frame::ExprStart));
+                continue;
+            case tok_for:
+                // `for i = start, cond, step in body`。stepは省略できる。
+                getNextToken();
+                if (CurTok != tok_identifier)
+                    return LogError("expected identifier after for");
+                Frames.push_back(Frame(Frame::For));
+                Frames.back().Sym = lexer.getSymbol();
+                Frames.back().Scope = ScopeUndo.size();
+                getNextToken();
+                if (CurTok != '=')
+                    return LogError("expected '=' after for");
+                getNextToken();
+                Frames.push_back(Frame(Frame::ExprStart));
+                continue;
+            case tok_while:
+                // `while cond do body`
+                getNextToken();
+                Frames.push_back(Frame(Frame::While));
+                Frames.push_back(Frame(Frame::ExprStart));
+                continue;
         }
 
-        // LHS, RHSをBinaryASTにしてLHSに代入する。
-        LHS = std::make_unique<BinaryAST>(BinOp, std::move(LHS), std::move(RHS));
+        // 2. オペランドVの後ろを読む。
+        while (true) {
+            // TODO 1.6: 二項演算子のパーシング
+            // 次の演算子の結合度Precより強い(同じ結合度なら左結合の)演算子が左に残っていれば、
+            // それをVと合わせて二項演算のASTにする。'='の場合は代入のASTにする。
+            int Prec = GetTokPrecedence();
+            while (Frames.back().Kind == Frame::BinOp &&
+                    (Frames.back().Prec > Prec ||
+                     (Frames.back().Prec == Prec && Frames.back().Op != '='))) {
+                Frame F = Frames.pop_back_val();
+                V = F.Op == '=' ? B.assign(F.E[0], V) : B.binary(F.Op, F.E[0], V);
+                if (!V)
+                    return nullptr;
+                Depth = std::max(F.Depth, Depth) + 1;
+            }
+
+            // 次が二項演算子なら、Vを左辺として積み、右辺のオペランドを読みに行く。
+            if (Prec > 0) {
+                Frames.push_back(Frame(Frame::BinOp));
+                Frames.back().Op = CurTok;
+                Frames.back().Prec = Prec;
+                Frames.back().E[0] = V;
+                Frames.back().Depth = Depth;
+                getNextToken();
+                break;
+            }
+
+            // 式の終わり。ExprStartを外し、この式を待っていたフレームを続ける。
+            Frames.pop_back();
+            if (Frames.empty()) {
+                ParsedExprDepth = Depth;
+                return V;
+            }
+            Frame &F = Frames.back();
+            F.Depth = std::max(F.Depth, Depth);
+
+            bool NeedExpr = true;
+            switch (F.Kind) {
+                case Frame::Paren:
+                    if (CurTok != ')')
+                        return LogError("expected ')'");
+                    getNextToken(); // eat ).
+                    NeedExpr = false;
+                    break;
+                case Frame::Index:
+                    if (CurTok != ']')
+                        return LogError("expected ']'");
+                    getNextToken();
+                    V = B.index(F.Slot, V);
+                    NeedExpr = false;
+                    break;
+                case Frame::Call:
+                    Args.push_back(V);
+                    if (CurTok == ')') {
+                        getNextToken();
+                        V = B.call(F.Sym, makeArrayRef(Args).drop_front(F.Begin));
+                        Args.truncate(F.Begin);
+                        NeedExpr = false;
+                    } else if (CurTok == ',') {
+                        getNextToken();
+                    } else {
+                        return LogError("Expected ')' or ',' in argument list");
+                    }
+                    break;
+                case Frame::If:
+                    if (F.Stage == 2) {
+                        V = B.ifExpr(F.E[0], F.E[1], V);
+                        NeedExpr = false;
+                        break;
+                    }
+                    F.E[F.Stage] = V;
+                    if (F.Stage == 0 && CurTok != tok_then) {
+                        std::cout << lexer.getIdentifier().str() << std::endl;;
+                        return LogError("expected then");
+                    }
+                    if (F.Stage == 1 && CurTok != tok_else)
+                        return LogError("expected else");
+                    getNextToken();
+                    ++F.Stage;
+                    break;
+                case Frame::Var:
+                    if (F.Stage == 1) {
+                        V = B.varExpr(makeArrayRef(Vars).drop_front(F.Begin), V);
+                        Vars.truncate(F.Begin);
+                        unbindSlots(F.Scope);
+                        NeedExpr = false;
+                        break;
+                    }
+                    // 初期値を読み終えた
+                    Vars.push_back({bindSlot(F.Sym), V});
+                    if (!parseVarList(true))
+                        return nullptr;
+                    break;
+                case Frame::For:
+                    // Stageは0: start, 1: cond, 2: step, 3: body
+                    if (F.Stage == 3) {
+                        V = B.forExpr(F.Slot, F.E[0], F.E[1], F.E[2], V);
+                        unbindSlots(F.Scope);
+                        NeedExpr = false;
+                        break;
+                    }
+                    F.E[F.Stage] = V;
+                    if (F.Stage == 0) {
+                        if (CurTok != ',')
+                            return LogError("expected ',' after for start value");
+                        getNextToken();
+                        // iはstartの後に束縛し、cond, step, bodyから見える。
+                        F.Slot = bindSlot(F.Sym);
+                        F.Stage = 1;
+                        break;
+                    }
+                    if (F.Stage == 1 && CurTok == ',') {
+                        getNextToken();
+                        F.Stage = 2;
+                        break;
+                    }
+                    if (CurTok != tok_in)
+                        return LogError("expected 'in' after for");
+                    getNextToken();
+                    F.Stage = 3;
+                    break;
+                case Frame::While:
+                    if (F.Stage == 1) {
+                        V = B.whileExpr(F.E[0], V);
+                        NeedExpr = false;
+                        break;
+                    }
+                    F.E[0] = V;
+                    if (CurTok != tok_do)
+                        return LogError("expected 'do' after while");
+                    getNextToken();
+                    F.Stage = 1;
+                    break;
+                default:
+                    llvm_unreachable("BinOp and ExprStart are never below ExprStart");
+            }
+
+            if (NeedExpr) {
+                // このフレームの次の部分の式を読む
+                Frames.push_back(Frame(Frame::ExprStart));
+                break;
+            }
+            // 構文が一つ終わり、Vになった。Vの後ろを続けて読む。括弧はノードを作らない。
+            Depth = F.Depth + (F.Kind != Frame::Paren);
+            Frames.pop_back();
+        }
     }
 }
 
 // TODO 2.3: 関数のシグネチャをパースしよう
-static std::unique_ptr<PrototypeAST> ParsePrototype() {
+// 引数は読んだ順にスロット0, 1, ...に束縛する。
+static PrototypeAST *ParsePrototype() {
     // 2.2とほぼ同じ。CallExprASTではなくPrototypeASTを返し、
     // 引数同士の区切りが','ではなくgetNextToken()を呼ぶと直ぐに
     // CurTokに次の引数(もしくは')')が入るという違いのみ。
     if (CurTok != tok_identifier)
         return LogErrorP("Expected function name in prototype");
 
-    std::string FnName = lexer.getIdentifier();;
+    StringRef FnName = lexer.getIdentifier();
+    unsigned FnSym = lexer.getSymbol();
     getNextToken();
 
     if (CurTok != '(')
         return LogErrorP("Expected '(' in prototype");
 
-    std::vector<std::string> ArgNames;
-    while (getNextToken() == tok_identifier) {
-        std::string curArg = lexer.getIdentifier();
+    SmallVector<StringRef, 8> ArgNames;
+    SmallVector<bool, 8> ArrayArgs;
+    getNextToken();
+    while (CurTok == tok_identifier) {
+        StringRef curArg = lexer.getIdentifier();
         ArgNames.push_back(curArg);
+        bindSlot(lexer.getSymbol());
+        // `a[]`なら配列の引数
+        bool IsArray = getNextToken() == '[';
+        if (IsArray) {
+            if (getNextToken() != ']')
+                return LogErrorP("Expected ']' in prototype");
+            getNextToken();
+        }
+        ArrayArgs.push_back(IsArray);
     }
     if (CurTok != ')')
         return LogErrorP("Expected ')' in prototype");
 
     getNextToken();
 
-    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames));
+    return newAST<PrototypeAST>(FnName, FnSym, copyToArena<StringRef>(ArgNames),
+            copyToArena<bool>(ArrayArgs));
 }
 
-static std::unique_ptr<FunctionAST> ParseDefinition() {
+template <typename BuilderT>
+static typename BuilderT::Function ParseDefinition(BuilderT &B) {
+    PhaseTimer Timer(PhaseParse);
     getNextToken();
-    auto proto = ParsePrototype();
-    if (!proto)
-        return nullptr;
-
-    if (auto E = ParseExpression())
-        return std::make_unique<FunctionAST>(std::move(proto), std::move(E));
-    return nullptr;
+    SlotNames.clear();
+    typename BuilderT::Function Fn = nullptr;
+    if (auto proto = ParsePrototype())
+        if (auto E = ParseExpression(B))
+            Fn = B.function(proto, E, SlotNames);
+    // エラーで途中で戻った場合も含めて、この定義の束縛を全て戻す。
+    unbindSlots(0);
+    return Fn;
 }
 
-// ExprASTは1. 数値リテラル 2. '('から始まる演算 3. 二項演算子の三通りが考えられる為、
-// 最初に1,2を判定して、そうでなければ二項演算子だと思う。
-static std::unique_ptr<ExprAST> ParseExpression() {
-    auto LHS = ParsePrimary();
-    if (!LHS)
-        return nullptr;
-
-    return ParseBinOpRHS(0, std::move(LHS));
-}
+static FunctionAST *ParseDefinition() { return ParseDefinition(ClassBuilder); }
 
 // パーサーのトップレベル関数。まだ関数定義は実装しないので、今のmc言語では
 // __anon_exprという関数がトップレベルに作られ、その中に全てのASTが入る。
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
-    if (auto E = ParseExpression()) {
-        auto Proto = std::make_unique<PrototypeAST>("__anon_expr",
-                std::vector<std::string>());
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+// 二つ目以降のtop level expressionは__anon_expr.1, __anon_expr.2, ...という名前になる。
+static thread_local unsigned AnonExprCount = 0;
+template <typename BuilderT>
+static typename BuilderT::Function ParseTopLevelExpr(BuilderT &B) {
+    PhaseTimer Timer(PhaseParse);
+    SlotNames.clear();
+    auto E = ParseExpression(B);
+    unbindSlots(0);
+    if (E) {
+        std::string Name = "__anon_expr";
+        if (AnonExprCount)
+            Name += "." + std::to_string(AnonExprCount);
+        ++AnonExprCount;
+        // 名前はソースの中に無いので、アリーナにコピーしておく。
+        auto Proto = newAST<PrototypeAST>(StringRef(Name).copy(ASTArena), NoSymbol,
+                ArrayRef<StringRef>(), ArrayRef<bool>());
+        return B.function(Proto, E, SlotNames);
     }
     return nullptr;
 }
+
+static FunctionAST *ParseTopLevelExpr() { return ParseTopLevelExpr(ClassBuilder); }
@@ -0,0 +1,251 @@
+//===----------------------------------------------------------------------===//
+// Profile-Guided Optimization
+// --profile-generate[=FILE]が指定された場合、codegen直後の各関数の入口と、全ての条件分岐の
+// 両方の行き先にカウンタを入れます。プログラムが終了する時(atexit)に、カウンタを
+// FILE(省略したらdefault.mcprof)に追記します。--runの場合は実行が終わった時に書き出します。
+// --profile-use=FILEが指定された場合、FILEのカウントを関数のentry countと条件分岐の
+// branch weights(!prof)としてcodegen直後のIRに付け、モジュールにProfileSummaryを付けてから
+// 最適化します。これでLLVMのインライン展開やブロックの配置、ループの最適化が実際の実行回数を使います。
+// 呼び出しごとのカウンタは入れませんが、entry countとbranch weightsから
+// BlockFrequencyInfoが呼び出しの回数を計算します。
+//
+// プロファイルは一行に一つの関数のテキストで、
+//   <関数名> <チェックサム> <入口の回数> <分岐0のtrue> <分岐0のfalse> <分岐1のtrue> ...
+// です。分岐の番号はcodegen直後のIRでの条件分岐の順番で、チェックサムはその時のIRの形から計算します。
+// ソースが変わって形が合わない関数のプロファイルは無視します。同じ関数が何回も現れたら
+// (何回も実行した場合)足し合わせるので、取り直す時はファイルを消してください。
+//===----------------------------------------------------------------------===//
+
+namespace {
+    const char *const ProfileWriterName = "__mc_prof_write";
+
+    struct FunctionProfile {
+        uint64_t Checksum = 0;
+        // Counts[0]が入口の回数、Counts[1 + 2 * i]とCounts[2 + 2 * i]がi番目の分岐のtrueとfalse
+        std::vector<uint64_t> Counts;
+    };
+} // end anonymous namespace
+
+// --profile-useで読んだプロファイル。mainで一度だけ読み、以後は読むだけなので--batchの各スレッドで共有する。
+static StringMap<FunctionProfile> ProfileData;
+
+// getCondBranches - Fの条件分岐を、ブロックの順番に返す。
+static std::vector<BranchInst *> getCondBranches(Function &F) {
+    std::vector<BranchInst *> Branches;
+    for (auto &BB : F)
+        if (auto *BI = dyn_cast<BranchInst>(BB.getTerminator()))
+            if (BI->isConditional())
+                Branches.push_back(BI);
+    return Branches;
+}
+
+// computeProfileChecksum - Fのブロック数、命令の種類と後続ブロックの数のハッシュ。
+// ソースが変わってカウンタの意味が変わったことを検出するのに使う。
+static uint64_t computeProfileChecksum(Function &F) {
+    std::string Shape = utostr(F.arg_size()) + ":" + utostr(F.size());
+    for (auto &BB : F) {
+        for (auto &I : BB)
+            Shape += utostr(I.getOpcode()) + ",";
+        Shape += "/" + utostr(BB.getTerminator()->getNumSuccessors()) + ";";
+    }
+    return xxHash64(Shape);
+}
+
+//===----------------------------------------------------------------------===//
+// --profile-generate
+//===----------------------------------------------------------------------===//
+
+// instrumentFunction - Fの入口と条件分岐にカウンタを入れる。
+// カウンタはF.profという配列で、先頭にチェックサム、次に入口、その後に分岐ごとに二つ並ぶ。
+// クリティカルエッジを分割しなくて済むように、分岐の直前で条件によってカウンタを選んで足す。
+static void instrumentFunction(Function &F) {
+    Module &M = *F.getParent();
+    LLVMContext &Ctx = M.getContext();
+    Type *I64 = Type::getInt64Ty(Ctx);
+    std::vector<BranchInst *> Branches = getCondBranches(F);
+
+    std::vector<Constant *> Init(2 + 2 * Branches.size(), ConstantInt::get(I64, 0));
+    Init[0] = ConstantInt::get(I64, computeProfileChecksum(F));
+    ArrayType *CountersTy = ArrayType::get(I64, Init.size());
+    auto *Counters = new GlobalVariable(M, CountersTy, false, GlobalValue::InternalLinkage,
+            ConstantArray::get(CountersTy, Init), F.getName() + ".prof");
+
+    auto Increment = [&](IRBuilder<> &B, Value *Index) {
+        Value *Ptr = B.CreateInBoundsGEP(CountersTy, Counters,
+                {ConstantInt::get(I64, 0), Index}, "prof.ptr");
+        Value *Count = B.CreateLoad(I64, Ptr, "prof.count");
+        B.CreateStore(B.CreateAdd(Count, ConstantInt::get(I64, 1)), Ptr);
+    };
+
+    IRBuilder<> B(&*F.getEntryBlock().getFirstInsertionPt());
+    Increment(B, ConstantInt::get(I64, 1));
+    for (unsigned i = 0; i < Branches.size(); ++i) {
+        B.SetInsertPoint(Branches[i]);
+        Increment(B, B.CreateSelect(Branches[i]->getCondition(),
+                    ConstantInt::get(I64, 2 + 2 * i), ConstantInt::get(I64, 3 + 2 * i),
+                    "prof.index"));
+    }
+}
+
+// emitProfileWriter - Mの全てのカウンタをプロファイルファイルに追記する関数を作り、
+// プログラムの開始時にatexitで登録する。
+static void emitProfileWriter(Module &M) {
+    LLVMContext &Ctx = M.getContext();
+    Type *I32 = Type::getInt32Ty(Ctx);
+    Type *I64 = Type::getInt64Ty(Ctx);
+    PointerType *I8Ptr = Type::getInt8PtrTy(Ctx);
+    FunctionType *VoidFnTy = FunctionType::get(Type::getVoidTy(Ctx), false);
+
+    FunctionCallee FOpen = M.getOrInsertFunction("fopen", I8Ptr, I8Ptr, I8Ptr);
+    FunctionCallee FPrintf = M.getOrInsertFunction("fprintf",
+            FunctionType::get(I32, {I8Ptr, I8Ptr}, true));
+    FunctionCallee FClose = M.getOrInsertFunction("fclose", I32, I8Ptr);
+    FunctionCallee AtExit = M.getOrInsertFunction("atexit", I32, VoidFnTy->getPointerTo());
+
+    Function *Writer = Function::Create(VoidFnTy, Function::InternalLinkage,
+            ProfileWriterName, &M);
+    BasicBlock *Entry = BasicBlock::Create(Ctx, "entry", Writer);
+    BasicBlock *Write = BasicBlock::Create(Ctx, "write", Writer);
+    BasicBlock *Done = BasicBlock::Create(Ctx, "done", Writer);
+    IRBuilder<> B(Entry);
+    Value *File = B.CreateCall(FOpen, {B.CreateGlobalStringPtr(Opts.ProfileGenerate),
+            B.CreateGlobalStringPtr("a")}, "file");
+    B.CreateCondBr(B.CreateIsNull(File), Done, Write);
+
+    B.SetInsertPoint(Write);
+    Value *NameFmt = B.CreateGlobalStringPtr("%s");
+    Value *CountFmt = B.CreateGlobalStringPtr(" %llu");
+    Value *Newline = B.CreateGlobalStringPtr("\n");
+    for (auto &GV : M.globals()) {
+        // MC言語の識別子には'.'が無いので、".prof"で終わるのはカウンタだけ。
+        if (!GV.getName().endswith(".prof"))
+            continue;
+        auto *CountersTy = cast<ArrayType>(GV.getValueType());
+        B.CreateCall(FPrintf, {File, NameFmt,
+                B.CreateGlobalStringPtr(GV.getName().drop_back(5))});
+        for (unsigned i = 0; i < CountersTy->getNumElements(); ++i) {
+            Value *Count = B.CreateLoad(I64, B.CreateConstInBoundsGEP2_64(CountersTy, &GV, 0, i));
+            B.CreateCall(FPrintf, {File, CountFmt, Count});
+        }
+        B.CreateCall(FPrintf, {File, Newline});
+    }
+    B.CreateCall(FClose, {File});
+    B.CreateBr(Done);
+    B.SetInsertPoint(Done);
+    B.CreateRetVoid();
+
+    Function *Init = Function::Create(VoidFnTy, Function::InternalLinkage,
+            "__mc_prof_init", &M);
+    B.SetInsertPoint(BasicBlock::Create(Ctx, "entry", Init));
+    B.CreateCall(AtExit, {Writer});
+    B.CreateRetVoid();
+    appendToGlobalCtors(M, Init, 0);
+}
+
+// detachProfileWriter - --runの場合に、emitProfileWriterが作った書き出す関数を返す。
+// JITしたコードはプロセスの終了前に解放されるし、atexitはJITから見つからないので、
+// atexitに登録するコンストラクタは消し、実行後に呼べるように外から見えるようにする。
+static Function *detachProfileWriter(Module &M) {
+    Function *Writer = M.getFunction(ProfileWriterName);
+    if (!Writer)
+        return nullptr;
+    if (GlobalVariable *Ctors = M.getNamedGlobal("llvm.global_ctors"))
+        Ctors->eraseFromParent();
+    if (Function *Init = M.getFunction("__mc_prof_init"))
+        Init->eraseFromParent();
+    Writer->setLinkage(GlobalValue::ExternalLinkage);
+    return Writer;
+}
+
+//===----------------------------------------------------------------------===//
+// --profile-use
+//===----------------------------------------------------------------------===//
+
+// loadProfile - Filenameのプロファイルを読んでProfileDataにセットする。
+static bool loadProfile(StringRef Filename) {
+    auto BufOrErr = MemoryBuffer::getFile(Filename);
+    if (!BufOrErr) {
+        errs() << "Could not read profile " << Filename << ": "
+               << BufOrErr.getError().message() << "\n";
+        return false;
+    }
+    SmallVector<StringRef, 16> Lines, Fields;
+    (*BufOrErr)->getBuffer().split(Lines, '\n', -1, false);
+    for (StringRef Line : Lines) {
+        Fields.clear();
+        Line.split(Fields, ' ', -1, false);
+        FunctionProfile P;
+        // 関数名、チェックサム、入口の回数と、分岐ごとに二つずつ
+        if (Fields.size() < 3 || Fields.size() % 2 == 0 ||
+                Fields[1].getAsInteger(10, P.Checksum)) {
+            errs() << "Malformed profile " << Filename << ": " << Line << "\n";
+            return false;
+        }
+        for (StringRef Field : makeArrayRef(Fields).drop_front(2)) {
+            P.Counts.push_back(0);
+            if (Field.getAsInteger(10, P.Counts.back())) {
+                errs() << "Malformed profile " << Filename << ": " << Line << "\n";
+                return false;
+            }
+        }
+
+        // 同じ形の関数の回数は足し合わせ、形が変わっていたら新しい方を使う。
+        auto Ins = ProfileData.try_emplace(Fields[0], P);
+        FunctionProfile &Old = Ins.first->second;
+        if (Ins.second || Old.Checksum != P.Checksum || Old.Counts.size() != P.Counts.size()) {
+            Old = std::move(P);
+            continue;
+        }
+        for (size_t i = 0; i < P.Counts.size(); ++i)
+            Old.Counts[i] += P.Counts[i];
+    }
+    return true;
+}
+
+// attachProfileSummary - ProfileDataの全ての回数からProfileSummaryを作ってMに付ける。
+// インライン展開等は、これを使ってどの回数からhot/coldと見なすかを決める。
+static void attachProfileSummary(Module &M) {
+    if (ProfileData.empty())
+        return;
+    InstrProfSummaryBuilder Builder(ProfileSummaryBuilder::DefaultCutoffs);
+    for (auto &Entry : ProfileData)
+        Builder.addRecord(InstrProfRecord(Entry.second.Counts));
+    M.setProfileSummary(Builder.getSummary()->getMD(M.getContext()),
+            ProfileSummary::PSK_Instr);
+}
+
+// annotateFunction - Fにプロファイルのentry countとbranch weightsを付ける。
+static void annotateFunction(Function &F) {
+    auto It = ProfileData.find(F.getName());
+    if (It == ProfileData.end())
+        return;
+    const FunctionProfile &P = It->second;
+    std::vector<BranchInst *> Branches = getCondBranches(F);
+    if (P.Checksum != computeProfileChecksum(F) || P.Counts.size() != 1 + 2 * Branches.size()) {
+        errs() << "warning: profile for " << F.getName()
+               << " does not match the source; ignored\n";
+        return;
+    }
+
+    F.setEntryCount(Function::ProfileCount(P.Counts[0], Function::PCT_Real));
+    MDBuilder MDB(F.getContext());
+    for (unsigned i = 0; i < Branches.size(); ++i) {
+        uint64_t T = P.Counts[1 + 2 * i], E = P.Counts[2 + 2 * i];
+        // 一度も実行されなかった分岐には何も分からないので付けない。
+        if (T == 0 && E == 0)
+            continue;
+        // branch weightsは32ビットなので、大きい方が収まるように縮める。
+        uint64_t Scale = std::max(T, E) / UINT32_MAX + 1;
+        Branches[i]->setMetadata(LLVMContext::MD_prof,
+                MDB.createBranchWeights(T / Scale, E / Scale));
+    }
+}
+
+// applyProfile - codegen直後のFに、--profile-generateならカウンタを入れ、
+// --profile-useならプロファイルを付ける。
+static void applyProfile(Function &F) {
+    if (!Opts.ProfileGenerate.empty())
+        instrumentFunction(F);
+    else if (!Opts.ProfileUse.empty())
+        annotateFunction(F);
+}
@@ -0,0 +1,191 @@
+//===----------------------------------------------------------------------===//
+// Pipelined Compile
+// --pipelineが指定された場合、パースとcodegenを別々のスレッドで並行に行います。
+// メインスレッドはトップレベルの定義と式を一つずつパースし、そのASTをアリーナごと
+// 長さに上限のあるキューに入れます。-j N個のワーカーはキューからASTを取り、それぞれ自分の
+// LLVMContextとモジュールにcodegenして関数単位の最適化をかけ、キューが空になって
+// パースが終わったら自分のモジュールにモジュール単位の最適化をかけてオブジェクトファイルを
+// 一時ファイルに出力します。出来たオブジェクトファイルは-jと同じく`ld -r`で一つのoutput.o
+// (-oの出力先)にまとめ、一時ファイルは失敗した場合も消します。
+// 他のワーカーがcodegenする関数は、パースした順で前にある定義だけを宣言して呼び出すので、
+// 未定義の関数の呼び出しのエラーは直列の場合と同じになります。
+// -jと同じく、モジュールをまたいだインライン展開やメモ化は行われません。
+// ワーカーのスレッドで行うcodegen等の時間は-time-phasesに数えません。
+//===----------------------------------------------------------------------===//
+
+// FunctionASTはparser.hの無名名前空間にあるので、それを持つ型も無名名前空間に置く。
+namespace {
+    // PipelineItem - パースしたトップレベルの定義か式一つ分のASTと、そのノードが入ったアリーナ
+    struct PipelineItem {
+        FunctionAST *FnAST = nullptr;
+        BumpPtrAllocator Arena;
+        // パースした順の番号(1から)
+        unsigned Ordinal = 0;
+    };
+
+    // PipelineQueue - パースするスレッドからワーカーにASTを渡す、長さに上限のあるキュー
+    class PipelineQueue {
+        public:
+            explicit PipelineQueue(size_t Capacity) : Capacity(Capacity) {}
+
+            // push - Itemを入れる。キューが一杯ならワーカーが取り出すまで待つ。
+            void push(PipelineItem Item) {
+                std::unique_lock<std::mutex> Lock(Mutex);
+                NotFull.wait(Lock, [&] { return Items.size() < Capacity; });
+                Items.push_back(std::move(Item));
+                NotEmpty.notify_one();
+            }
+
+            // pop - Itemを一つ取り出す。closeされていて空ならfalseを返す。
+            bool pop(PipelineItem &Item) {
+                std::unique_lock<std::mutex> Lock(Mutex);
+                NotEmpty.wait(Lock, [&] { return !Items.empty() || Closed; });
+                if (Items.empty())
+                    return false;
+                Item = std::move(Items.front());
+                Items.pop_front();
+                NotFull.notify_one();
+                return true;
+            }
+
+            // close - もうpushしないことをワーカーに知らせる。
+            void close() {
+                std::lock_guard<std::mutex> Lock(Mutex);
+                Closed = true;
+                NotEmpty.notify_all();
+            }
+
+        private:
+            std::mutex Mutex;
+            std::condition_variable NotEmpty, NotFull;
+            std::deque<PipelineItem> Items;
+            size_t Capacity;
+            bool Closed = false;
+    };
+} // end anonymous namespace
+
+// runPipelineWorker - Queueから取ったASTをこのスレッドのモジュールにcodegenし、
+// パースが終わったら最適化してFilenameに出力する。Parserはパースしているスレッドのlexer。
+static bool runPipelineWorker(PipelineQueue &Queue, const Lexer &Parser,
+        const FunctionSignature *Signatures, const std::string &Filename) {
+    if (!initTargetMachine())
+        return false;
+    initOptimizer();
+    SymbolSource = &Parser;
+    PipelineSignatures = Signatures;
+    // Filenameは一時ファイルの名前なので、オブジェクトファイルが毎回変わらないように
+    // 直列の場合と同じモジュール名にする。
+    myModule = std::make_unique<Module>("my cool jit", Context);
+    SymbolFunctions.clear();
+    myModule->setTargetTriple(TheTargetMachine->getTargetTriple().str());
+    myModule->setDataLayout(TheTargetMachine->createDataLayout());
+
+    PipelineItem Item;
+    while (Queue.pop(Item)) {
+        PipelineOrdinal = Item.Ordinal;
+        if (Function *FnIR = Item.FnAST->codegen())
+            optimizeFunction(*FnIR);
+        // このASTはもう使わないので、次のItemを取る前に解放する。
+        Item.Arena.Reset();
+    }
+
+    transformModule();
+    optimizeModule(*myModule);
+
+    auto dest = openOutputFile(Filename);
+    if (!dest)
+        return false;
+    bool Ok = emitObject(*myModule, *TheTargetMachine, *dest);
+    FAM.clear();
+    myModule.reset();
+    return Ok;
+}
+
+// runPipeline - Opts.InputFileをパースしながらOpts.Jobs個のワーカーでcodegenし、
+// getOutputFilename()に出力する。
+static int runPipeline() {
+    if (!initTargetMachine())
+        return -1;
+    initBinopPrecedence();
+    {
+        PhaseTimer Timer(PhaseLex);
+        if (!lexer.initStream(Opts.InputFile))
+            return -1;
+        lexer.tokenize(Opts.LexThreads);
+        // ワーカーがパース中にシンボルの名前を読めるように、先に全て登録しておく。
+        lexer.internAll();
+    }
+
+    std::vector<FunctionSignature> Signatures(lexer.getNumSymbols());
+    // パースがcodegenより速くても、ASTはワーカー一つあたりこれだけしか溜めない。
+    PipelineQueue Queue(4 * Opts.Jobs);
+    const std::string Filename = getOutputFilename();
+    // ワーカーごとのオブジェクトファイルは-jと同じく一時ファイルに出力する(parallel.h)。
+    std::vector<std::string> Parts;
+    if (!createPartFiles(Filename, Opts.Jobs, Parts))
+        return -1;
+    std::vector<char> Ok(Opts.Jobs);
+    std::vector<std::thread> Workers;
+    // lexerはthread_localなので、ワーカーの中で参照すると別のものになる。
+    const Lexer &Parser = lexer;
+    for (unsigned i = 0; i < Opts.Jobs; ++i)
+        Workers.emplace_back([&, i] {
+            Ok[i] = runPipelineWorker(Queue, Parser, Signatures.data(), Parts[i]);
+        });
+
+    unsigned Ordinal = 0;
+    getNextToken();
+    while (CurTok != tok_eof) {
+        FunctionAST *FnAST;
+        if (CurTok == ';') {
+            getNextToken();
+            continue;
+        }
+        if (CurTok == tok_def) {
+            FnAST = ParseDefinition();
+        } else {
+            FnAST = ParseTopLevelExpr();
+        }
+        if (!FnAST) {
+            getNextToken();
+            ASTArena.Reset();
+            continue;
+        }
+
+        PipelineItem Item;
+        Item.FnAST = FnAST;
+        Item.Ordinal = ++Ordinal;
+        PrototypeAST *Proto = FnAST->getProto();
+        if (Proto->getSymbol() != NoSymbol) {
+            // 後の定義のcodegenで宣言できるようにシグネチャを残す。再定義では上書きしない。
+            FunctionSignature &S = Signatures[Proto->getSymbol()];
+            if (!S.Ordinal.load(std::memory_order_relaxed)) {
+                S.Args.assign(Proto->getArgs().begin(), Proto->getArgs().end());
+                for (unsigned i = 0; i < Proto->getArgs().size(); ++i)
+                    S.ArrayArgs.push_back(Proto->isArrayArg(i));
+                S.Ordinal.store(Item.Ordinal, std::memory_order_release);
+            }
+            // 後の定義や式のパースでコンパイル時に評価できるようにする。
+            // エラーはワーカーのcodegenが表示する。
+            QuietErrors = true;
+            addConstEvalFunction(*FnAST);
+            QuietErrors = false;
+        }
+        // ASTのノードはアリーナごとワーカーに渡し、次の定義は新しいアリーナに作る。
+        Item.Arena = std::move(ASTArena);
+        Queue.push(std::move(Item));
+    }
+    Queue.close();
+    for (auto &W : Workers)
+        W.join();
+    if (std::count(Ok.begin(), Ok.end(), 0)) {
+        removePartFiles(Parts);
+        return -1;
+    }
+    if (!linkRelocatable(Filename, Parts))
+        return -1;
+    outs() << "Wrote " << Filename << "\n";
+    recordObjectFile(Filename);
+    finishStats();
+    return 0;
+}
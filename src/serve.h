@@ -0,0 +1,197 @@
+//===----------------------------------------------------------------------===//
+// Compile Server
+// `./mc --serve`はターゲットの登録とTheTargetMachineの作成、最適化パイプラインの構築を済ませ、
+// 小さなプログラムを一度コンパイルして温まった状態でUnixドメインソケットを待ち受けます。
+// クライアント(`./mcc`)から受け取ったコマンドラインは、stdin/stdout/stderrをクライアントのものに
+// 差し替え、カレントディレクトリを移ってから、mainと同じrunCommandでこのプロセスのまま実行します。
+// --batchと同じくmc::Compilerの状態を使い回すので、一回のコンパイルにかかるのはlibLLVMの動的リンクや
+// ターゲットの初期化を除いた部分だけになります。リクエストは一つずつ順に処理します。
+// mc::Compilerがリセットしない状態(-mcpu/-mattr/-Oで変わるTargetMachineと最適化パイプライン、
+// プロファイル、キャッシュ、統計)は、リクエストごとにここで合わせます。
+// --runと--vmはMC言語のプログラムを実行するので、止まらなかったり落ちたりしてもサーバーが
+// 巻き込まれないように、forkした子プロセスで実行します。
+// メッセージの形式はserve_protocol.hを参照してください。
+//===----------------------------------------------------------------------===//
+
+// サーバーを終了する時に消すソケットのパス
+static char ServeSocketPath[sizeof(sockaddr_un::sun_path)];
+
+static void handleServeSignal(int Sig) {
+    unlink(ServeSocketPath);
+    _exit(128 + Sig);
+}
+
+// ServeWarmUpSource - サーバーが起動時に一度コンパイルするプログラム
+static const char ServeWarmUpSource[] =
+    "def fib(x) if x < 3 then 1 else fib(x-1) + fib(x-2);\n"
+    "def sum(n) var s = 0 in (for i = 1, i < n in s = s + i) : s;\n"
+    "fib(10) + sum(10);\n";
+
+// warmUp - 小さなプログラムを一度コンパイルしてオブジェクトファイルまで出力し、捨てる。
+// パスやMCレイヤーの遅延初期化を、最初のリクエストより前に済ませておく。
+static void warmUp() {
+    SmallString<128> Source, Object;
+    if (sys::fs::createTemporaryFile("mc-serve", "mc", Source) ||
+            sys::fs::createTemporaryFile("mc-serve", "o", Object))
+        return;
+    {
+        std::error_code EC;
+        raw_fd_ostream OS(Source, EC);
+        OS << ServeWarmUpSource;
+    }
+    mc::Compiler C;
+    if (C.compile(Source.str().str()))
+        C.writeObject(Object);
+    sys::fs::remove(Source);
+    sys::fs::remove(Object);
+}
+
+// prepareRequest - 前のリクエストの状態を捨て、TheTargetMachineと最適化パイプラインを
+// このリクエストのOptsに合わせる。TargetOptsは今のTheTargetMachineを作った時のオプションで、
+// 合わせた後のものに更新する。
+// TargetMachine::setOptLevelで最適化レベルだけ変えると、その最適化レベルで作った場合と
+// 命令選択が変わることがあるので、-Oが違う場合も作り直す。
+static void prepareRequest(MCOptions &TargetOpts) {
+    if (Opts.CPU != TargetOpts.CPU || Opts.Attrs != TargetOpts.Attrs ||
+            Opts.OptLevel != TargetOpts.OptLevel) {
+        selectTargetCPU();
+        TheTargetMachine = createTargetMachine();
+        resetOptimizer();
+    }
+    TargetOpts.CPU = Opts.CPU;
+    TargetOpts.Attrs = Opts.Attrs;
+    TargetOpts.OptLevel = Opts.OptLevel;
+
+    ProfileData.clear();
+    FnCache.reset();
+    Stats = CompileStats();
+    ConstCallsEvaluated = 0;
+    ConstEvalFuelUsed = 0;
+}
+
+// flushOutput - リクエストの出力を全てクライアントのfdに書き出す。
+static void flushOutput() {
+    std::cout.flush();
+    outs().flush();
+    errs().flush();
+    fflush(nullptr);
+}
+
+// serveRequest - Connからリクエストを受け取ってRunCommandで実行し、終了コードをConnに送る。
+// ServerFdsはサーバー自身のstdin/stdout/stderrで、終わったら元に戻す。
+static void serveRequest(int Conn, const int ServerFds[3], MCOptions &TargetOpts,
+        int (*RunCommand)()) {
+    int Fds[3];
+    std::string Cwd;
+    std::vector<std::string> Args;
+    if (!mc::serve::recvRequest(Conn, Fds, Cwd, Args))
+        return;
+    for (int i = 0; i < 3; ++i) {
+        dup2(Fds[i], i);
+        close(Fds[i]);
+    }
+
+    std::vector<char *> Argv{const_cast<char *>("mc")};
+    for (auto &A : Args)
+        Argv.push_back(&A[0]);
+    Opts = MCOptions();
+    int Ret = -1;
+    pid_t Pid = -1;
+    if (chdir(Cwd.c_str()) != 0) {
+        errs() << "Could not change directory to " << Cwd << "\n";
+    } else if (!parseOptions(Argv.size(), Argv.data()) || Opts.Serve) {
+        printUsage();
+    } else {
+        prepareRequest(TargetOpts);
+        // --runと--vmは子プロセスで実行し、終了コードも子プロセスが送る。
+        if (Opts.Run || Opts.VM)
+            Pid = fork();
+        if (Pid == 0) {
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTERM, SIG_DFL);
+            signal(SIGPIPE, SIG_DFL);
+        }
+        if (Pid <= 0)
+            Ret = RunCommand();
+    }
+
+    flushOutput();
+    if (Pid <= 0)
+        mc::serve::sendStatus(Conn, Ret);
+    if (Pid == 0)
+        _exit(Ret & 0xff);
+
+    // クライアントが先に出力を閉じていた場合のエラーを次のリクエストに持ち越さない。
+    outs().clear_error();
+    for (int i = 0; i < 3; ++i) {
+        if (ServerFds[i] < 0)
+            close(i);
+        else
+            dup2(ServerFds[i], i);
+    }
+}
+
+// runServer - Opts.SocketPathで待ち受け、リクエストを一つずつRunCommandで実行する。
+// シグナルで止められるまで戻らない。
+static int runServer(int (*RunCommand)()) {
+    if (!initTargetMachine())
+        return -1;
+    initOptimizer();
+    warmUp();
+    MCOptions TargetOpts = Opts;
+
+    // リクエストごとにカレントディレクトリが変わるので、ソケットのパスは絶対パスにしておく。
+    SmallString<128> Path(Opts.SocketPath.empty() ? mc::serve::getDefaultSocketPath()
+                                                  : Opts.SocketPath);
+    sys::fs::make_absolute(Path);
+    sockaddr_un Addr;
+    if (!mc::serve::makeAddress(Path.str().str(), Addr)) {
+        errs() << "Socket path is too long: " << Path << "\n";
+        return -1;
+    }
+    int Listen = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (Listen < 0) {
+        errs() << "Could not create socket: " << strerror(errno) << "\n";
+        return -1;
+    }
+    // 前のサーバーが残したソケットのファイルは消す。他のユーザーからは接続させない。
+    unlink(Path.c_str());
+    mode_t OldMask = umask(077);
+    int BindErr = bind(Listen, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr));
+    umask(OldMask);
+    if (BindErr != 0 || listen(Listen, SOMAXCONN) != 0) {
+        errs() << "Could not listen on " << Path << ": " << strerror(errno) << "\n";
+        close(Listen);
+        return -1;
+    }
+    memcpy(ServeSocketPath, Addr.sun_path, sizeof(ServeSocketPath));
+    signal(SIGINT, handleServeSignal);
+    signal(SIGTERM, handleServeSignal);
+    // クライアントが出力を読まずに終了しても、サーバーは止まらないようにする。
+    signal(SIGPIPE, SIG_IGN);
+
+    int ServerFds[3];
+    for (int i = 0; i < 3; ++i)
+        ServerFds[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+
+    outs() << "Listening on " << Path << "\n";
+    outs().flush();
+    for (;;) {
+        // 終わった--runと--vmの子プロセスを回収する。リクエストの中で待つ子プロセス(-jの`ld -r`等)が
+        // あるので、SIGCHLDを無視して自動で回収させることはしない。
+        while (waitpid(-1, nullptr, WNOHANG) > 0)
+            ;
+        int Conn = accept4(Listen, nullptr, nullptr, SOCK_CLOEXEC);
+        if (Conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            errs() << "accept failed: " << strerror(errno) << "\n";
+            break;
+        }
+        serveRequest(Conn, ServerFds, TargetOpts, RunCommand);
+        close(Conn);
+    }
+    close(Listen);
+    unlink(Path.c_str());
+    return -1;
+}
@@ -0,0 +1,162 @@
+//===----------------------------------------------------------------------===//
+// Compile Server Protocol
+// `./mc --serve`(serve.h)とクライアントの`./mcc`(mcc.cpp)がUnixドメインソケットでやり取りする
+// メッセージです。mccはLLVMをリンクしないので、このファイルはLLVMを使わずに書きます。
+// リクエスト: クライアントは自分のstdin/stdout/stderrのfdをSCM_RIGHTSで渡し、続けて本体の長さ
+// (uint32_t)と、カレントディレクトリとコマンドライン引数を'\0'で区切って並べた本体を送ります。
+// レスポンス: サーバーはコンパイルが終わるとmainの戻り値(int32_t)を送ります。コンパイラの出力は
+// 受け取ったfdに直接書くので、クライアントからは`./mc`を実行した場合と同じに見えます。
+//===----------------------------------------------------------------------===//
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace mc {
+namespace serve {
+
+// リクエストの本体の長さの上限
+const uint32_t MaxRequestSize = 1 << 20;
+
+// getDefaultSocketPath - --socketを指定しない場合のソケットのパス。ユーザーごとに分ける。
+static inline std::string getDefaultSocketPath() {
+    return "/tmp/mc-" + std::to_string(getuid()) + ".sock";
+}
+
+// makeAddress - Pathのsockaddr_unを作る。パスが長過ぎればfalseを返す。
+static inline bool makeAddress(const std::string &Path, sockaddr_un &Addr) {
+    memset(&Addr, 0, sizeof(Addr));
+    Addr.sun_family = AF_UNIX;
+    if (Path.empty() || Path.size() >= sizeof(Addr.sun_path))
+        return false;
+    memcpy(Addr.sun_path, Path.c_str(), Path.size() + 1);
+    return true;
+}
+
+static inline bool writeAll(int FD, const void *Buf, size_t Len) {
+    const char *P = static_cast<const char *>(Buf);
+    while (Len) {
+        ssize_t N = write(FD, P, Len);
+        if (N < 0 && errno == EINTR)
+            continue;
+        if (N <= 0)
+            return false;
+        P += N;
+        Len -= N;
+    }
+    return true;
+}
+
+static inline bool readAll(int FD, void *Buf, size_t Len) {
+    char *P = static_cast<char *>(Buf);
+    while (Len) {
+        ssize_t N = read(FD, P, Len);
+        if (N < 0 && errno == EINTR)
+            continue;
+        if (N <= 0)
+            return false;
+        P += N;
+        Len -= N;
+    }
+    return true;
+}
+
+// sendRequest - Fdsの3つのfdとCwd、Argsをサーバーに送る。
+static inline bool sendRequest(int Sock, const int Fds[3], const std::string &Cwd,
+        const std::vector<std::string> &Args) {
+    std::string Body = Cwd + '\0';
+    for (auto &A : Args)
+        Body += A + '\0';
+    if (Body.size() > MaxRequestSize)
+        return false;
+
+    // fdは長さと一緒に送る。
+    uint32_t Size = Body.size();
+    iovec IOV = {&Size, sizeof(Size)};
+    alignas(cmsghdr) char Control[CMSG_SPACE(3 * sizeof(int))];
+    msghdr Msg = {};
+    Msg.msg_iov = &IOV;
+    Msg.msg_iovlen = 1;
+    Msg.msg_control = Control;
+    Msg.msg_controllen = sizeof(Control);
+    cmsghdr *C = CMSG_FIRSTHDR(&Msg);
+    C->cmsg_level = SOL_SOCKET;
+    C->cmsg_type = SCM_RIGHTS;
+    C->cmsg_len = CMSG_LEN(3 * sizeof(int));
+    memcpy(CMSG_DATA(C), Fds, 3 * sizeof(int));
+    ssize_t N;
+    do
+        N = sendmsg(Sock, &Msg, 0);
+    while (N < 0 && errno == EINTR);
+    if (N != sizeof(Size))
+        return false;
+    return writeAll(Sock, Body.data(), Body.size());
+}
+
+// recvRequest - sendRequestで送られたリクエストを受け取る。
+// 成功した場合、Fdsに受け取った3つのfdが入り、呼び出し側が閉じる。
+static inline bool recvRequest(int Sock, int Fds[3], std::string &Cwd,
+        std::vector<std::string> &Args) {
+    uint32_t Size;
+    iovec IOV = {&Size, sizeof(Size)};
+    alignas(cmsghdr) char Control[CMSG_SPACE(3 * sizeof(int))];
+    msghdr Msg = {};
+    Msg.msg_iov = &IOV;
+    Msg.msg_iovlen = 1;
+    Msg.msg_control = Control;
+    Msg.msg_controllen = sizeof(Control);
+    ssize_t N;
+    do
+        N = recvmsg(Sock, &Msg, MSG_CMSG_CLOEXEC);
+    while (N < 0 && errno == EINTR);
+    cmsghdr *C = N == sizeof(Size) ? CMSG_FIRSTHDR(&Msg) : nullptr;
+    if (!C || C->cmsg_level != SOL_SOCKET || C->cmsg_type != SCM_RIGHTS ||
+            C->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+        // fdの数が違えば、受け取ってしまったものを閉じる。
+        if (C && C->cmsg_level == SOL_SOCKET && C->cmsg_type == SCM_RIGHTS) {
+            size_t Count = (C->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < Count; ++i) {
+                int FD;
+                memcpy(&FD, CMSG_DATA(C) + i * sizeof(int), sizeof(int));
+                close(FD);
+            }
+        }
+        return false;
+    }
+    memcpy(Fds, CMSG_DATA(C), 3 * sizeof(int));
+
+    std::string Body(std::min(Size, MaxRequestSize), '\0');
+    if (Size > MaxRequestSize || Body.empty() || !readAll(Sock, &Body[0], Size) ||
+            Body.back() != '\0') {
+        for (int i = 0; i < 3; ++i)
+            close(Fds[i]);
+        return false;
+    }
+    std::vector<std::string> Fields;
+    for (size_t Pos = 0; Pos < Body.size();) {
+        size_t End = Body.find('\0', Pos);
+        Fields.push_back(Body.substr(Pos, End - Pos));
+        Pos = End + 1;
+    }
+    Cwd = Fields.front();
+    Args.assign(Fields.begin() + 1, Fields.end());
+    return true;
+}
+
+// sendStatus/recvStatus - コンパイルの終了コード
+static inline bool sendStatus(int Sock, int32_t Status) {
+    return writeAll(Sock, &Status, sizeof(Status));
+}
+
+static inline bool recvStatus(int Sock, int32_t &Status) {
+    return readAll(Sock, &Status, sizeof(Status));
+}
+
+} // end namespace serve
+} // end namespace mc
@@ -0,0 +1,169 @@
+//===----------------------------------------------------------------------===//
+// Compile Statistics
+// -time-phasesが指定された場合、コンパイルの各フェーズ(字句解析、構文解析、codegen、検証、
+// 最適化、オブジェクトの出力)にかかった実時間とCPU時間の表を最後にstderrに出力します。
+// -stats=jsonが指定された場合、同じ時間に加えて、トークン数、作ったASTのノード数、
+// 関数ごとのIRの命令数、出力したコードのサイズ、最大RSSをJSONでstdoutに出力します。
+// フェーズは入れ子にでき(codegenの中のverifyFunction等)、時間は一番内側のフェーズにだけ数えます。
+// 統計はスレッドごとに持つので、--batchと-j、--pipelineの別スレッドで行う部分は数えません。
+//===----------------------------------------------------------------------===//
+
+enum CompilePhase {
+    PhaseLex,
+    PhaseParse,
+    PhaseCodegen,
+    PhaseVerify,
+    PhaseOptimize,
+    PhaseEmit,
+    NumPhases,
+    // どのフェーズにも入っていない
+    PhaseNone = -1,
+};
+
+static const char *const PhaseNames[NumPhases] = {
+    "lex", "parse", "codegen", "verify", "optimize", "emit",
+};
+
+struct CompileStats {
+    double Wall[NumPhases] = {}, CPU[NumPhases] = {};
+    uint64_t ASTNodes = 0;
+    // 関数ごとの、関数単位の最適化が終わった時点のIRの命令数
+    std::vector<std::pair<std::string, unsigned>> FunctionInsts;
+    // 出力したオブジェクトファイルのバイト数と、その中の実行可能なセクションのバイト数
+    uint64_t ObjectBytes = 0, CodeBytes = 0;
+
+    CompilePhase Current = PhaseNone;
+    std::chrono::steady_clock::time_point Start = std::chrono::steady_clock::now(), LastWall;
+    double LastCPU = 0;
+};
+
+static thread_local CompileStats Stats;
+
+static bool statsEnabled() { return Opts.TimePhases || Opts.StatsJSON; }
+
+// getCPUSeconds - このプロセスが使ったユーザーとシステムのCPU時間
+static double getCPUSeconds() {
+    sys::TimePoint<> Elapsed;
+    std::chrono::nanoseconds User, Sys;
+    sys::Process::GetTimeUsage(Elapsed, User, Sys);
+    return std::chrono::duration<double>(User + Sys).count();
+}
+
+// switchPhase - 今のフェーズにここまでの時間を足し、Phaseに切り替える。前のフェーズを返す。
+static CompilePhase switchPhase(CompilePhase Phase) {
+    auto Now = std::chrono::steady_clock::now();
+    double CPU = getCPUSeconds();
+    CompilePhase Prev = Stats.Current;
+    if (Prev != PhaseNone) {
+        Stats.Wall[Prev] += std::chrono::duration<double>(Now - Stats.LastWall).count();
+        Stats.CPU[Prev] += CPU - Stats.LastCPU;
+    }
+    Stats.Current = Phase;
+    Stats.LastWall = Now;
+    Stats.LastCPU = CPU;
+    return Prev;
+}
+
+// PhaseTimer - スコープの間の時間をPhaseに数える。
+class PhaseTimer {
+    public:
+        explicit PhaseTimer(CompilePhase Phase) : Enabled(statsEnabled()) {
+            if (Enabled)
+                Prev = switchPhase(Phase);
+        }
+        ~PhaseTimer() {
+            if (Enabled)
+                switchPhase(Prev);
+        }
+
+    private:
+        bool Enabled;
+        CompilePhase Prev = PhaseNone;
+};
+
+// recordFunction - Fの命令数を覚える。
+static void recordFunction(Function &F) {
+    if (statsEnabled())
+        Stats.FunctionInsts.emplace_back(F.getName().str(), F.getInstructionCount());
+}
+
+// recordObjectFile - 出力したオブジェクトファイルFilenameのサイズを覚える。
+static void recordObjectFile(StringRef Filename) {
+    if (!statsEnabled())
+        return;
+    auto ObjOrErr = object::ObjectFile::createObjectFile(Filename);
+    if (!ObjOrErr) {
+        consumeError(ObjOrErr.takeError());
+        return;
+    }
+    object::ObjectFile &Obj = *ObjOrErr->getBinary();
+    Stats.ObjectBytes = Obj.getData().size();
+    for (const object::SectionRef &Section : Obj.sections())
+        if (Section.isText())
+            Stats.CodeBytes += Section.getSize();
+}
+
+// getPeakRSSKB - このプロセスの最大RSS(KB)
+static uint64_t getPeakRSSKB() {
+    struct rusage Usage;
+    if (getrusage(RUSAGE_SELF, &Usage))
+        return 0;
+    return Usage.ru_maxrss;
+}
+
+// printTimeReport - 各フェーズの時間の表をOSに出力する。
+static void printTimeReport(raw_ostream &OS) {
+    double TotalWall = 0, TotalCPU = 0;
+    for (unsigned i = 0; i < NumPhases; ++i) {
+        TotalWall += Stats.Wall[i];
+        TotalCPU += Stats.CPU[i];
+    }
+    OS << "===-------------------------------------------------------------------------===\n"
+       << "                          MC compile time report\n"
+       << "===-------------------------------------------------------------------------===\n"
+       << "   Wall (ms)    CPU (ms)  Phase\n";
+    for (unsigned i = 0; i < NumPhases; ++i)
+        OS << format("  %10.3f  %10.3f  %s\n", Stats.Wall[i] * 1e3, Stats.CPU[i] * 1e3,
+                PhaseNames[i]);
+    OS << format("  %10.3f  %10.3f  total\n", TotalWall * 1e3, TotalCPU * 1e3);
+}
+
+// toMillis - 秒をマイクロ秒の精度のミリ秒にする。
+static double toMillis(double Seconds) { return std::round(Seconds * 1e6) / 1e3; }
+
+// printStatsJSON - 全ての統計をJSONでOSに出力する。
+static void printStatsJSON(raw_ostream &OS) {
+    std::chrono::duration<double> Total = std::chrono::steady_clock::now() - Stats.Start;
+    json::OStream J(OS, 2);
+    J.object([&] {
+        J.attributeObject("phases", [&] {
+            for (unsigned i = 0; i < NumPhases; ++i)
+                J.attributeObject(PhaseNames[i], [&] {
+                    J.attribute("wall_ms", toMillis(Stats.Wall[i]));
+                    J.attribute("cpu_ms", toMillis(Stats.CPU[i]));
+                });
+        });
+        J.attribute("total_wall_ms", toMillis(Total.count()));
+        J.attribute("tokens", (int64_t)lexer.getNumTokens());
+        J.attribute("ast_nodes", (int64_t)Stats.ASTNodes);
+        J.attributeArray("functions", [&] {
+            for (auto &F : Stats.FunctionInsts)
+                J.object([&] {
+                    J.attribute("name", F.first);
+                    J.attribute("ir_instructions", (int64_t)F.second);
+                });
+        });
+        J.attribute("object_bytes", (int64_t)Stats.ObjectBytes);
+        J.attribute("code_bytes", (int64_t)Stats.CodeBytes);
+        J.attribute("peak_rss_kb", (int64_t)getPeakRSSKB());
+    });
+    OS << "\n";
+}
+
+// finishStats - -time-phasesと-stats=jsonの出力をする。
+static void finishStats() {
+    if (Opts.TimePhases)
+        printTimeReport(errs());
+    if (Opts.StatsJSON)
+        printStatsJSON(outs());
+}
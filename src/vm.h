@@ -0,0 +1,568 @@
+//===----------------------------------------------------------------------===//
+// Bytecode VM
+// codegen.hがASTからLLVM IRを作るのに対し、このファイルではASTをレジスタ型の
+// バイトコードに変換し、その場でインタプリタで実行します。
+// LLVMの初期化もオブジェクトファイルの出力もしないので、小さなスクリプトなら
+// 最初の結果が出るまでの時間が大幅に短くなります。
+// ./mc --vm file.mc --call fib 10
+//===----------------------------------------------------------------------===//
+
+// VMの命令。各命令はOpとA, B, Cの三つのオペランドを持つ。
+// 32bitの即値(定数プールの番号、ジャンプ先、関数の番号)はBとCを繋げて表す。
+enum VMOpCode : uint16_t {
+    OP_LOADK, // R[A] = Consts[BC]
+    OP_MOV,   // R[A] = R[B]
+    OP_ADD,   // R[A] = R[B] + R[C]
+    OP_SUB,   // R[A] = R[B] - R[C]
+    OP_MUL,   // R[A] = R[B] * R[C]
+    OP_LT,    // R[A] = R[B] < R[C] ? -1 : 0 (codegenのsextに合わせる)
+    OP_JMP,   // PC = BC
+    OP_JZ,    // if (R[A] == 0) PC = BC
+    OP_CALL,  // R[A] = Functions[BC](R[A], R[A+1], ...)
+    OP_RET,   // return R[A]
+};
+
+struct VMInstr {
+    uint16_t Op, A, B, C;
+    uint32_t getBC() const { return B | (uint32_t(C) << 16); }
+};
+
+struct BytecodeFunction {
+    std::string Name;
+    unsigned NumArgs = 0;
+    // 引数を含めたこの関数が使うレジスタの数
+    unsigned NumRegs = 0;
+    std::vector<VMInstr> Code;
+    std::vector<int64_t> Consts;
+};
+
+struct BytecodeProgram {
+    std::vector<BytecodeFunction> Functions;
+    StringMap<unsigned> FunctionIndex;
+};
+
+// BytecodeBuilder - 一つの関数をバイトコードに変換している間の状態
+// レジスタは引数の後ろからスタックのように割り当て、式の評価が終わったら解放する。
+struct BytecodeBuilder {
+    BytecodeProgram &Program;
+    BytecodeFunction *F = nullptr;
+    // 変数のスロット(parser.hを参照)ごとの、その変数のレジスタ。束縛されていなければ-1。
+    std::vector<int> SlotRegs;
+    unsigned NextReg = 0;
+    // 変数に代入する式を変換したらtrueになる
+    bool Assigned = false;
+    // trueなら、変数を読む度に一時レジスタにコピーする。`x + (x = 1)`の左のxが
+    // 右の代入で書き換わらないようにするため、代入のある関数でだけ使う。
+    bool CopyVariables = false;
+
+    BytecodeBuilder(BytecodeProgram &Program) : Program(Program) {}
+
+    int allocReg() {
+        if (NextReg > UINT16_MAX)
+            return -1;
+        F->NumRegs = std::max(F->NumRegs, NextReg + 1);
+        return NextReg++;
+    }
+    size_t emit(VMOpCode Op, unsigned A, unsigned B = 0, unsigned C = 0) {
+        F->Code.push_back({Op, uint16_t(A), uint16_t(B), uint16_t(C)});
+        return F->Code.size() - 1;
+    }
+    size_t emitBC(VMOpCode Op, unsigned A, uint32_t BC) {
+        return emit(Op, A, BC & 0xffff, BC >> 16);
+    }
+    // ジャンプ先が決まった時に、既に出力したジャンプ命令の飛び先を書き換える
+    void patchJump(size_t At, uint32_t Target) {
+        F->Code[At].B = Target & 0xffff;
+        F->Code[At].C = Target >> 16;
+    }
+    uint32_t currentPC() const { return F->Code.size(); }
+    void emitConst(unsigned Dst, int64_t Val) {
+        emitBC(OP_LOADK, Dst, F->Consts.size());
+        F->Consts.push_back(Val);
+    }
+    // lookupVariable - スロットSlotの変数のレジスタ。束縛されていなければ-1。
+    int lookupVariable(int Slot) const { return Slot < 0 ? -1 : SlotRegs[Slot]; }
+};
+
+namespace {
+    // bytecodegenはASTの深さだけ再帰するので、これより深い式はC++のスタックが溢れる前に断る。
+    // パーサーとcodegenは作業スタックを使うので、深さの制限はVMとコンパイル時の評価にだけある。
+    const unsigned BytecodeMaxExprDepth = 10000;
+} // end anonymous namespace
+
+int LogErrorR(const char *Str) {
+    LogError(Str);
+    return -1;
+}
+
+//===----------------------------------------------------------------------===//
+// AST -> Bytecode
+// 各bytecodegenは式の結果が入ったレジスタの番号を返し、エラーの場合は-1を返す。
+//===----------------------------------------------------------------------===//
+
+int NumberAST::bytecodegen(BytecodeBuilder &B) {
+    int Dst = B.allocReg();
+    if (Dst < 0)
+        return LogErrorR("too many registers");
+    B.emitConst(Dst, Val);
+    return Dst;
+}
+
+int VariableExprAST::bytecodegen(BytecodeBuilder &B) {
+    int VarR = B.lookupVariable(Slot);
+    if (VarR < 0)
+        return LogErrorR("Unknown variable name");
+    if (!B.CopyVariables)
+        return VarR;
+    int Dst = B.allocReg();
+    if (Dst < 0)
+        return LogErrorR("too many registers");
+    B.emit(OP_MOV, Dst, VarR);
+    return Dst;
+}
+
+int BinaryAST::bytecodegen(BytecodeBuilder &B) {
+    // 子の評価で使った一時レジスタは、結果を書き込んだ後は不要なので再利用する。
+    unsigned Mark = B.NextReg;
+    int L = LHS->bytecodegen(B);
+    if (L < 0)
+        return -1;
+    int R = RHS->bytecodegen(B);
+    if (R < 0)
+        return -1;
+    B.NextReg = Mark;
+    int Dst = B.allocReg();
+    if (Dst < 0)
+        return LogErrorR("too many registers");
+
+    switch (Op) {
+        case '+':
+            B.emit(OP_ADD, Dst, L, R);
+            break;
+        case '-':
+            B.emit(OP_SUB, Dst, L, R);
+            break;
+        case '*':
+            B.emit(OP_MUL, Dst, L, R);
+            break;
+        case '<':
+            B.emit(OP_LT, Dst, L, R);
+            break;
+        case ':':
+            B.emit(OP_MOV, Dst, R);
+            break;
+        default:
+            return LogErrorR("invalid binary operator");
+    }
+    return Dst;
+}
+
+int CallExprAST::bytecodegen(BytecodeBuilder &B) {
+    auto It = B.Program.FunctionIndex.find(lexer.getSymbolName(callee));
+    if (It == B.Program.FunctionIndex.end())
+        return LogErrorR("Unknown function referenced");
+    if (B.Program.Functions[It->second].NumArgs != args.size())
+        return LogErrorR("Incorrect # arguments passed");
+
+    // 引数は連続したレジスタに並べ、呼び出し先ではそれがr0, r1, ...になる。
+    // 返り値は先頭の引数のレジスタに書き込まれる。
+    unsigned Base = B.NextReg;
+    for (unsigned i = 0, e = std::max<size_t>(args.size(), 1); i != e; ++i)
+        if (B.allocReg() < 0)
+            return LogErrorR("too many registers");
+    for (unsigned i = 0, e = args.size(); i != e; ++i) {
+        int V = args[i]->bytecodegen(B);
+        if (V < 0)
+            return -1;
+        if (unsigned(V) != Base + i)
+            B.emit(OP_MOV, Base + i, V);
+        B.NextReg = Base + std::max<size_t>(args.size(), 1);
+    }
+    B.emitBC(OP_CALL, Base, It->second);
+    B.NextReg = Base + 1;
+    return Base;
+}
+
+int IfExprAST::bytecodegen(BytecodeBuilder &B) {
+    int Dst = B.allocReg();
+    if (Dst < 0)
+        return LogErrorR("too many registers");
+    unsigned Mark = B.NextReg;
+
+    int CondR = Cond->bytecodegen(B);
+    if (CondR < 0)
+        return -1;
+    size_t JumpToElse = B.emitBC(OP_JZ, CondR, 0);
+    B.NextReg = Mark;
+
+    int ThenR = Then->bytecodegen(B);
+    if (ThenR < 0)
+        return -1;
+    B.emit(OP_MOV, Dst, ThenR);
+    size_t JumpToEnd = B.emitBC(OP_JMP, 0, 0);
+    B.NextReg = Mark;
+
+    B.patchJump(JumpToElse, B.currentPC());
+    int ElseR = Else->bytecodegen(B);
+    if (ElseR < 0)
+        return -1;
+    B.emit(OP_MOV, Dst, ElseR);
+    B.NextReg = Mark;
+
+    B.patchJump(JumpToEnd, B.currentPC());
+    return Dst;
+}
+
+int VarExprAST::bytecodegen(BytecodeBuilder &B) {
+    int Dst = B.allocReg();
+    if (Dst < 0)
+        return LogErrorR("too many registers");
+    unsigned Mark = B.NextReg;
+
+    // 変数のレジスタはbodyの評価が終わるまで解放しない。
+    for (auto &Var : Vars) {
+        int VarR = B.allocReg();
+        if (VarR < 0)
+            return LogErrorR("too many registers");
+        int InitR = Var.second->bytecodegen(B);
+        if (InitR < 0)
+            return -1;
+        if (InitR != VarR)
+            B.emit(OP_MOV, VarR, InitR);
+        B.NextReg = VarR + 1;
+        B.SlotRegs[Var.first] = VarR;
+    }
+
+    int BodyR = Body->bytecodegen(B);
+    if (BodyR < 0)
+        return -1;
+    B.emit(OP_MOV, Dst, BodyR);
+    B.NextReg = Mark;
+    return Dst;
+}
+
+// 配列はVMでは扱えない。
+int IndexExprAST::bytecodegen(BytecodeBuilder &) {
+    return LogErrorR("arrays are not supported by the VM");
+}
+
+int AssignExprAST::bytecodegen(BytecodeBuilder &B) {
+    if (Index)
+        return LogErrorR("arrays are not supported by the VM");
+    int VarR = B.lookupVariable(Slot);
+    if (VarR < 0)
+        return LogErrorR("Unknown variable name");
+    int V = Val->bytecodegen(B);
+    if (V < 0)
+        return -1;
+    if (V != VarR)
+        B.emit(OP_MOV, VarR, V);
+    B.Assigned = true;
+    return V;
+}
+
+// emitLoopBC - Condが0でない間Bodyを繰り返すバイトコードを作る。forとwhileで共有する。
+// CondはCondの値のレジスタ(エラーなら-1)を、Bodyは成功したかを返す。
+template <typename CondFn, typename BodyFn>
+static bool emitLoopBC(BytecodeBuilder &B, CondFn Cond, BodyFn Body) {
+    unsigned Mark = B.NextReg;
+    uint32_t Top = B.currentPC();
+    int CondR = Cond();
+    if (CondR < 0)
+        return false;
+    size_t JumpToEnd = B.emitBC(OP_JZ, CondR, 0);
+    B.NextReg = Mark;
+    if (!Body())
+        return false;
+    B.NextReg = Mark;
+    B.emitBC(OP_JMP, 0, Top);
+    B.patchJump(JumpToEnd, B.currentPC());
+    return true;
+}
+
+int ForExprAST::bytecodegen(BytecodeBuilder &B) {
+    int Dst = B.allocReg();
+    if (Dst < 0)
+        return LogErrorR("too many registers");
+    unsigned Mark = B.NextReg;
+
+    int VarR = B.allocReg();
+    if (VarR < 0)
+        return LogErrorR("too many registers");
+    int StartR = Start->bytecodegen(B);
+    if (StartR < 0)
+        return -1;
+    if (StartR != VarR)
+        B.emit(OP_MOV, VarR, StartR);
+    B.NextReg = VarR + 1;
+
+    B.SlotRegs[Slot] = VarR;
+    bool Ok = emitLoopBC(B, [&] { return Cond->bytecodegen(B); }, [&] {
+        if (Body->bytecodegen(B) < 0)
+            return false;
+        int StepR;
+        if (Step) {
+            StepR = Step->bytecodegen(B);
+        } else {
+            StepR = B.allocReg();
+            if (StepR >= 0)
+                B.emitConst(StepR, 1);
+        }
+        if (StepR < 0)
+            return false;
+        B.emit(OP_ADD, VarR, VarR, StepR);
+        return true;
+    });
+    if (!Ok)
+        return -1;
+
+    B.emitConst(Dst, 0);
+    B.NextReg = Mark;
+    return Dst;
+}
+
+int WhileExprAST::bytecodegen(BytecodeBuilder &B) {
+    int Dst = B.allocReg();
+    if (Dst < 0)
+        return LogErrorR("too many registers");
+    if (!emitLoopBC(B, [&] { return Cond->bytecodegen(B); },
+                [&] { return Body->bytecodegen(B) >= 0; }))
+        return -1;
+    B.emitConst(Dst, 0);
+    return Dst;
+}
+
+int FunctionAST::bytecodegen(BytecodeBuilder &B) {
+    BytecodeProgram &P = B.Program;
+    StringRef Name = proto->getFunctionName();
+    if (P.FunctionIndex.count(Name))
+        return LogErrorR("Function cannot be redefined");
+    if (proto->hasArrayArgs())
+        return LogErrorR("arrays are not supported by the VM");
+    if (ParsedExprDepth > BytecodeMaxExprDepth)
+        return LogErrorR("expression is too deeply nested for the VM");
+
+    // 再帰呼び出しが出来るように、bodyを変換する前に関数を登録しておく。
+    unsigned Index = P.Functions.size();
+    P.Functions.emplace_back();
+    P.FunctionIndex[Name] = Index;
+    BytecodeFunction &F = P.Functions.back();
+    F.Name = Name.str();
+    F.NumArgs = proto->getArgs().size();
+    F.NumRegs = F.NumArgs;
+
+    B.F = &F;
+    auto GenBody = [&](bool CopyVariables) {
+        F.Code.clear();
+        F.Consts.clear();
+        F.NumRegs = F.NumArgs;
+        // i番目の引数のスロットはiで、レジスタもr(i)になる。
+        B.SlotRegs.assign(slotNames.size(), -1);
+        for (unsigned i = 0; i < F.NumArgs; ++i)
+            B.SlotRegs[i] = i;
+        B.NextReg = F.NumArgs;
+        B.Assigned = false;
+        B.CopyVariables = CopyVariables;
+        return body->bytecodegen(B);
+    };
+
+    // 代入があった場合は、変数を読む度にコピーするようにして作り直す。
+    int RetR = GenBody(false);
+    if (RetR >= 0 && B.Assigned)
+        RetR = GenBody(true);
+    if (RetR < 0) {
+        P.FunctionIndex.erase(Name);
+        P.Functions.pop_back();
+        return -1;
+    }
+    B.emit(OP_RET, RetR);
+    return Index;
+}
+
+//===----------------------------------------------------------------------===//
+// Interpreter
+// 命令の振り分けにはcomputed goto(GCC/Clangの拡張)を使い、各命令の最後で
+// 直接次の命令のラベルに飛ぶ。関数呼び出しはC++のスタックを使わずに
+// Framesに積むので、再帰の深さはメモリの量だけで制限される。
+//===----------------------------------------------------------------------===//
+
+namespace {
+    struct VMFrame {
+        const BytecodeFunction *F;
+        const VMInstr *PC;
+        size_t Base;
+    };
+} // end anonymous namespace
+
+// runBytecode - Program.Functions[FnIndex]をArgsで呼び出し、返り値をResultに入れる。
+// Fuelがnullptrでなければ、関数呼び出しと後ろ向きのジャンプの度に一つ減らし、
+// 0になったら実行を止めてfalseを返す。呼び出しの深さがMaxDepthを超えた場合もfalseを返す。
+static bool runBytecode(const BytecodeProgram &Program, unsigned FnIndex,
+        ArrayRef<int64_t> Args, int64_t &Result, uint64_t *Fuel = nullptr,
+        size_t MaxDepth = SIZE_MAX) {
+    const BytecodeFunction *F = &Program.Functions[FnIndex];
+    if (Args.size() != F->NumArgs)
+        return false;
+
+    std::vector<int64_t> Stack(std::max<size_t>(F->NumRegs, 1) + 1024);
+    std::vector<VMFrame> Frames;
+    std::copy(Args.begin(), Args.end(), Stack.begin());
+    size_t Base = 0;
+    int64_t *R = Stack.data();
+    const int64_t *K = F->Consts.data();
+    const VMInstr *PC = F->Code.data();
+    uint64_t NoFuel = UINT64_MAX;
+    uint64_t &Remaining = Fuel ? *Fuel : NoFuel;
+
+#if defined(__GNUC__)
+    static const void *DispatchTable[] = {
+        &&L_OP_LOADK, &&L_OP_MOV, &&L_OP_ADD, &&L_OP_SUB, &&L_OP_MUL,
+        &&L_OP_LT, &&L_OP_JMP, &&L_OP_JZ, &&L_OP_CALL, &&L_OP_RET,
+    };
+#define VM_CASE(Op) L_##Op:
+#define VM_NEXT() goto *DispatchTable[(++PC)->Op]
+#define VM_JUMP(Target) do { PC = (Target); goto *DispatchTable[PC->Op]; } while (0)
+    goto *DispatchTable[PC->Op];
+#else
+#define VM_CASE(Op) case Op:
+#define VM_NEXT() do { ++PC; goto Dispatch; } while (0)
+#define VM_JUMP(Target) do { PC = (Target); goto Dispatch; } while (0)
+Dispatch:
+    switch (PC->Op) {
+#endif
+
+    VM_CASE(OP_LOADK)
+        R[PC->A] = K[PC->getBC()];
+        VM_NEXT();
+    VM_CASE(OP_MOV)
+        R[PC->A] = R[PC->B];
+        VM_NEXT();
+    // 符号付き整数のオーバーフローはLLVM IRと同じく2の補数で折り返す
+    VM_CASE(OP_ADD)
+        R[PC->A] = uint64_t(R[PC->B]) + uint64_t(R[PC->C]);
+        VM_NEXT();
+    VM_CASE(OP_SUB)
+        R[PC->A] = uint64_t(R[PC->B]) - uint64_t(R[PC->C]);
+        VM_NEXT();
+    VM_CASE(OP_MUL)
+        R[PC->A] = uint64_t(R[PC->B]) * uint64_t(R[PC->C]);
+        VM_NEXT();
+    VM_CASE(OP_LT)
+        R[PC->A] = R[PC->B] < R[PC->C] ? -1 : 0;
+        VM_NEXT();
+    VM_CASE(OP_JMP) {
+        const VMInstr *Target = F->Code.data() + PC->getBC();
+        if (Target <= PC && Remaining-- == 0)
+            return false;
+        VM_JUMP(Target);
+    }
+    VM_CASE(OP_JZ)
+        if (R[PC->A] == 0)
+            VM_JUMP(F->Code.data() + PC->getBC());
+        VM_NEXT();
+    VM_CASE(OP_CALL) {
+        if (Remaining-- == 0 || Frames.size() >= MaxDepth)
+            return false;
+        const BytecodeFunction *Callee = &Program.Functions[PC->getBC()];
+        Frames.push_back({F, PC, Base});
+        Base += PC->A;
+        if (Base + Callee->NumRegs > Stack.size())
+            Stack.resize(std::max(Stack.size() * 2, Base + Callee->NumRegs));
+        F = Callee;
+        R = Stack.data() + Base;
+        K = F->Consts.data();
+        VM_JUMP(F->Code.data());
+    }
+    VM_CASE(OP_RET) {
+        int64_t V = R[PC->A];
+        if (Frames.empty()) {
+            Result = V;
+            return true;
+        }
+        VMFrame &Caller = Frames.back();
+        F = Caller.F;
+        PC = Caller.PC;
+        Base = Caller.Base;
+        Frames.pop_back();
+        R = Stack.data() + Base;
+        K = F->Consts.data();
+        R[PC->A] = V;
+        VM_NEXT();
+    }
+
+#if !defined(__GNUC__)
+    }
+#endif
+#undef VM_CASE
+#undef VM_NEXT
+#undef VM_JUMP
+    return false;
+}
+
+//===----------------------------------------------------------------------===//
+// VM エントリーポイント
+// --vmが指定された場合、mc.cppからMainLoopの代わりにVMMainLoopが呼ばれます。
+// 関数定義はバイトコードに変換して溜めておき、top level expressionはその場で実行します。
+//===----------------------------------------------------------------------===//
+
+static thread_local BytecodeProgram VMProgram;
+
+// runVMFunction - 結果を表示するか、実行できなかった理由を表示する。
+static bool runVMFunction(unsigned Index, ArrayRef<int64_t> Args, int64_t &Result) {
+    if (runBytecode(VMProgram, Index, Args, Result))
+        return true;
+    fprintf(stderr, "Error: failed to run %s\n", VMProgram.Functions[Index].Name.c_str());
+    return false;
+}
+
+static int VMMainLoop() {
+    BytecodeBuilder B(VMProgram);
+    while (true) {
+        switch (CurTok) {
+            case tok_eof: {
+                if (Opts.CallFunction.empty())
+                    return 0;
+                auto It = VMProgram.FunctionIndex.find(Opts.CallFunction);
+                if (It == VMProgram.FunctionIndex.end()) {
+                    fprintf(stderr, "Error: Unknown function %s\n", Opts.CallFunction.c_str());
+                    return -1;
+                }
+                unsigned NumArgs = VMProgram.Functions[It->second].NumArgs;
+                if (Opts.CallArgs.size() != NumArgs) {
+                    fprintf(stderr, "Error: %s takes %u arguments but --call passed %zu\n",
+                            Opts.CallFunction.c_str(), NumArgs, Opts.CallArgs.size());
+                    return -1;
+                }
+                int64_t Result;
+                if (!runVMFunction(It->second, Opts.CallArgs, Result))
+                    return -1;
+                outs() << "Call " << Opts.CallFunction << " with";
+                for (int64_t A : Opts.CallArgs)
+                    outs() << " " << A;
+                outs() << ": " << Result << "\n";
+                return 0;
+            }
+            case tok_def:
+                if (auto FnAST = ParseDefinition())
+                    FnAST->bytecodegen(B);
+                else
+                    getNextToken();
+                ASTArena.Reset();
+                break;
+            case ';':
+                getNextToken();
+                break;
+            default:
+                if (auto FnAST = ParseTopLevelExpr()) {
+                    int Index = FnAST->bytecodegen(B);
+                    int64_t Result;
+                    if (Index >= 0 && runVMFunction(Index, None, Result))
+                        outs() << "Evaluated to " << Result << "\n";
+                } else {
+                    getNextToken();
+                }
+                ASTArena.Reset();
+                break;
+        }
+    }
+}
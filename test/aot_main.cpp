@@ -0,0 +1,36 @@
+// ./mc file.mcで作ったoutput.oとリンクし、MC_FUNCにコマンドライン引数を渡して呼ぶ。
+// 出力は./mc --vm file.mc --call MC_FUNC <引数>...と同じ形式なので、そのままdiffできる。
+// e.g. clang++ -DMC_FUNC=fib test/aot_main.cpp output.o -o main && ./main 10
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+extern "C" void MC_FUNC();
+
+int main(int argc, char *argv[]) {
+    typedef long I;
+    std::vector<I> a;
+    for (int i = 1; i < argc; ++i)
+        a.push_back(atol(argv[i]));
+
+    void *fp = (void *)&MC_FUNC;
+    I result;
+    switch (a.size()) {
+        case 0: result = ((I(*)())fp)(); break;
+        case 1: result = ((I(*)(I))fp)(a[0]); break;
+        case 2: result = ((I(*)(I, I))fp)(a[0], a[1]); break;
+        case 3: result = ((I(*)(I, I, I))fp)(a[0], a[1], a[2]); break;
+        default:
+            std::cout << "too many arguments" << std::endl;
+            return 1;
+    }
+
+    std::cout << "Call " << XSTR(MC_FUNC) << " with";
+    for (I v : a)
+        std::cout << " " << v;
+    std::cout << ": " << result << std::endl;
+    return 0;
+}
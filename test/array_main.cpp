@@ -0,0 +1,52 @@
+// test/array.mcのoutput.oとリンクし、配列の関数の結果をC++で計算した値と比べる。
+// e.g. clang++ test/array_main.cpp output.o -o test/array_main && ./test/array_main
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <numeric>
+#include <random>
+#include <vector>
+
+extern "C" {
+    long asum(long *a, long n);
+    long amin(long *a, long n);
+    long amax(long *a, long n);
+    long adot(long *a, long n, long *b, long m);
+    long alen(long *a, long n);
+    long loopsum(long *a, long n);
+    long twice(long *a, long n);
+}
+
+static int Failed = 0;
+
+static void expect(const char *What, long N, long Got, long Want) {
+    if (Got != Want) {
+        printf("FAIL: %s n=%ld: got %ld, want %ld\n", What, N, Got, Want);
+        Failed = 1;
+    }
+}
+
+int main() {
+    std::mt19937_64 Rng(1);
+    for (long N : {0, 1, 7, 8, 9, 15, 16, 17, 100, 1000, 4099}) {
+        std::vector<long> A(N), B(N + 3);
+        for (long &X : A)
+            X = long(Rng() % 2001) - 1000;
+        for (long &X : B)
+            X = long(Rng() % 2001) - 1000;
+
+        long Sum = std::accumulate(A.begin(), A.end(), 0L);
+        expect("sum", N, asum(A.data(), N), Sum);
+        expect("min", N, amin(A.data(), N), N ? *std::min_element(A.begin(), A.end()) : LONG_MAX);
+        expect("max", N, amax(A.data(), N), N ? *std::max_element(A.begin(), A.end()) : LONG_MIN);
+        // 長さの違う配列のdotは短い方に合わせる
+        expect("dot", N, adot(A.data(), N, B.data(), N + 3),
+                std::inner_product(A.begin(), A.end(), B.begin(), 0L));
+        expect("len", N, alen(A.data(), N), N);
+        expect("loopsum", N, loopsum(A.data(), N), Sum);
+        expect("twice", N, twice(A.data(), N), 2 * Sum);
+    }
+    if (!Failed)
+        printf("array: OK\n");
+    return Failed;
+}
@@ -0,0 +1,16 @@
+#!/bin/sh
+# test/array.mcを-O0/-O2/--flat-astでコンパイルし、test/array_main.cppとリンクして確かめる。
+# usage: CXX=clang++ sh test/array_test.sh
+CXX=${CXX:-clang++}
+
+for opts in -O0 -O2 --flat-ast; do
+    ./mc $opts test/array.mc > /dev/null 2>&1 || exit 1
+    $CXX test/array_main.cpp output.o -o test/array_main || exit 1
+    ./test/array_main > /dev/null || { echo "FAIL: $opts"; ./test/array_main; exit 1; }
+done
+
+# 組み込みのリダクションはベクトルのIRになる
+./mc --emit=ll -o - test/array.mc | grep -q "call i64 @llvm.vector.reduce.add.v8i64" || exit 1
+# 配列はVMでは扱えない
+./mc --vm test/array.mc 2>&1 | grep -q "arrays are not supported by the VM" || exit 1
+echo "array_test: OK"
@@ -0,0 +1,26 @@
+#!/bin/sh
+# ./mc --batchで複数のファイルを一つのプロセスでコンパイルし、file.mcをfile.oに書き出せるかと、
+# コンパイルできないファイルがあれば失敗してその数を数えないかを確かめる。
+# usage: CXX=clang++ sh test/batch_test.sh
+CXX=${CXX:-clang++}
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+cp test/test1.mc test/test5.mc test/parallel.mc $dir
+./mc --batch -j 2 $dir/test1.mc $dir/test5.mc $dir/parallel.mc > $dir/out.txt 2>&1 ||
+    { echo "FAIL: --batch"; cat $dir/out.txt; exit 1; }
+grep -q "^Compiled 3 files" $dir/out.txt || { echo "FAIL: --batch output"; exit 1; }
+$CXX -DMC_FUNC=mix test/aot_main.cpp $dir/parallel.o -o test/aot_main || exit 1
+got=$(./test/aot_main 5 7)
+if [ "$got" != "Call mix with 5 7: 66" ]; then
+    echo "FAIL: --batch mix: \"$got\""
+    exit 1
+fi
+
+if ./mc --batch $dir/test1.mc $dir/no_such_file.mc > $dir/out.txt 2>&1 ||
+        ! grep -q "^Compiled 1 files" $dir/out.txt; then
+    echo "FAIL: --batch with a missing file"
+    cat $dir/out.txt
+    exit 1
+fi
+echo "batch_test: OK"
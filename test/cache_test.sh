@@ -0,0 +1,46 @@
+#!/bin/sh
+# --cache-dirで、変わっていない定義はキャッシュから読み、変わった定義だけcodegenし直すかを確かめる。
+# キャッシュから読んだ場合もIRの出力とoutput.oの実行結果は同じになる。
+# usage: CXX=clang++ sh test/cache_test.sh
+CXX=${CXX:-clang++}
+dir=test/cache_test_dir
+rm -rf $dir
+mkdir -p $dir/cache
+
+run() {
+    ./mc -O2 --cache-dir=$dir/cache --cache-stats $dir/in.mc 2> $dir/err.txt > /dev/null || exit 1
+    grep "^cache:" $dir/err.txt
+}
+
+check() {
+    if [ "$1" != "$2" ]; then
+        echo "FAIL: $3: \"$1\" != \"$2\""
+        exit 1
+    fi
+}
+
+cp test/parallel.mc $dir/in.mc
+check "$(run)" "cache: 0 hits, 5 misses, 5 stored, 0 evicted" "cold"
+grep -v "^cache:" $dir/err.txt > $dir/cold.txt
+check "$(run)" "cache: 5 hits, 0 misses, 0 stored, 0 evicted" "warm"
+grep -v "^cache:" $dir/err.txt | diff - $dir/cold.txt > /dev/null || { echo "FAIL: IR differs"; exit 1; }
+
+# triだけ変えると、triと、triの引数の数が変わらないのでtriを呼ぶmixはキャッシュから読める
+sed 's/n + tri(n - 1)/n + n + tri(n - 1)/' test/parallel.mc > $dir/in.mc
+check "$(run)" "cache: 4 hits, 1 misses, 1 stored, 0 evicted" "edit"
+$CXX -DMC_FUNC=mix test/aot_main.cpp output.o -o test/aot_main || exit 1
+check "$(./test/aot_main 5 7)" "Call mix with 5 7: 94" "edited result"
+
+# 上限を4KB(エントリ2つ分)にすると、最近使われていないものから消える
+cp test/parallel.mc $dir/in.mc
+./mc -O2 --cache-dir=$dir/cache --cache-size=4k --cache-stats $dir/in.mc 2> $dir/err.txt > /dev/null
+check "$(grep "^cache:" $dir/err.txt)" "cache: 5 hits, 0 misses, 0 stored, 4 evicted" "prune"
+# 引数の数が同じでも、配列の引数に変わった関数を呼ぶ定義はキャッシュから読まない
+rm -rf $dir/cache
+printf 'def g(a b) a + b\ndef f(x) g(x, 1)\n' > $dir/in.mc
+check "$(run)" "cache: 0 hits, 2 misses, 2 stored, 0 evicted" "scalar args"
+printf 'def g(a[]) a[0]\ndef f(x) g(x, 1)\n' > $dir/in.mc
+./mc -O2 --cache-dir=$dir/cache $dir/in.mc > /dev/null 2> $dir/err.txt
+grep -q "Incorrect # arguments passed" $dir/err.txt || { echo "FAIL: array arg hit the cache"; exit 1; }
+rm -rf $dir
+echo "cache_test: OK"
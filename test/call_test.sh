@@ -0,0 +1,21 @@
+#!/bin/sh
+# --runと--vmの--callで関数を呼んだ結果と、引数の数の間違いや未定義の関数、
+# 配列を受け取る関数がエラーになるかを確かめる。
+# usage: sh test/call_test.sh
+
+# expect line args... - ./mc argsのstdoutかstderrにlineという行があるかを確かめる。
+expect() {
+    line=$1; shift
+    if ! ./mc "$@" 2>&1 | grep -qxF "$line"; then
+        echo "FAIL: ./mc $*: expected \"$line\""
+        exit 1
+    fi
+}
+
+expect "Call fib with 10: 55" --run test/test5.mc --call fib 10
+expect "Error: fib takes 1 arguments but --call passed 0" --run test/test5.mc --call fib
+expect "Error: fib takes 1 arguments but --call passed 3" --run test/test5.mc --call fib 1 2 3
+expect "Error: Unknown function nope" --run test/test5.mc --call nope 1
+expect "Error: fib takes 1 arguments but --call passed 0" --vm test/test5.mc --call fib
+expect "Error: --call cannot pass arrays to asum" --run test/array.mc --call asum 1
+echo "call_test: OK"
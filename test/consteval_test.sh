@@ -0,0 +1,35 @@
+#!/bin/sh
+# test/consteval.mcの定数の呼び出しがコンパイル時に評価されるかと、--consteval-fuelと
+# --consteval-budgetを使い切った呼び出しが普通の呼び出しのまま残るかを確かめる。
+# usage: CXX=clang++ sh test/consteval_test.sh
+CXX=${CXX:-clang++}
+
+# has opts pattern / lacks opts pattern - --emit=llの出力にpatternがある(無い)かを確かめる。
+has() {
+    ./mc --emit=ll -o - $1 test/consteval.mc 2> /dev/null | grep -qF "$2" ||
+        { echo "FAIL: $1: expected \"$2\""; exit 1; }
+}
+lacks() {
+    ! ./mc --emit=ll -o - $1 test/consteval.mc 2> /dev/null | grep -qF "$2" ||
+        { echo "FAIL: $1: unexpected \"$2\""; exit 1; }
+}
+
+has "" "ret i64 832040"
+lacks "" "call i64 @fib(i64 20)"
+# 一つの呼び出しの上限を超えるfib(30)は評価しない。
+has --consteval-fuel=1000 "call i64 @fib(i64 30)"
+# fib(20)を評価した後、never(i)の止まらない呼び出しで合計の上限を使い切る。
+lacks --consteval-budget=20000 "call i64 @fib(i64 20)"
+has --consteval-budget=20000 "call i64 @fib(i64 30)"
+# 評価した関数定義も全て残る。
+n=$(./mc --emit=ll -o - test/consteval.mc 2> /dev/null | grep -c '^define')
+[ "$n" = 5 ] || { echo "FAIL: $n definitions"; exit 1; }
+
+./mc -O1 test/consteval.mc > /dev/null 2>&1 || exit 1
+$CXX -DMC_FUNC=table test/aot_main.cpp output.o -o test/aot_main || exit 1
+got=$(./test/aot_main 2)
+if [ "$got" != "Call table with 2: 6775" ]; then
+    echo "FAIL: -O1 table: \"$got\""
+    exit 1
+fi
+echo "consteval_test: OK"
@@ -0,0 +1,65 @@
+#!/bin/sh
+# 深さ10^6の式をパースしてコンパイルし、スタックが溢れずに、時間が深さに比例するかを確かめる。
+# パーサーとcodegenは作業スタックを使うので、スタックを1MBに制限しても通るはず。
+# usage: CXX=clang++ sh test/deep_test.sh
+CXX=${CXX:-clang++}
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+# chain(x) = x : x : ... : x + 1  (左結合の二項演算子がn段)
+gen_chain() {
+    awk -v n=$1 'BEGIN { printf "def chain(x) x"; for (i = 0; i < n; i++) printf " : x"; print " + 1" }'
+}
+# paren(x) = (x : (x : ... (x + 2)...))  (括弧がn段)
+gen_paren() {
+    awk -v n=$1 'BEGIN {
+        printf "def paren(x) "; for (i = 0; i < n; i++) printf "(x : ";
+        printf "x + 2"; for (i = 0; i < n; i++) printf ")"; print "" }'
+}
+# nest(x) = if x < 1 then 0 else if x < 2 then 1 else ... else x  (ifがn段)
+gen_nest() {
+    awk -v n=$1 'BEGIN {
+        printf "def nest(x) ";
+        for (i = 0; i < n; i++) printf "if x < %d then %d else ", i + 1, i;
+        print "x" }'
+}
+
+# check func n arg expected [arg expected]... - 深さnのfuncをコンパイルし、func(arg)を確かめる。
+check() {
+    func=$1; n=$2; shift 2
+    pairs="$*"
+    gen_$func $n > $dir/$func.mc
+    for opts in -O0 --flat-ast; do
+        (ulimit -s 1024; ./mc $opts $dir/$func.mc > /dev/null 2>&1) || {
+            echo "FAIL: $opts $func depth $n"
+            exit 1
+        }
+        $CXX -DMC_FUNC=$func test/aot_main.cpp output.o -o test/aot_main || exit 1
+        set -- $pairs
+        while [ $# -gt 0 ]; do
+            got=$(./test/aot_main $1)
+            if [ "$got" != "Call $func with $1: $2" ]; then
+                echo "FAIL: $opts $func depth $n: \"$got\""
+                exit 1
+            fi
+            shift 2
+        done
+    done
+}
+
+check chain 1000000 5 6
+check paren 1000000 5 7
+check nest 20000 16 16 20000 20000
+
+# 深さを10倍にしてもコンパイル時間が(ほぼ)10倍に収まる
+total_ms() {
+    gen_chain $1 > $dir/t.mc
+    ./mc -time-phases $dir/t.mc 2>&1 >/dev/null | awk '$3 == "total" { print $1 }'
+}
+small=$(total_ms 100000)
+large=$(total_ms 1000000)
+if ! awk -v s=$small -v l=$large 'BEGIN { exit !(l < s * 30) }'; then
+    echo "FAIL: depth 10^5 took ${small}ms but 10^6 took ${large}ms"
+    exit 1
+fi
+echo "deep_test: OK"
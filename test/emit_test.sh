@@ -0,0 +1,27 @@
+#!/bin/sh
+# --emitの各種類の出力ができるかと、-oの出力先に書けない場合に失敗するかを確かめる。
+# usage: sh test/emit_test.sh
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+./mc --emit=asm -o - test/test5.mc | grep -q "^fib:" || { echo "FAIL: --emit=asm"; exit 1; }
+./mc --emit=bc -o $dir/test5.bc test/test5.mc > /dev/null || exit 1
+[ "$(head -c 2 $dir/test5.bc)" = BC ] || { echo "FAIL: --emit=bc"; exit 1; }
+if ./mc --emit=none test/test5.mc | grep -q Wrote; then
+    echo "FAIL: --emit=none wrote a file"
+    exit 1
+fi
+
+# fail args... - ./mc argsが0以外で終了するかを確かめる。
+fail() {
+    if ./mc "$@" > $dir/out.txt 2>&1; then
+        echo "FAIL: ./mc $* succeeded"
+        exit 1
+    fi
+}
+fail -o $dir/no/such/dir/x.o test/test1.mc
+grep -qx "Could not open file: No such file or directory" $dir/out.txt ||
+    { echo "FAIL: bad -o message:"; cat $dir/out.txt; exit 1; }
+fail --emit=asm -o $dir/no/such/dir/x.s test/test1.mc
+fail -j 2 -o $dir/no/such/dir/x.o test/parallel.mc
+echo "emit_test: OK"
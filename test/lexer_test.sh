@@ -0,0 +1,15 @@
+#!/bin/sh
+# ASCIIでないバイトがトークンの種類(tok_eof等)と混ざらず、一文字のトークンになるかを確かめる。
+# 0xffのバイトはエラーになるが、入力はそこで終わらずに続きの定義もコンパイルされる。
+# usage: sh test/lexer_test.sh
+
+# 一文字ずつ調べる場合と、64バイト以上あってSIMDで調べる場合
+for pad in 0 64; do
+    out=$(printf "def f(x) x\n\377%${pad}s\ndef g(y) y\n" | ./mc --emit=ll -o - - 2>&1)
+    if ! echo "$out" | grep -q "^Error: unknown token" || ! echo "$out" | grep -q "define i64 @g"; then
+        echo "FAIL: 0xff byte followed by $pad spaces"
+        echo "$out"
+        exit 1
+    fi
+done
+echo "lexer_test: OK"
@@ -0,0 +1,39 @@
+#!/bin/sh
+# test/loop.mcのループと代入を、-O0/-O2のAOT、--flat-ast、--vmで実行して結果を確かめる。
+# usage: CXX=clang++ sh test/loop_test.sh
+CXX=${CXX:-clang++}
+
+check() {
+    func=$1; expected=$2; shift 2
+    want="Call $func with $(echo "$@"): $expected"
+    for opts in -O0 -O2 --flat-ast; do
+        ./mc $opts test/loop.mc > /dev/null 2>&1 || exit 1
+        $CXX -DMC_FUNC=$func test/aot_main.cpp output.o -o test/aot_main || exit 1
+        got=$(./test/aot_main "$@")
+        if [ "$got" != "$want" ]; then
+            echo "FAIL: $opts $func $*: \"$got\""
+            exit 1
+        fi
+    done
+    got=$(./mc --vm test/loop.mc --call $func "$@")
+    if [ "$got" != "$want" ]; then
+        echo "FAIL: --vm $func $*: \"$got\""
+        exit 1
+    fi
+}
+
+check sumto 5050 100
+check sumto 0 0
+check fact 2432902008176640000 20
+check tri2 120 10
+check step2 5 9
+check swap 7 3 10
+check order 6 5
+check chain 12 5
+
+# 変数は全てmem2regでSSAのレジスタになる
+if ./mc --emit=ll -o - test/loop.mc | grep -q alloca; then
+    echo "FAIL: alloca left after mem2reg"
+    exit 1
+fi
+echo "loop_test: OK"
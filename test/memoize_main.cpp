@@ -0,0 +1,37 @@
+// ./mc --memoize test/test5.mc で作ったoutput.oとリンクして、
+// 複数のスレッドから同時にfibを呼んでも、memo表から正しい値が返るかを確認する。
+#include <iostream>
+#include <thread>
+#include <vector>
+
+extern "C" long fib(long);
+
+int main() {
+    const int N = 90;
+    long expected[N + 1] = {0, 1, 1};
+    for (int i = 3; i <= N; ++i)
+        expected[i] = expected[i - 1] + expected[i - 2];
+
+    // スレッドごとに違う順番で呼び、同じエントリの読み書きが重なるようにする。
+    std::vector<std::thread> threads;
+    bool failed[4] = {};
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&, t] {
+            for (int round = 0; round < 20000; ++round) {
+                int x = 1 + (round * (2 * t + 7) + t) % N;
+                if (fib(x) != expected[x])
+                    failed[t] = true;
+            }
+        });
+    }
+    for (auto &th : threads)
+        th.join();
+    for (bool f : failed) {
+        if (f) {
+            std::cout << "fib returned a wrong value" << std::endl;
+            return 1;
+        }
+    }
+    std::cout << "OK" << std::endl;
+    return 0;
+}
@@ -0,0 +1,21 @@
+#!/bin/sh
+# --memoizeでfib(90)がすぐに終わるかと、メモ化したoutput.oを複数のスレッドから呼んでも
+# 正しい値が返るかを確かめる。
+# usage: CXX=clang++ sh test/memoize_test.sh
+CXX=${CXX:-clang++}
+
+got=$(timeout 10 ./mc --run --memoize test/test5.mc --call fib 90 2> /dev/null)
+if [ "$got" != "Call fib with 90: 2880067194370816120" ]; then
+    echo "FAIL: --run --memoize fib 90: \"$got\""
+    exit 1
+fi
+./mc -O2 --memoize test/test5.mc > /dev/null 2>&1 || exit 1
+$CXX -DMC_FUNC=fib test/aot_main.cpp output.o -o test/aot_main || exit 1
+got=$(timeout 10 ./test/aot_main 50)
+if [ "$got" != "Call fib with 50: 12586269025" ]; then
+    echo "FAIL: -O2 --memoize fib 50: \"$got\""
+    exit 1
+fi
+$CXX -pthread test/memoize_main.cpp output.o -o test/memoize_main || exit 1
+./test/memoize_main | grep -qx OK || { echo "FAIL: memoize_main"; exit 1; }
+echo "memoize_test: OK"
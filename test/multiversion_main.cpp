@@ -0,0 +1,33 @@
+// ./mc --multiversion test/test5.mc で作ったoutput.oとリンクして、
+// ifuncのresolverがこのマシンで実行できるクローンを選んでいるかを確認する。
+#include <iostream>
+
+extern "C" {
+    typedef long (*fib_t)(long);
+    long fib(long);
+    long fib_default(long) __asm__("fib.default");
+    long fib_avx2(long) __asm__("fib.avx2");
+    long fib_avx512(long) __asm__("fib.avx512");
+    fib_t fib_resolver(void) __asm__("fib.resolver");
+}
+
+int main() {
+    fib_t expected = fib_default;
+    bool avx2 = __builtin_cpu_supports("avx") && __builtin_cpu_supports("avx2") &&
+        __builtin_cpu_supports("fma");
+    if (avx2 && __builtin_cpu_supports("avx512f"))
+        expected = fib_avx512;
+    else if (avx2)
+        expected = fib_avx2;
+
+    if (fib_resolver() != expected) {
+        std::cout << "resolver picked the wrong clone" << std::endl;
+        return 1;
+    }
+    if (fib(10) != 55) {
+        std::cout << "fib(10) returned " << fib(10) << std::endl;
+        return 1;
+    }
+    std::cout << "Call fib with 10: " << fib(10) << std::endl;
+    return 0;
+}
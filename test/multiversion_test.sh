@@ -0,0 +1,20 @@
+#!/bin/sh
+# --multiversionで作ったoutput.oをC++とリンクし、resolverがこのマシンで実行できるクローンを選ぶかと、
+# -mcpu=nativeでもdefault版がgenericのCPUと機能で作られるかを確かめる。
+# usage: CXX=clang++ sh test/multiversion_test.sh
+CXX=${CXX:-clang++}
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+./mc --multiversion test/test5.mc > /dev/null || exit 1
+$CXX test/multiversion_main.cpp output.o -o test/multiversion_main || exit 1
+./test/multiversion_main > /dev/null || { echo "FAIL: multiversion_main"; exit 1; }
+
+./mc --multiversion -mcpu=native --emit=bc -o $dir/mv.bc test/test5.mc > /dev/null || exit 1
+`llvm-config --bindir`/llvm-dis $dir/mv.bc -o - \
+    | awk '/^define .*@fib.default\(/ { g = $(NF - 1) } $1 == "attributes" && $2 == g' \
+    | grep -q '"target-cpu"="x86-64" "target-features" }' || {
+    echo "FAIL: fib.default is not built for the generic CPU"
+    exit 1
+}
+echo "multiversion_test: OK"
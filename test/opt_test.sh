@@ -0,0 +1,25 @@
+#!/bin/sh
+# -O1から-O3で最適化したモジュールが--print-after-optでstderrに出力され、そのoutput.oが
+# 正しく動くかを確かめる。
+# usage: CXX=clang++ sh test/opt_test.sh
+CXX=${CXX:-clang++}
+
+# -O0はモジュール単位のパイプラインをかけないので、関数の属性が推論されない。
+if ./mc -O0 --print-after-opt test/test5.mc 2>&1 > /dev/null | grep -q readnone; then
+    echo "FAIL: -O0 --print-after-opt printed an optimized module"
+    exit 1
+fi
+for O in 1 2 3; do
+    ./mc -O$O --print-after-opt test/test5.mc 2>&1 > /dev/null \
+        | grep -q "^attributes #0 = { nofree nosync nounwind readnone }" || {
+        echo "FAIL: -O$O --print-after-opt"
+        exit 1
+    }
+    $CXX -DMC_FUNC=fib test/aot_main.cpp output.o -o test/aot_main || exit 1
+    got=$(./test/aot_main 30)
+    if [ "$got" != "Call fib with 30: 832040" ]; then
+        echo "FAIL: -O$O: \"$got\""
+        exit 1
+    fi
+done
+echo "opt_test: OK"
@@ -0,0 +1,44 @@
+#!/bin/sh
+# ./mc -j Nで分割して出力したoutput.oが、直列(-j 1)の場合と同じ結果になるかを確かめる。
+# 分割した部分の一時ファイルが、出力できなかった場合も含めて残らないことも確かめる。
+# usage: CXX=clang++ sh test/parallel_test.sh
+CXX=${CXX:-clang++}
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+run() {
+    ./mc "$@" test/parallel.mc > /dev/null 2>&1 || exit 1
+    $CXX -DMC_FUNC=mix test/aot_main.cpp output.o -o test/aot_main || exit 1
+    ./test/aot_main 5 7
+}
+
+expected=$(run -j 1)
+if [ "$expected" != "Call mix with 5 7: 66" ]; then
+    echo "FAIL: -j 1: $expected"
+    exit 1
+fi
+for opt in -O0 -O2; do
+    for j in 2 3 8; do
+        got=$(run $opt -j $j)
+        if [ "$got" != "$expected" ]; then
+            echo "FAIL: $opt -j $j: \"$got\" != \"$expected\""
+            exit 1
+        fi
+    done
+done
+# ifuncとクローンが別々の部分に分かれてもリンクできること
+./mc --multiversion -j 3 test/test5.mc > /dev/null 2>&1 || exit 1
+$CXX test/multiversion_main.cpp output.o -o test/multiversion_main || exit 1
+./test/multiversion_main > /dev/null || exit 1
+# 部分の一時ファイルはTMPDIRに作り、-oの出力先に書けなくても消す。
+repo=$(pwd)
+mkdir $dir/tmp $dir/cwd
+(cd $dir/cwd && TMPDIR=$dir/tmp $repo/mc -j 2 -o $dir/out.o $repo/test/parallel.mc > /dev/null) &&
+    [ -f $dir/out.o ] || { echo "FAIL: -j 2 -o $dir/out.o"; exit 1; }
+(cd $dir/cwd && TMPDIR=$dir/tmp $repo/mc -j 2 -o $dir/no/such/dir/x.o $repo/test/parallel.mc \
+    > /dev/null 2>&1)
+if [ -n "$(find $dir/tmp $dir/cwd -type f)" ]; then
+    echo "FAIL: -j 2 left part files behind:" $(find $dir/tmp $dir/cwd -type f)
+    exit 1
+fi
+echo "parallel_test: OK"
@@ -0,0 +1,39 @@
+#!/bin/sh
+# --profile-generateで作ったプログラムの結果とプロファイルの回数を確かめ、
+# --profile-useでentry countとbranch weightsが付くかを確かめる。
+# usage: CXX=clang++ sh test/pgo_test.sh
+CXX=${CXX:-clang++}
+PROF=test/pgo.mcprof
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+rm -f $PROF
+./mc --profile-generate=$PROF test/pgo.mc > /dev/null 2>&1 || fail "--profile-generate"
+$CXX -DMC_FUNC=count test/aot_main.cpp output.o -o test/aot_main || exit 1
+./test/aot_main 10 | grep -qx "Call count with 10: 48" || fail "instrumented count 10"
+# pickは10回呼ばれ、x < 0は3回true、7回false。countのループの条件は10回true、1回false。
+grep -q "^pick [0-9]* 10 3 7$" $PROF || fail "pick profile: $(cat $PROF)"
+grep -q "^count [0-9]* 1 10 1$" $PROF || fail "count profile: $(cat $PROF)"
+
+# --runでも実行後にプロファイルを書き出し、二回分の回数は足し合わされる。
+# pickはcountにインライン展開されるので、countのentry countとpickの分岐の重みを見る。
+./mc --run --profile-generate=$PROF test/pgo.mc --call count 10 > /dev/null 2>&1 \
+    || fail "--run --profile-generate"
+./mc -O2 --profile-use=$PROF --print-after-opt test/pgo.mc > test/pgo_out.txt 2>&1 \
+    || fail "--profile-use"
+grep -q '!"function_entry_count", i64 2}' test/pgo_out.txt || fail "entry count"
+grep -q '!"branch_weights", i32 6, i32 14}' test/pgo_out.txt || fail "branch weights"
+grep -q '!"ProfileSummary"' test/pgo_out.txt || fail "profile summary"
+$CXX -DMC_FUNC=count test/aot_main.cpp output.o -o test/aot_main || exit 1
+./test/aot_main 100 | grep -qx "Call count with 100: 9318" || fail "optimized count 100"
+
+# 分岐が増えるなど、形が変わった関数のプロファイルは使わない。
+sed 's/else x \* 2/else if x < 5 then x else x * 2/' test/pgo.mc > test/pgo_changed.mc
+./mc --profile-use=$PROF test/pgo_changed.mc 2>&1 \
+    | grep -q "warning: profile for pick does not match the source; ignored" \
+    || fail "mismatched profile"
+rm -f $PROF test/pgo_out.txt test/pgo_changed.mc
+echo "pgo_test: OK"
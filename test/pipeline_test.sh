@@ -0,0 +1,67 @@
+#!/bin/sh
+# ./mc --pipelineでパースと並行にcodegenしたoutput.oが、直列の場合と同じ結果になるかと、
+# 後で定義される関数の呼び出しが直列の場合と同じくエラーになるかを確かめる。
+# ワーカーの一時ファイルが、失敗した場合も含めて残らないことも確かめる。
+# usage: CXX=clang++ sh test/pipeline_test.sh
+CXX=${CXX:-clang++}
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+# run func file args... - fileを./mcでコンパイルし、func(args)を呼んだ結果を出力する。
+run() {
+    func=$1; file=$2; shift 2
+    ./mc $opts $file > /dev/null 2>&1 || exit 1
+    $CXX -DMC_FUNC=$func test/aot_main.cpp output.o -o test/aot_main || exit 1
+    ./test/aot_main "$@"
+}
+
+opts=""
+expected_mix=$(run mix test/parallel.mc 5 7)
+expected_table=$(run table test/consteval.mc 2)
+for opt in -O0 -O2; do
+    for j in 1 2 3 8; do
+        opts="--pipeline $opt -j $j"
+        got=$(run mix test/parallel.mc 5 7)
+        if [ "$got" != "$expected_mix" ]; then
+            echo "FAIL: $opts: \"$got\" != \"$expected_mix\""
+            exit 1
+        fi
+        got=$(run table test/consteval.mc 2)
+        if [ "$got" != "$expected_table" ]; then
+            echo "FAIL: $opts: \"$got\" != \"$expected_table\""
+            exit 1
+        fi
+    done
+done
+
+# fはgより前に定義されているので、別のワーカーがgをcodegenしていても呼べない。
+cat > $dir/order.mc <<'MC'
+def f(x) g(x)
+def g(x) x + 1
+def h(x) g(x) * 2
+MC
+./mc $dir/order.mc 2>&1 | grep "^Error" > $dir/serial.txt
+./mc --pipeline -j 2 $dir/order.mc 2>&1 | grep "^Error" > $dir/pipeline.txt
+if ! cmp -s $dir/serial.txt $dir/pipeline.txt || [ ! -s $dir/serial.txt ]; then
+    echo "FAIL: errors differ from the serial compile"
+    exit 1
+fi
+opts="--pipeline -j 2"
+got=$(run h $dir/order.mc 4)
+if [ "$got" != "Call h with 4: 10" ]; then
+    echo "FAIL: $opts h: \"$got\""
+    exit 1
+fi
+
+# ワーカーのオブジェクトファイルはTMPDIRに作り、codegenのエラーやldの失敗でも消す。
+repo=$(pwd)
+mkdir $dir/tmp $dir/cwd
+echo "def f(x) y" > $dir/bad.mc
+(cd $dir/cwd && TMPDIR=$dir/tmp $repo/mc --pipeline -j 2 -o $dir/bad.o $dir/bad.mc > /dev/null 2>&1)
+(cd $dir/cwd && TMPDIR=$dir/tmp $repo/mc --pipeline -j 2 -o $dir/no/such/dir/x.o \
+    $repo/test/parallel.mc > /dev/null 2>&1)
+if [ -n "$(find $dir/tmp $dir/cwd -type f)" ]; then
+    echo "FAIL: --pipeline left part files behind:" $(find $dir/tmp $dir/cwd -type f)
+    exit 1
+fi
+echo "pipeline_test: OK"
@@ -0,0 +1,76 @@
+#!/bin/sh
+# ./mc --serveを起動し、./mccでコンパイルした結果(出力ファイル、stdout/stderr、終了コード)が
+# ./mcを直接実行した場合と同じになるかを確かめる。リクエストごとにオプションを変えて、
+# 前のリクエストの状態(最適化レベル、CPU、キャッシュ等)が残らないことも確かめる。
+# usage: sh test/serve_test.sh
+dir=$(mktemp -d)
+sock=$dir/mc.sock
+./mc --serve --socket=$sock > $dir/server.log 2>&1 &
+server=$!
+trap 'kill $server 2>/dev/null; rm -rf $dir' EXIT
+for i in $(seq 100); do
+    [ -S $sock ] && break
+    sleep 0.1
+done
+[ -S $sock ] || { echo "FAIL: server did not start"; cat $dir/server.log; exit 1; }
+
+# same args... - ./mcと./mccで同じargsを実行し、結果を比べる。出力先は-o $dir/outにする。
+same() {
+    rm -f $dir/out
+    ./mc "$@" > $dir/cli.txt 2>&1 < ${STDIN:-/dev/null}
+    echo "exit $?" >> $dir/cli.txt
+    [ -f $dir/out ] && mv $dir/out $dir/cli.out
+    ./mcc --socket=$sock "$@" > $dir/srv.txt 2>&1 < ${STDIN:-/dev/null}
+    echo "exit $?" >> $dir/srv.txt
+    [ -f $dir/out ] && mv $dir/out $dir/srv.out
+    if ! diff $dir/cli.txt $dir/srv.txt > /dev/null ||
+            { [ -f $dir/cli.out ] && ! cmp -s $dir/cli.out $dir/srv.out; }; then
+        echo "FAIL: $*"
+        diff $dir/cli.txt $dir/srv.txt
+        exit 1
+    fi
+    rm -f $dir/cli.out $dir/srv.out
+}
+
+same -o $dir/out test/test1.mc
+same --emit=ll -o - test/test4.mc
+same -O2 -o $dir/out test/test5.mc
+same -O0 --emit=asm -o $dir/out test/loop.mc
+same -O3 -mcpu=native --emit=asm -o $dir/out test/loop.mc
+same -O1 -mattr=+avx2 --emit=asm -o $dir/out test/consteval.mc
+same --emit=asm -o $dir/out test/consteval.mc
+same -O2 --emit=bc -o $dir/out test/array.mc
+same --memoize --emit=ll -o - test/test5.mc
+same --flat-ast --emit=ll -o - test/test4.mc
+same -j 2 -O2 -o $dir/out test/parallel.mc
+STDIN=test/test5.mc same --emit=ll -o - -
+same --run test/test5.mc --call fib 10
+same --vm test/test5.mc --call fib 10
+# エラー
+same test/no_such_file.mc
+same --bogus test/test1.mc
+echo "def f(x) x +" > $dir/bad.mc
+same --emit=ll -o - $dir/bad.mc
+# --cache-dirの統計はリクエストごとに始まり、次のリクエストには残らない。
+for side in cli srv; do
+    mc=./mc
+    [ $side = srv ] && mc="./mcc --socket=$sock"
+    for i in 1 2; do
+        $mc --cache-dir=$dir/cache-$side --cache-stats -O2 -o $dir/$side.o test/parallel.mc \
+            > /dev/null 2> $dir/$side.cache$i
+    done
+done
+for i in 1 2; do
+    diff $dir/cli.cache$i $dir/srv.cache$i || { echo "FAIL: --cache-stats run $i"; exit 1; }
+done
+same --cache-stats -O2 -o $dir/out test/parallel.mc
+
+# 相対パスはクライアントのカレントディレクトリから解決する。
+repo=$(pwd)
+(cd $dir && $repo/mcc --socket=$sock $repo/test/test1.mc > /dev/null) && [ -f $dir/output.o ] || {
+    echo "FAIL: output.o was not written to the client's directory"
+    exit 1
+}
+
+kill -0 $server || { echo "FAIL: server exited"; exit 1; }
+echo "serve_test: OK"
@@ -0,0 +1,9 @@
+#!/bin/sh
+# -time-phasesがフェーズごとの時間をstderrに、-stats=jsonが関数ごとの統計をstdoutに出力するかを確かめる。
+# usage: sh test/stats_test.sh
+
+./mc -time-phases test/test5.mc 2>&1 | grep -q "^ *[0-9.]* *[0-9.]*  codegen$" ||
+    { echo "FAIL: -time-phases"; exit 1; }
+./mc -O2 -stats=json test/test5.mc 2> /dev/null | grep -q '"name": "fib"' ||
+    { echo "FAIL: -stats=json"; exit 1; }
+echo "stats_test: OK"
@@ -0,0 +1,23 @@
+#!/bin/sh
+# test/tre.mcの深さ10^7の再帰が、-O0でも--memoizeでもループになってスタックが溢れないかを確かめる。
+# usage: CXX=clang++ sh test/tre_test.sh
+CXX=${CXX:-clang++}
+
+for opts in -O0 "-O0 --memoize"; do
+    got=$(./mc --run $opts test/tre.mc --call sum 10000000 2> /dev/null)
+    if [ "$got" != "Call sum with 10000000: 50000005000000" ]; then
+        echo "FAIL: --run $opts sum: \"$got\""
+        exit 1
+    fi
+    ./mc $opts test/tre.mc > /dev/null 2>&1 || exit 1
+    for check in "pow3 385609709189952001" "down 20000007"; do
+        set -- $check
+        $CXX -DMC_FUNC=$1 test/aot_main.cpp output.o -o test/aot_main || exit 1
+        got=$(./test/aot_main 10000000)
+        if [ "$got" != "Call $1 with 10000000: $2" ]; then
+            echo "FAIL: $opts $1: \"$got\""
+            exit 1
+        fi
+    done
+done
+echo "tre_test: OK"
@@ -0,0 +1,25 @@
+#!/bin/sh
+# ./mc --vmの結果が、output.oをリンクして実行した結果(AOT)と一致するかを確かめる。
+# usage: CXX=clang++ sh test/vm_test.sh
+CXX=${CXX:-clang++}
+
+check() {
+    file=$1; func=$2; shift 2
+    ./mc test/$file.mc > /dev/null 2>&1 || exit 1
+    $CXX -DMC_FUNC=$func test/aot_main.cpp output.o -o test/aot_main || exit 1
+    aot=$(./test/aot_main "$@")
+    vm=$(./mc --vm test/$file.mc --call $func "$@")
+    if [ "$aot" != "$vm" ]; then
+        echo "FAIL: $file.mc $func $*: aot=\"$aot\" vm=\"$vm\""
+        exit 1
+    fi
+}
+
+check test1 myfunc 3 2
+check test1 myfunc 2 3
+check test4 myfunc 3 2
+check test4 myfunc 2 3
+for n in 1 2 3 10 20; do
+    check test5 fib $n
+done
+echo "vm_test: OK"